@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "hash.h"
+
+
+/* Blocked Bloom filter.
+ *
+ * The high half of a key's hash picks a block; the low half is multiplied by
+ * a different odd salt per word to pick one bit in each of the block's words.
+ * A lookup therefore touches exactly one cache line, and the per-word loops
+ * have no data dependencies between lanes so the compiler can vectorize them. */
+
+static const uint32_t bloom_salts[BLOOM_BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+
+static uint64_t* bloom_block(bloom_t *bloom, uint64_t hash)
+{
+    // Maps the high 32 bits onto [0, num_blocks) without a division.
+    size_t block = ((hash >> 32) * bloom->num_blocks) >> 32;
+    return &bloom->blocks[block * BLOOM_BLOCK_WORDS];
+}
+
+static void bloom_mask(uint64_t hash, uint64_t mask[BLOOM_BLOCK_WORDS])
+{
+    uint32_t low = (uint32_t)hash;
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        mask[i] = 1ULL << ((uint32_t)(low * bloom_salts[i]) >> 26);
+}
+
+bloom_t* bloom_init(size_t expected_keys, size_t bits_per_key)
+{
+    if (bits_per_key == 0) {
+        printf("Cannot initialize bloom filter with 0 bits per key\n");
+        return NULL;
+    }
+    bloom_t *bloom = (bloom_t*)malloc(sizeof(bloom_t));
+    if (bloom == NULL) {
+        printf("Failed to allocate bloom_t\n");
+        return NULL;
+    }
+    size_t block_bits = BLOOM_BLOCK_WORDS * 64;
+    bloom->num_blocks = (expected_keys * bits_per_key + block_bits - 1) / block_bits;
+    if (bloom->num_blocks == 0)
+        bloom->num_blocks = 1;
+
+    size_t size = bloom->num_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+    bloom->blocks = (uint64_t*)aligned_alloc(64, size);
+    if (bloom->blocks == NULL) {
+        printf("Failed to allocate %zu bloom filter blocks\n", bloom->num_blocks);
+        free(bloom);
+        return NULL;
+    }
+    memset(bloom->blocks, 0, size);
+    return bloom;
+}
+
+void bloom_add(bloom_t *bloom, const char *key, size_t len)
+{
+    uint64_t hash = hash_bytes(key, len);
+    uint64_t *block = bloom_block(bloom, hash);
+    uint64_t mask[BLOOM_BLOCK_WORDS];
+    bloom_mask(hash, mask);
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        block[i] |= mask[i];
+}
+
+int bloom_may_contain(bloom_t *bloom, const char *key, size_t len)
+{
+    uint64_t hash = hash_bytes(key, len);
+    uint64_t *block = bloom_block(bloom, hash);
+    uint64_t mask[BLOOM_BLOCK_WORDS];
+    bloom_mask(hash, mask);
+    uint64_t missing = 0;
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        missing |= mask[i] & ~block[i];
+    return missing == 0;
+}
+
+void bloom_free(bloom_t *bloom)
+{
+    if (bloom == NULL) {
+        printf("Warning: tried to free NULL bloom_t*\n");
+        return;
+    }
+    free(bloom->blocks);
+    free(bloom);
+}
@@ -0,0 +1,24 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One block is a single 64-byte cache line of BLOOM_BLOCK_WORDS words, and
+// every key sets one bit in each word of its block.
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_BITS_PER_KEY 10
+
+struct bloom {
+    size_t num_blocks;
+    uint64_t *blocks;
+};
+
+typedef struct bloom bloom_t;
+
+bloom_t* bloom_init(size_t expected_keys, size_t bits_per_key);
+void bloom_add(bloom_t *bloom, const char *key, size_t len);
+int bloom_may_contain(bloom_t *bloom, const char *key, size_t len);
+void bloom_free(bloom_t *bloom);
+
+#endif
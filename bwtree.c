@@ -0,0 +1,719 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bwtree.h"
+
+
+/* Bw-tree.
+ *
+ * Each node is a chain of delta records in front of an immutable base page,
+ * reached through the node's entry in the mapping table. Writers never
+ * change a record in place: they prepend a delta and publish it with a
+ * compare-and-swap on the mapping entry, retrying if another writer got there
+ * first. Whoever makes a chain BWTREE_CONSOLIDATE_LENGTH long folds it into a
+ * new base page, splitting the node if it no longer fits.
+ *
+ * A split publishes the left half with a high key and a side link to the new
+ * right half, so readers stay correct before the parent knows about it (as in
+ * a B-link tree). The splitter then posts an index entry delta to the parent,
+ * and any traversal that has to follow a side link tries again for it.
+ *
+ * Unlinked chains are retired with the epoch they were unlinked at and freed
+ * once every thread in an operation entered after that. */
+
+// Threads start probing for an epoch slot at the one they last held.
+static size_t bwtree_threads = 0;
+static __thread size_t bwtree_thread_hint = PAGE_INDEX_NONE;
+
+
+static int bwtree_compare(bwtree_t *tree, const char *a, const char *b)
+{
+    return memcmp(a, b, tree->key_size);
+}
+
+static size_t* base_children(bwtree_base_t *base)
+{
+    return (size_t*)base->data;
+}
+
+static char* base_high(bwtree_t *tree, bwtree_base_t *base)
+{
+    if (base->level == 0)
+        return base->data;
+    return base->data + (tree->internal_capacity + 1) * sizeof(size_t);
+}
+
+static char* base_key(bwtree_t *tree, bwtree_base_t *base, size_t i)
+{
+    return base_high(tree, base) + (i + 1) * tree->key_size;
+}
+
+static char* base_value(bwtree_t *tree, bwtree_base_t *base, size_t i)
+{
+    return base->data + (tree->leaf_capacity + 1) * tree->key_size + i * tree->data_size;
+}
+
+static int base_above_high(bwtree_t *tree, bwtree_base_t *base, char *key)
+{
+    return base->sibling != PAGE_INDEX_NONE && bwtree_compare(tree, key, base_high(tree, base)) >= 0;
+}
+
+static bwtree_base_t* chain_base(bwtree_record_t *record)
+{
+    if (record->type == BWTREE_BASE)
+        return (bwtree_base_t*)record;
+    return ((bwtree_delta_t*)record)->base;
+}
+
+static bwtree_record_t* bwtree_head(bwtree_t *tree, size_t node)
+{
+    return __atomic_load_n(&tree->mapping[node], __ATOMIC_ACQUIRE);
+}
+
+static int bwtree_publish(bwtree_t *tree, size_t node, bwtree_record_t *head, bwtree_record_t *record)
+{
+    return __atomic_compare_exchange_n(&tree->mapping[node], &head, record, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+
+static int bwtree_stack_init(bwtree_stack_t *stack, size_t len)
+{
+    stack->head = 0;
+    stack->next = (size_t*)calloc(len, sizeof(size_t));
+    return stack->next == NULL ? -1 : 0;
+}
+
+static void bwtree_stack_push(bwtree_stack_t *stack, size_t index)
+{
+    uint64_t head = __atomic_load_n(&stack->head, __ATOMIC_ACQUIRE);
+    uint64_t top;
+    do {
+        __atomic_store_n(&stack->next[index], head & 0xffffffffU, __ATOMIC_RELAXED);
+        top = (((head >> 32) + 1) << 32) | (index + 1);
+    } while (!__atomic_compare_exchange_n(&stack->head, &head, top, 0,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+static size_t bwtree_stack_pop(bwtree_stack_t *stack)
+{
+    uint64_t head = __atomic_load_n(&stack->head, __ATOMIC_ACQUIRE);
+    for (;;) {
+        if ((head & 0xffffffffU) == 0)
+            return PAGE_INDEX_NONE;
+        size_t index = (head & 0xffffffffU) - 1;
+        uint64_t next = __atomic_load_n(&stack->next[index], __ATOMIC_RELAXED);
+        uint64_t top = (((head >> 32) + 1) << 32) | next;
+        if (__atomic_compare_exchange_n(&stack->head, &head, top, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            return index;
+    }
+}
+
+
+static size_t bwtree_enter(bwtree_t *tree)
+{
+    if (bwtree_thread_hint == PAGE_INDEX_NONE)
+        bwtree_thread_hint = __atomic_fetch_add(&bwtree_threads, 1, __ATOMIC_RELAXED) % BWTREE_MAX_THREADS;
+    size_t slot = bwtree_thread_hint;
+    for (size_t tries = 1;; tries++) {
+        size_t epoch = __atomic_load_n(&tree->epoch, __ATOMIC_SEQ_CST);
+        size_t idle = 0;
+        if (__atomic_compare_exchange_n(&tree->slots[slot].epoch, &idle, epoch, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            bwtree_thread_hint = slot;
+            return slot;
+        }
+        slot = (slot + 1) % BWTREE_MAX_THREADS;
+        if (tries % BWTREE_MAX_THREADS == 0)
+            sched_yield();
+    }
+}
+
+static void bwtree_exit(bwtree_t *tree, size_t slot)
+{
+    __atomic_store_n(&tree->slots[slot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+static void bwtree_free_chain(bwtree_t *tree, bwtree_record_t *record)
+{
+    while (record->type != BWTREE_BASE) {
+        bwtree_delta_t *delta = (bwtree_delta_t*)record;
+        record = delta->next;
+        free(delta);
+    }
+    bwtree_stack_push(&tree->free_pages, ((bwtree_base_t*)record)->page);
+}
+
+static void bwtree_reclaim(bwtree_t *tree)
+{
+    size_t oldest = __atomic_load_n(&tree->epoch, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < BWTREE_MAX_THREADS; i++) {
+        size_t epoch = __atomic_load_n(&tree->slots[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    // Taking the whole list makes it ours; whatever is still in use goes back.
+    bwtree_garbage_t *garbage = __atomic_exchange_n(&tree->garbage, NULL, __ATOMIC_ACQUIRE);
+    bwtree_garbage_t *kept = NULL, *last = NULL;
+    while (garbage != NULL) {
+        bwtree_garbage_t *next = garbage->next;
+        if (garbage->epoch < oldest) {
+            bwtree_free_chain(tree, garbage->chain);
+            free(garbage);
+        } else {
+            garbage->next = kept;
+            kept = garbage;
+            if (last == NULL)
+                last = garbage;
+        }
+        garbage = next;
+    }
+    if (kept == NULL)
+        return;
+    last->next = __atomic_load_n(&tree->garbage, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&tree->garbage, &last->next, kept, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+}
+
+static void bwtree_retire(bwtree_t *tree, bwtree_record_t *chain)
+{
+    bwtree_garbage_t *garbage = (bwtree_garbage_t*)malloc(sizeof(bwtree_garbage_t));
+    if (garbage == NULL) {
+        printf("Failed to retire bw-tree chain, leaking it\n");
+        return;
+    }
+    garbage->chain = chain;
+    garbage->epoch = __atomic_fetch_add(&tree->epoch, 1, __ATOMIC_SEQ_CST);
+    garbage->next = __atomic_load_n(&tree->garbage, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&tree->garbage, &garbage->next, garbage, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+    if (__atomic_add_fetch(&tree->retired, 1, __ATOMIC_RELAXED) % BWTREE_RECLAIM_INTERVAL == 0)
+        bwtree_reclaim(tree);
+}
+
+
+static bwtree_base_t* bwtree_new_base(bwtree_t *tree, size_t level)
+{
+    page_t *page;
+    size_t index = bwtree_stack_pop(&tree->free_pages);
+    if (index != PAGE_INDEX_NONE) {
+        page = tree->pool->pages[index];
+    } else {
+        pthread_mutex_lock(&tree->pool_lock);
+        page = page_pool_create_page(tree->pool, &index);
+        pthread_mutex_unlock(&tree->pool_lock);
+        if (page == NULL)
+            return NULL;
+    }
+    bwtree_base_t *base = (bwtree_base_t*)page->data;
+    base->header.type = BWTREE_BASE;
+    base->header.length = 0;
+    base->page = index;
+    base->level = level;
+    base->num_keys = 0;
+    base->sibling = PAGE_INDEX_NONE;
+    return base;
+}
+
+static size_t bwtree_new_node(bwtree_t *tree, bwtree_base_t *base)
+{
+    size_t node = bwtree_stack_pop(&tree->free_nodes);
+    if (node == PAGE_INDEX_NONE) {
+        node = __atomic_fetch_add(&tree->next_node, 1, __ATOMIC_RELAXED);
+        if (node >= tree->pool->max_len) {
+            printf("Cannot allocate bw-tree node, mapping table is full\n");
+            return PAGE_INDEX_NONE;
+        }
+    }
+    __atomic_store_n(&tree->mapping[node], (bwtree_record_t*)base, __ATOMIC_RELEASE);
+    return node;
+}
+
+// Undoes bwtree_new_node for a node no other thread can have seen.
+static void bwtree_drop_node(bwtree_t *tree, size_t node)
+{
+    __atomic_store_n(&tree->mapping[node], NULL, __ATOMIC_RELAXED);
+    bwtree_stack_push(&tree->free_nodes, node);
+}
+
+static bwtree_delta_t* bwtree_new_delta(bwtree_t *tree, bwtree_record_type_t type, size_t payload)
+{
+    bwtree_delta_t *delta = (bwtree_delta_t*)malloc(sizeof(bwtree_delta_t) + payload);
+    if (delta == NULL) {
+        printf("Failed to allocate bw-tree delta\n");
+        return NULL;
+    }
+    delta->header.type = type;
+    delta->child = PAGE_INDEX_NONE;
+    delta->has_high = 0;
+    return delta;
+}
+
+
+bwtree_t* bwtree_allocate(page_pool_t *pool, size_t key_size, size_t data_size)
+{
+    if (pool == NULL) {
+        printf("Cannot allocate bw-tree without a page_pool\n");
+        return NULL;
+    }
+    if (pool->fd >= 0) {
+        printf("Cannot allocate bw-tree on a file-backed page_pool\n");
+        return NULL;
+    }
+    if (key_size == 0 || data_size == 0) {
+        printf("Cannot allocate bw-tree with key_size or data_size 0\n");
+        return NULL;
+    }
+    size_t space = PAGE_SIZE - sizeof(bwtree_base_t) - key_size;
+    size_t leaf_capacity = space / (key_size + data_size);
+    size_t internal_capacity = (space - sizeof(size_t)) / (key_size + sizeof(size_t));
+    if (leaf_capacity < 2 || internal_capacity < 2) {
+        printf("Cannot allocate bw-tree, keys and data are too large for a page\n");
+        return NULL;
+    }
+
+    bwtree_t *tree = (bwtree_t*)malloc(sizeof(bwtree_t));
+    if (tree == NULL) {
+        printf("Failed to allocate bwtree_t\n");
+        return NULL;
+    }
+    tree->key_size = key_size;
+    tree->data_size = data_size;
+    tree->leaf_capacity = leaf_capacity;
+    tree->internal_capacity = internal_capacity;
+    tree->num_keys = 0;
+    tree->consolidations = 0;
+    tree->splits = 0;
+    tree->next_node = 0;
+    tree->pool = pool;
+    // Epoch 0 marks an idle slot.
+    tree->epoch = 1;
+    tree->garbage = NULL;
+    tree->retired = 0;
+    tree->mapping = (bwtree_record_t**)calloc(pool->max_len, sizeof(bwtree_record_t*));
+    tree->slots = (bwtree_slot_t*)aligned_alloc(64, BWTREE_MAX_THREADS * sizeof(bwtree_slot_t));
+    tree->free_nodes.next = NULL;
+    tree->free_pages.next = NULL;
+    if (tree->mapping == NULL || tree->slots == NULL ||
+        bwtree_stack_init(&tree->free_nodes, pool->max_len) != 0 ||
+        bwtree_stack_init(&tree->free_pages, pool->max_len) != 0) {
+        printf("Failed to allocate bw-tree mapping table\n");
+        free(tree->mapping);
+        free(tree->slots);
+        free(tree->free_nodes.next);
+        free(tree->free_pages.next);
+        free(tree);
+        return NULL;
+    }
+    memset(tree->slots, 0, BWTREE_MAX_THREADS * sizeof(bwtree_slot_t));
+    pthread_mutex_init(&tree->pool_lock, NULL);
+
+    bwtree_base_t *root = bwtree_new_base(tree, 0);
+    if (root == NULL) {
+        bwtree_free(tree);
+        return NULL;
+    }
+    tree->root = bwtree_new_node(tree, root);
+    return tree;
+}
+
+
+/* The data for key in a leaf chain known to cover it, or NULL. */
+static char* bwtree_leaf_find(bwtree_t *tree, bwtree_record_t *record, char *key)
+{
+    while (record->type != BWTREE_BASE) {
+        bwtree_delta_t *delta = (bwtree_delta_t*)record;
+        if (bwtree_compare(tree, delta->keys, key) == 0)
+            return record->type == BWTREE_DELTA_INSERT ? delta->keys + tree->key_size : NULL;
+        record = delta->next;
+    }
+    bwtree_base_t *base = (bwtree_base_t*)record;
+    size_t lo = 0, hi = base->num_keys;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = bwtree_compare(tree, base_key(tree, base, mid), key);
+        if (cmp == 0)
+            return base_value(tree, base, mid);
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/* The child of an internal chain known to cover key that key belongs under. */
+static size_t bwtree_internal_child(bwtree_t *tree, bwtree_record_t *record, char *key)
+{
+    while (record->type != BWTREE_BASE) {
+        bwtree_delta_t *delta = (bwtree_delta_t*)record;
+        if (bwtree_compare(tree, key, delta->keys) >= 0 &&
+            (!delta->has_high || bwtree_compare(tree, key, delta->keys + tree->key_size) < 0))
+            return delta->child;
+        record = delta->next;
+    }
+    bwtree_base_t *base = (bwtree_base_t*)record;
+    size_t lo = 0, hi = base->num_keys;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (bwtree_compare(tree, key, base_key(tree, base, mid)) < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return base_children(base)[lo];
+}
+
+
+static void bwtree_consolidate(bwtree_t *tree, size_t *path, size_t height, size_t node, bwtree_record_t *head);
+
+static void bwtree_grow_root(bwtree_t *tree, size_t left, bwtree_base_t *base)
+{
+    if (__atomic_load_n(&tree->root, __ATOMIC_ACQUIRE) != left)
+        return;
+    bwtree_base_t *root = bwtree_new_base(tree, base->level + 1);
+    if (root == NULL)
+        return;
+    root->num_keys = 1;
+    base_children(root)[0] = left;
+    base_children(root)[1] = base->sibling;
+    memcpy(base_key(tree, root, 0), base_high(tree, base), tree->key_size);
+
+    size_t node = bwtree_new_node(tree, root);
+    if (node == PAGE_INDEX_NONE) {
+        bwtree_stack_push(&tree->free_pages, root->page);
+        return;
+    }
+    if (!__atomic_compare_exchange_n(&tree->root, &left, node, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        bwtree_drop_node(tree, node);
+        bwtree_stack_push(&tree->free_pages, root->page);
+    }
+}
+
+/* Tells the parent of left about the right sibling its base links to, or
+ * grows the tree if left is the root. Gives up quietly if the parent changed
+ * under it: a later traversal will find the side link and try again. */
+static void bwtree_post_split(bwtree_t *tree, size_t *path, size_t height, size_t left, bwtree_base_t *base)
+{
+    if (base->level == height) {
+        bwtree_grow_root(tree, left, base);
+        return;
+    }
+    size_t parent = path[base->level + 1];
+    char *separator = base_high(tree, base);
+    bwtree_record_t *head = bwtree_head(tree, parent);
+    if (base_above_high(tree, chain_base(head), separator) ||
+        bwtree_internal_child(tree, head, separator) == base->sibling)
+        return;
+
+    bwtree_base_t *right = chain_base(bwtree_head(tree, base->sibling));
+    bwtree_delta_t *delta = bwtree_new_delta(tree, BWTREE_DELTA_INDEX, 2 * tree->key_size);
+    if (delta == NULL)
+        return;
+    delta->header.length = head->length + 1;
+    delta->next = head;
+    delta->base = chain_base(head);
+    delta->child = base->sibling;
+    memcpy(delta->keys, separator, tree->key_size);
+    if (right->sibling != PAGE_INDEX_NONE) {
+        delta->has_high = 1;
+        memcpy(delta->keys + tree->key_size, base_high(tree, right), tree->key_size);
+    }
+    if (!bwtree_publish(tree, parent, head, &delta->header)) {
+        free(delta);
+        return;
+    }
+    if (delta->header.length >= BWTREE_CONSOLIDATE_LENGTH)
+        bwtree_consolidate(tree, path, height, parent, &delta->header);
+}
+
+/* The chain of the node at or right of *node that covers key. */
+static bwtree_record_t* bwtree_move_right(bwtree_t *tree, size_t *path, size_t height, size_t *node, char *key)
+{
+    for (;;) {
+        bwtree_record_t *head = bwtree_head(tree, *node);
+        bwtree_base_t *base = chain_base(head);
+        if (!base_above_high(tree, base, key))
+            return head;
+        bwtree_post_split(tree, path, height, *node, base);
+        *node = base->sibling;
+    }
+}
+
+/* Descends to the leaf covering key, recording the node taken at each level
+ * in path. */
+static size_t bwtree_descend(bwtree_t *tree, char *key, size_t *path, size_t *height, bwtree_record_t **head)
+{
+    size_t node = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+    size_t level = chain_base(bwtree_head(tree, node))->level;
+    *height = level;
+    for (;;) {
+        *head = bwtree_move_right(tree, path, *height, &node, key);
+        path[level] = node;
+        if (level == 0)
+            return node;
+        node = bwtree_internal_child(tree, *head, key);
+        level--;
+    }
+}
+
+
+typedef struct {
+    char *key;
+    char *value;
+} bwtree_entry_t;
+
+/* Merges the deltas of a chain into its base's entries, in key order. For
+ * internal nodes the values are children, and the base's first child, which
+ * has no key, is left out. */
+static bwtree_entry_t* bwtree_collect(bwtree_t *tree, bwtree_record_t *head, size_t *count)
+{
+    bwtree_base_t *base = chain_base(head);
+    size_t max = base->num_keys + head->length;
+    bwtree_entry_t *entries = (bwtree_entry_t*)malloc(2 * max * sizeof(bwtree_entry_t) + 1);
+    if (entries == NULL) {
+        printf("Failed to consolidate bw-tree node\n");
+        return NULL;
+    }
+    bwtree_entry_t *deltas = entries + max;
+
+    // Newest first, so the first delta seen for a key is the one that counts.
+    size_t num_deltas = 0;
+    for (bwtree_record_t *record = head; record->type != BWTREE_BASE; ) {
+        bwtree_delta_t *delta = (bwtree_delta_t*)record;
+        record = delta->next;
+        size_t i = 0;
+        while (i < num_deltas && bwtree_compare(tree, deltas[i].key, delta->keys) != 0)
+            i++;
+        if (i < num_deltas)
+            continue;
+        // Insertion sort; chains are short.
+        while (i > 0 && bwtree_compare(tree, deltas[i - 1].key, delta->keys) > 0) {
+            deltas[i] = deltas[i - 1];
+            i--;
+        }
+        deltas[i].key = delta->keys;
+        if (delta->header.type == BWTREE_DELTA_INSERT)
+            deltas[i].value = delta->keys + tree->key_size;
+        else if (delta->header.type == BWTREE_DELTA_INDEX)
+            deltas[i].value = (char*)&delta->child;
+        else
+            deltas[i].value = NULL;
+        num_deltas++;
+    }
+
+    size_t n = 0, i = 0, j = 0;
+    while (i < base->num_keys || j < num_deltas) {
+        char *key = i < base->num_keys ? base_key(tree, base, i) : NULL;
+        if (key != NULL && (j == num_deltas || bwtree_compare(tree, key, deltas[j].key) < 0)) {
+            entries[n].key = key;
+            entries[n].value = base->level == 0 ? base_value(tree, base, i)
+                                                : (char*)&base_children(base)[i + 1];
+            n++;
+            i++;
+            continue;
+        }
+        if (key != NULL && bwtree_compare(tree, key, deltas[j].key) == 0)
+            i++;
+        if (deltas[j].value != NULL)
+            entries[n++] = deltas[j];
+        j++;
+    }
+    *count = n;
+    return entries;
+}
+
+/* Fills a new base from entries [start, end). Pieces after the first of an
+ * internal node take their first entry's child as their leftmost child, its
+ * key having moved up as the separator. */
+static void bwtree_fill(bwtree_t *tree, bwtree_base_t *base, bwtree_entry_t *entries, size_t start, size_t end, size_t first_child)
+{
+    if (base->level > 0) {
+        if (first_child == PAGE_INDEX_NONE)
+            memcpy(&first_child, entries[start++].value, sizeof(size_t));
+        base_children(base)[0] = first_child;
+    }
+    base->num_keys = end - start;
+    for (size_t i = 0; i < base->num_keys; i++) {
+        memcpy(base_key(tree, base, i), entries[start + i].key, tree->key_size);
+        if (base->level == 0)
+            memcpy(base_value(tree, base, i), entries[start + i].value, tree->data_size);
+        else
+            memcpy(&base_children(base)[i + 1], entries[start + i].value, sizeof(size_t));
+    }
+}
+
+static void bwtree_consolidate(bwtree_t *tree, size_t *path, size_t height, size_t node, bwtree_record_t *head)
+{
+    bwtree_base_t *old = chain_base(head);
+    size_t n;
+    bwtree_entry_t *entries = bwtree_collect(tree, head, &n);
+    if (entries == NULL)
+        return;
+
+    size_t capacity = old->level == 0 ? tree->leaf_capacity : tree->internal_capacity;
+    size_t pieces = n <= capacity ? 1 : (n + capacity - 1) / capacity;
+    bwtree_base_t **bases = (bwtree_base_t**)calloc(pieces, sizeof(bwtree_base_t*));
+    size_t *nodes = (size_t*)malloc(pieces * sizeof(size_t));
+    size_t made = 0;
+    if (bases == NULL || nodes == NULL) {
+        printf("Failed to consolidate bw-tree node\n");
+        goto done;
+    }
+    // Only the first piece replaces the node; the rest become new nodes to its
+    // right, reachable through the side links until their parent is told.
+    for (; made < pieces; made++) {
+        bases[made] = bwtree_new_base(tree, old->level);
+        if (bases[made] == NULL)
+            goto done;
+        nodes[made] = made == 0 ? node : bwtree_new_node(tree, bases[made]);
+        if (nodes[made] == PAGE_INDEX_NONE) {
+            bwtree_stack_push(&tree->free_pages, bases[made]->page);
+            goto done;
+        }
+    }
+    for (size_t i = 0; i < pieces; i++) {
+        size_t start = n * i / pieces, end = n * (i + 1) / pieces;
+        size_t first_child = PAGE_INDEX_NONE;
+        if (i == 0 && old->level > 0)
+            first_child = base_children(old)[0];
+        bwtree_fill(tree, bases[i], entries, start, end, first_child);
+        if (i + 1 < pieces) {
+            bases[i]->sibling = nodes[i + 1];
+            memcpy(base_high(tree, bases[i]), entries[end].key, tree->key_size);
+        } else if (old->sibling != PAGE_INDEX_NONE) {
+            bases[i]->sibling = old->sibling;
+            memcpy(base_high(tree, bases[i]), base_high(tree, old), tree->key_size);
+        }
+    }
+    if (!bwtree_publish(tree, node, head, &bases[0]->header))
+        goto done;
+
+    bwtree_retire(tree, head);
+    __atomic_add_fetch(&tree->consolidations, 1, __ATOMIC_RELAXED);
+    if (pieces > 1)
+        __atomic_add_fetch(&tree->splits, pieces - 1, __ATOMIC_RELAXED);
+    for (size_t i = 0; i + 1 < pieces; i++)
+        bwtree_post_split(tree, path, height, nodes[i], bases[i]);
+    made = 0;
+
+done:
+    // Nothing built here was published unless made was reset.
+    for (size_t i = 0; i < made; i++) {
+        if (i > 0)
+            bwtree_drop_node(tree, nodes[i]);
+        bwtree_stack_push(&tree->free_pages, bases[i]->page);
+    }
+    free(bases);
+    free(nodes);
+    free(entries);
+}
+
+
+void bwtree_insert(bwtree_t *tree, char *key, char *data)
+{
+    bwtree_delta_t *delta = bwtree_new_delta(tree, BWTREE_DELTA_INSERT, tree->key_size + tree->data_size);
+    if (delta == NULL) {
+        printf("Failed to insert into bw-tree\n");
+        return;
+    }
+    memcpy(delta->keys, key, tree->key_size);
+    memcpy(delta->keys + tree->key_size, data, tree->data_size);
+
+    size_t slot = bwtree_enter(tree);
+    size_t path[BWTREE_MAX_HEIGHT], height;
+    bwtree_record_t *head;
+    size_t node = bwtree_descend(tree, key, path, &height, &head);
+    char *found;
+    for (;;) {
+        found = bwtree_leaf_find(tree, head, key);
+        delta->header.length = head->length + 1;
+        delta->next = head;
+        delta->base = chain_base(head);
+        if (bwtree_publish(tree, node, head, &delta->header))
+            break;
+        head = bwtree_move_right(tree, path, height, &node, key);
+    }
+    if (found == NULL)
+        __atomic_add_fetch(&tree->num_keys, 1, __ATOMIC_RELAXED);
+    if (delta->header.length >= BWTREE_CONSOLIDATE_LENGTH)
+        bwtree_consolidate(tree, path, height, node, &delta->header);
+    bwtree_exit(tree, slot);
+}
+
+int bwtree_search(bwtree_t *tree, char *key, char *data)
+{
+    size_t slot = bwtree_enter(tree);
+    size_t path[BWTREE_MAX_HEIGHT], height;
+    bwtree_record_t *head;
+    bwtree_descend(tree, key, path, &height, &head);
+    char *found = bwtree_leaf_find(tree, head, key);
+    if (found != NULL)
+        memcpy(data, found, tree->data_size);
+    bwtree_exit(tree, slot);
+    return found == NULL ? -1 : 0;
+}
+
+int bwtree_delete(bwtree_t *tree, char *key)
+{
+    bwtree_delta_t *delta = bwtree_new_delta(tree, BWTREE_DELTA_DELETE, tree->key_size);
+    if (delta == NULL)
+        return -1;
+    memcpy(delta->keys, key, tree->key_size);
+
+    size_t slot = bwtree_enter(tree);
+    size_t path[BWTREE_MAX_HEIGHT], height;
+    bwtree_record_t *head;
+    size_t node = bwtree_descend(tree, key, path, &height, &head);
+    for (;;) {
+        if (bwtree_leaf_find(tree, head, key) == NULL) {
+            bwtree_exit(tree, slot);
+            free(delta);
+            return -1;
+        }
+        delta->header.length = head->length + 1;
+        delta->next = head;
+        delta->base = chain_base(head);
+        if (bwtree_publish(tree, node, head, &delta->header))
+            break;
+        head = bwtree_move_right(tree, path, height, &node, key);
+    }
+    __atomic_sub_fetch(&tree->num_keys, 1, __ATOMIC_RELAXED);
+    if (delta->header.length >= BWTREE_CONSOLIDATE_LENGTH)
+        bwtree_consolidate(tree, path, height, node, &delta->header);
+    bwtree_exit(tree, slot);
+    return 0;
+}
+
+
+void bwtree_free(bwtree_t *tree)
+{
+    if (tree == NULL) {
+        printf("Warning: tried to free NULL bwtree_t*\n");
+        return;
+    }
+    // Base pages belong to the pool and are freed with it.
+    size_t nodes = tree->next_node < tree->pool->max_len ? tree->next_node : tree->pool->max_len;
+    for (size_t node = 0; node < nodes; node++) {
+        if (tree->mapping[node] != NULL)
+            bwtree_free_chain(tree, tree->mapping[node]);
+    }
+    while (tree->garbage != NULL) {
+        bwtree_garbage_t *next = tree->garbage->next;
+        bwtree_free_chain(tree, tree->garbage->chain);
+        free(tree->garbage);
+        tree->garbage = next;
+    }
+    pthread_mutex_destroy(&tree->pool_lock);
+    free(tree->mapping);
+    free(tree->slots);
+    free(tree->free_nodes.next);
+    free(tree->free_pages.next);
+    free(tree);
+}
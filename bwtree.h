@@ -0,0 +1,118 @@
+#ifndef BWTREE_H
+#define BWTREE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "index.h"
+
+// Delta chains this long are folded into a new base page by the thread that
+// made them so.
+#define BWTREE_CONSOLIDATE_LENGTH 8
+// Threads that can be inside an operation at once; more wait for a slot.
+#define BWTREE_MAX_THREADS 64
+// Retired chains collected between attempts to free some of them.
+#define BWTREE_RECLAIM_INTERVAL 64
+#define BWTREE_MAX_HEIGHT 64
+
+typedef enum {
+    BWTREE_BASE,
+    BWTREE_DELTA_INSERT,
+    BWTREE_DELTA_DELETE,
+    BWTREE_DELTA_INDEX
+} bwtree_record_type_t;
+
+// Mapping table entries point at a chain of delta records ending in a base
+// page, and both start with this. length counts the deltas from here to the
+// base.
+typedef struct {
+    bwtree_record_type_t type;
+    size_t length;
+} bwtree_record_t;
+
+// Base pages are never changed once published. Keys at or above the high key
+// belong to the right sibling, which is PAGE_INDEX_NONE on the right edge
+// (where there is no high key). Leaves (level 0) hold the high key, the keys,
+// then the data; internal nodes hold num_keys + 1 children, the high key, then
+// the keys.
+typedef struct {
+    bwtree_record_t header;
+    size_t page;
+    size_t level;
+    size_t num_keys;
+    size_t sibling;
+    char data[];
+} bwtree_base_t;
+
+// An insert (key then data) or delete (key) in a leaf, or an index entry in
+// an internal node sending keys from key up to the high key after it to
+// child. Index entries at the right edge have no high key.
+typedef struct {
+    bwtree_record_t header;
+    bwtree_record_t *next;
+    // The base page at the end of the chain.
+    bwtree_base_t *base;
+    size_t child;
+    int has_high;
+    char keys[];
+} bwtree_delta_t;
+
+// Indices free for reuse: head holds the top index + 1 in its low half and a
+// count of changes in its high half, so a stale compare-and-swap fails.
+typedef struct {
+    uint64_t head;
+    size_t *next;
+} bwtree_stack_t;
+
+// The epoch a thread entered its current operation at, or 0 when idle. Each
+// is alone on its cache line.
+typedef struct {
+    size_t epoch;
+    char padding[64 - sizeof(size_t)];
+} bwtree_slot_t;
+
+// A chain unlinked from the mapping table, freed once no thread that entered
+// before it was retired is still running.
+typedef struct bwtree_garbage {
+    struct bwtree_garbage *next;
+    size_t epoch;
+    bwtree_record_t *chain;
+} bwtree_garbage_t;
+
+// A latch-free B-tree: updates prepend delta records to a node with one
+// compare-and-swap on its mapping table entry. Base pages come from the pool,
+// which must be in memory and not used by anything else at the same time.
+typedef struct {
+    size_t key_size;
+    size_t data_size;
+    size_t leaf_capacity;
+    size_t internal_capacity;
+    size_t num_keys;
+    size_t root;
+    size_t consolidations;
+    size_t splits;
+    // Chain heads by node id. Every node owns at least one page, so ids stay
+    // below the pool's max_len.
+    bwtree_record_t **mapping;
+    size_t next_node;
+    bwtree_stack_t free_nodes;
+    page_pool_t *pool;
+    // New pool pages are only created under this lock; released base pages
+    // are reused from free_pages without it.
+    pthread_mutex_t pool_lock;
+    bwtree_stack_t free_pages;
+    size_t epoch;
+    bwtree_slot_t *slots;
+    bwtree_garbage_t *garbage;
+    size_t retired;
+} bwtree_t;
+
+bwtree_t* bwtree_allocate(page_pool_t *pool, size_t key_size, size_t data_size);
+void bwtree_insert(bwtree_t *tree, char *key, char *data);
+// Copies the data for key out, since the record holding it may be freed as
+// soon as the call returns.
+int bwtree_search(bwtree_t *tree, char *key, char *data);
+int bwtree_delete(bwtree_t *tree, char *key);
+void bwtree_free(bwtree_t *tree);
+
+#endif
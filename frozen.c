@@ -0,0 +1,156 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "frozen.h"
+
+
+/* Frozen trees.
+ *
+ * Key k (counting from 1) has its children at 2k and 2k + 1, so the first
+ * levels of the search share a few cache lines and the rest are a fixed
+ * stride apart, which lets the search prefetch several levels ahead. There
+ * are no pointers and no slack: every slot holds a key. */
+
+// Copies sorted keys[from..] into the subtree rooted at k, in order, and
+// returns the next unused sorted position.
+static size_t frozen_fill(size_t k, size_t n, size_t from, size_t size,
+                          const char *sorted, char *out)
+{
+    if (k > n)
+        return from;
+    from = frozen_fill(2 * k, n, from, size, sorted, out);
+    memcpy(out + (k - 1) * size, sorted + from * size, size);
+    return frozen_fill(2 * k + 1, n, from + 1, size, sorted, out);
+}
+
+static int frozen_write_all(int fd, const char *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t written = pwrite(fd, buf, len, offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+int frozen_write(const char *path, size_t key_size, size_t data_size,
+                 size_t num_keys, const char *keys, const char *data)
+{
+    size_t keys_len = num_keys * key_size;
+    size_t data_len = num_keys * data_size;
+    // One allocation serves both arrays; +1 keeps malloc(0) out of the picture.
+    char *out = (char*)malloc(keys_len + data_len + 1);
+    if (out == NULL) {
+        printf("Failed to allocate frozen image of %zu keys\n", num_keys);
+        return -1;
+    }
+    frozen_fill(1, num_keys, 0, key_size, keys, out);
+    frozen_fill(1, num_keys, 0, data_size, data, out + keys_len);
+
+    char header[FROZEN_HEADER_SIZE] = {0};
+    frozen_header_t fields = {FROZEN_MAGIC, key_size, data_size, num_keys};
+    memcpy(header, &fields, sizeof(fields));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Cannot open frozen file %s: %s\n", path, strerror(errno));
+        free(out);
+        return -1;
+    }
+    int ret = 0;
+    if (frozen_write_all(fd, header, FROZEN_HEADER_SIZE, 0) != 0
+            || frozen_write_all(fd, out, keys_len + data_len, FROZEN_HEADER_SIZE) != 0
+            || fdatasync(fd) != 0) {
+        printf("Failed to write frozen file %s: %s\n", path, strerror(errno));
+        ret = -1;
+    }
+    close(fd);
+    free(out);
+    return ret;
+}
+
+frozen_t* frozen_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Cannot open frozen file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    frozen_header_t header;
+    if (fstat(fd, &st) != 0 || st.st_size < FROZEN_HEADER_SIZE
+            || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || header.magic != FROZEN_MAGIC
+            || header.key_size == 0
+            || st.st_size != FROZEN_HEADER_SIZE
+                             + header.num_keys * (header.key_size + header.data_size)) {
+        printf("File %s is not a frozen tree\n", path);
+        close(fd);
+        return NULL;
+    }
+    frozen_t *frozen = (frozen_t*)malloc(sizeof(frozen_t));
+    if (frozen == NULL) {
+        printf("Failed to allocate frozen_t\n");
+        close(fd);
+        return NULL;
+    }
+    frozen->map_size = st.st_size;
+    frozen->map = mmap(NULL, frozen->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file alive on its own.
+    close(fd);
+    if (frozen->map == MAP_FAILED) {
+        printf("Failed to map frozen file %s: %s\n", path, strerror(errno));
+        free(frozen);
+        return NULL;
+    }
+    frozen->key_size = header.key_size;
+    frozen->data_size = header.data_size;
+    frozen->num_keys = header.num_keys;
+    frozen->keys = (char*)frozen->map + FROZEN_HEADER_SIZE;
+    frozen->data = frozen->keys + frozen->num_keys * frozen->key_size;
+    return frozen;
+}
+
+void frozen_search(frozen_t *frozen, char *key, char **data)
+{
+    size_t n = frozen->num_keys;
+    size_t size = frozen->key_size;
+    size_t k = 1;
+    // Descend to a leaf, going right whenever the slot's key is smaller. The
+    // comparison feeds the index arithmetic rather than a branch, and the
+    // slot four levels down is fetched while this level is compared.
+    while (k <= n) {
+        __builtin_prefetch(frozen->keys + (16 * k - 1) * size);
+        k = 2 * k + (memcmp(frozen->keys + (k - 1) * size, key, size) < 0);
+    }
+    // Undo the right turns taken after the last left one: that left turn was
+    // at the smallest key not below the search key.
+    k >>= __builtin_ffsll(~(unsigned long long)k);
+    if (k == 0 || memcmp(frozen->keys + (k - 1) * size, key, size) != 0) {
+        *data = NULL;
+        return;
+    }
+    *data = frozen->data + (k - 1) * frozen->data_size;
+}
+
+void frozen_free(frozen_t *frozen)
+{
+    if (frozen == NULL) {
+        printf("Warning: tried to free NULL frozen_t*\n");
+        return;
+    }
+    munmap(frozen->map, frozen->map_size);
+    free(frozen);
+}
@@ -0,0 +1,39 @@
+#ifndef FROZEN_H
+#define FROZEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FROZEN_MAGIC 0x00315a52464c5143ULL // "CQLFRZ1" in little endian
+// The header is padded so the keys start on a cache line.
+#define FROZEN_HEADER_SIZE 64
+
+typedef struct {
+    uint64_t magic;
+    uint64_t key_size;
+    uint64_t data_size;
+    uint64_t num_keys;
+} frozen_header_t;
+
+// A read-only image of a tree, mapped straight from its file: the keys in
+// Eytzinger order (the implicit complete binary tree a heap uses), followed
+// by their data in the same order.
+struct frozen {
+    size_t key_size;
+    size_t data_size;
+    size_t num_keys;
+    char *keys;
+    char *data;
+    void *map;
+    size_t map_size;
+};
+
+typedef struct frozen frozen_t;
+
+int frozen_write(const char *path, size_t key_size, size_t data_size,
+                 size_t num_keys, const char *keys, const char *data);
+frozen_t* frozen_open(const char *path);
+void frozen_search(frozen_t *frozen, char *key, char **data);
+void frozen_free(frozen_t *frozen);
+
+#endif
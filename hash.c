@@ -0,0 +1,46 @@
+#include <string.h>
+
+#include "hash.h"
+
+
+/* MurmurHash64A. Keys are hashed as opaque bytes, so this must stay stable
+ * for anything that persists hashes (none of the current users do). */
+
+#define HASH_SEED 0x9747b28c
+#define HASH_M 0xc6a4a7935bd1e995ULL
+#define HASH_R 47
+
+
+uint64_t hash_bytes(const char *data, size_t len)
+{
+    uint64_t h = HASH_SEED ^ (len * HASH_M);
+    const char *end = data + (len & ~(size_t)7);
+
+    for (; data != end; data += 8) {
+        uint64_t k;
+        memcpy(&k, data, sizeof(k));
+        k *= HASH_M;
+        k ^= k >> HASH_R;
+        k *= HASH_M;
+        h ^= k;
+        h *= HASH_M;
+    }
+
+    uint64_t tail = 0;
+    switch (len & 7) {
+    case 7: tail ^= (uint64_t)(unsigned char)data[6] << 48; // fall through
+    case 6: tail ^= (uint64_t)(unsigned char)data[5] << 40; // fall through
+    case 5: tail ^= (uint64_t)(unsigned char)data[4] << 32; // fall through
+    case 4: tail ^= (uint64_t)(unsigned char)data[3] << 24; // fall through
+    case 3: tail ^= (uint64_t)(unsigned char)data[2] << 16; // fall through
+    case 2: tail ^= (uint64_t)(unsigned char)data[1] << 8;  // fall through
+    case 1: tail ^= (uint64_t)(unsigned char)data[0];
+        h ^= tail;
+        h *= HASH_M;
+    }
+
+    h ^= h >> HASH_R;
+    h *= HASH_M;
+    h ^= h >> HASH_R;
+    return h;
+}
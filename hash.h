@@ -0,0 +1,9 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t hash_bytes(const char *data, size_t len);
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "hash_index.h"
+
+
+/* Extendible hashing.
+ *
+ * The low global_depth bits of a key's hash select a directory slot, and each
+ * slot names a bucket page. A bucket with local_depth < global_depth is shared
+ * by every slot that agrees on its low local_depth bits. A full bucket splits
+ * on its next hash bit, doubling the directory first if it is already as deep
+ * as the directory, so no other bucket is touched. */
+
+static hash_bucket_t* hash_index_bucket(hash_index_t *index, size_t page_index)
+{
+    page_t *page = page_pool_get_page(index->pool, page_index);
+    if (page == NULL)
+        return NULL;
+    return (hash_bucket_t*)page->data;
+}
+
+static char* bucket_key(hash_index_t *index, hash_bucket_t *bucket, size_t i)
+{
+    return bucket->entries + i * (index->key_size + index->data_size);
+}
+
+static char* bucket_data(hash_index_t *index, hash_bucket_t *bucket, size_t i)
+{
+    return bucket_key(index, bucket, i) + index->key_size;
+}
+
+static size_t hash_index_slot(hash_index_t *index, uint64_t hash)
+{
+    return hash & (((uint64_t)1 << index->global_depth) - 1);
+}
+
+/* Position of key in bucket, or num_keys if it is not there. */
+static size_t bucket_find(hash_index_t *index, hash_bucket_t *bucket, char *key)
+{
+    for (size_t i = 0; i < bucket->num_keys; i++) {
+        if (memcmp(bucket_key(index, bucket, i), key, index->key_size) == 0)
+            return i;
+    }
+    return bucket->num_keys;
+}
+
+hash_index_t* hash_index_allocate(page_pool_t *pool, size_t key_size, size_t data_size)
+{
+    if (pool == NULL) {
+        printf("Cannot allocate hash index without a page_pool\n");
+        return NULL;
+    }
+    if (key_size == 0 || data_size == 0) {
+        printf("Cannot allocate hash index with key_size or data_size 0\n");
+        return NULL;
+    }
+    size_t bucket_capacity = (PAGE_SIZE - sizeof(hash_bucket_t)) / (key_size + data_size);
+    if (bucket_capacity < 2) {
+        printf("Cannot allocate hash index, keys and data are too large for a page\n");
+        return NULL;
+    }
+
+    hash_index_t *index = (hash_index_t*)malloc(sizeof(hash_index_t));
+    if (index == NULL) {
+        printf("Failed to allocate hash_index_t\n");
+        return NULL;
+    }
+    index->directory = (size_t*)malloc(sizeof(size_t));
+    if (index->directory == NULL) {
+        printf("Failed to allocate hash index directory\n");
+        free(index);
+        return NULL;
+    }
+    index->key_size = key_size;
+    index->data_size = data_size;
+    index->bucket_capacity = bucket_capacity;
+    index->global_depth = 0;
+    // A directory with more slots than the pool has room for keys would only
+    // come from hashes that collide.
+    index->max_depth = 0;
+    while (index->max_depth < HASH_INDEX_MAX_DEPTH
+           && ((size_t)1 << index->max_depth) < pool->max_len * bucket_capacity)
+        index->max_depth++;
+    index->num_keys = 0;
+    index->pool = pool;
+
+    // Pages come zeroed, which is an empty bucket of depth 0.
+    if (page_pool_create_page(pool, &index->directory[0]) == NULL) {
+        free(index->directory);
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+static int hash_index_double(hash_index_t *index)
+{
+    size_t len = (size_t)1 << index->global_depth;
+    size_t *directory = (size_t*)realloc(index->directory, 2 * len * sizeof(size_t));
+    if (directory == NULL) {
+        printf("Failed to grow hash index directory\n");
+        return -1;
+    }
+    memcpy(directory + len, directory, len * sizeof(size_t));
+    index->directory = directory;
+    index->global_depth++;
+    return 0;
+}
+
+static int hash_index_split(hash_index_t *index, size_t page_index, hash_bucket_t *bucket)
+{
+    int grow = bucket->local_depth == index->global_depth;
+    if (grow && index->global_depth == index->max_depth) {
+        printf("Cannot grow hash index directory past depth %zu\n", index->max_depth);
+        return -1;
+    }
+    // A full pool must not leave the directory doubled for nothing.
+    size_t new_index;
+    page_t *page = page_pool_create_page(index->pool, &new_index);
+    if (page == NULL)
+        return -1;
+    if (grow && hash_index_double(index) != 0)
+        return -1;
+    hash_bucket_t *sibling = (hash_bucket_t*)page->data;
+
+    // Entries with the next hash bit set move to the new bucket.
+    uint64_t bit = (uint64_t)1 << bucket->local_depth;
+    size_t entry_size = index->key_size + index->data_size;
+    size_t kept = 0;
+    for (size_t i = 0; i < bucket->num_keys; i++) {
+        char *entry = bucket_key(index, bucket, i);
+        if (hash_bytes(entry, index->key_size) & bit)
+            memcpy(bucket_key(index, sibling, sibling->num_keys++), entry, entry_size);
+        else
+            memmove(bucket_key(index, bucket, kept++), entry, entry_size);
+    }
+    bucket->num_keys = kept;
+    bucket->local_depth++;
+    sibling->local_depth = bucket->local_depth;
+
+    size_t len = (size_t)1 << index->global_depth;
+    for (size_t slot = 0; slot < len; slot++) {
+        if (index->directory[slot] == page_index && (slot & bit))
+            index->directory[slot] = new_index;
+    }
+    page_pool_mark_dirty(index->pool, page_index);
+    page_pool_mark_dirty(index->pool, new_index);
+    return 0;
+}
+
+void hash_index_insert(hash_index_t *index, char *key, char *data)
+{
+    uint64_t hash = hash_bytes(key, index->key_size);
+    for (;;) {
+        size_t page_index = index->directory[hash_index_slot(index, hash)];
+        hash_bucket_t *bucket = hash_index_bucket(index, page_index);
+        if (bucket == NULL) {
+            printf("Failed to insert into hash index\n");
+            return;
+        }
+
+        size_t pos = bucket_find(index, bucket, key);
+        if (pos == bucket->num_keys && bucket->num_keys == index->bucket_capacity) {
+            if (hash_index_split(index, page_index, bucket) != 0) {
+                printf("Failed to insert into hash index\n");
+                return;
+            }
+            // The split may not have made room on our side; look again.
+            continue;
+        }
+
+        if (pos == bucket->num_keys) {
+            memcpy(bucket_key(index, bucket, pos), key, index->key_size);
+            bucket->num_keys++;
+            index->num_keys++;
+        }
+        memcpy(bucket_data(index, bucket, pos), data, index->data_size);
+        page_pool_mark_dirty(index->pool, page_index);
+        return;
+    }
+}
+
+void hash_index_search(hash_index_t *index, char *key, char **data)
+{
+    *data = NULL;
+    uint64_t hash = hash_bytes(key, index->key_size);
+    hash_bucket_t *bucket = hash_index_bucket(index, index->directory[hash_index_slot(index, hash)]);
+    if (bucket == NULL)
+        return;
+    size_t pos = bucket_find(index, bucket, key);
+    if (pos < bucket->num_keys)
+        *data = bucket_data(index, bucket, pos);
+}
+
+int hash_index_delete(hash_index_t *index, char *key)
+{
+    uint64_t hash = hash_bytes(key, index->key_size);
+    size_t page_index = index->directory[hash_index_slot(index, hash)];
+    hash_bucket_t *bucket = hash_index_bucket(index, page_index);
+    if (bucket == NULL)
+        return -1;
+    size_t pos = bucket_find(index, bucket, key);
+    if (pos == bucket->num_keys)
+        return -1;
+
+    // Order within a bucket does not matter, so fill the hole from the end.
+    bucket->num_keys--;
+    if (pos != bucket->num_keys)
+        memcpy(bucket_key(index, bucket, pos), bucket_key(index, bucket, bucket->num_keys),
+               index->key_size + index->data_size);
+    page_pool_mark_dirty(index->pool, page_index);
+    index->num_keys--;
+    return 0;
+}
+
+void hash_index_free(hash_index_t *index)
+{
+    if (index == NULL) {
+        printf("Warning: tried to free NULL hash_index_t*\n");
+        return;
+    }
+    // Bucket pages belong to the pool and are freed with it.
+    free(index->directory);
+    free(index);
+}
@@ -0,0 +1,37 @@
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+#include "index.h"
+
+// Directory doubling stops here, or earlier for pools too small to need it;
+// reaching it means the keys' hashes collide.
+#define HASH_INDEX_MAX_DEPTH 32
+
+// Buckets hold num_keys entries, each a key immediately followed by its data.
+typedef struct {
+    size_t local_depth;
+    size_t num_keys;
+    char entries[];
+} hash_bucket_t;
+
+typedef struct {
+    size_t key_size;
+    size_t data_size;
+    size_t bucket_capacity;
+    size_t global_depth;
+    // At most HASH_INDEX_MAX_DEPTH, less for small pools.
+    size_t max_depth;
+    size_t num_keys;
+    // 1 << global_depth bucket page indices, kept in memory so that a lookup
+    // reads only the bucket page.
+    size_t *directory;
+    page_pool_t *pool;
+} hash_index_t;
+
+hash_index_t* hash_index_allocate(page_pool_t *pool, size_t key_size, size_t data_size);
+void hash_index_insert(hash_index_t *index, char *key, char *data);
+void hash_index_search(hash_index_t *index, char *key, char **data);
+int hash_index_delete(hash_index_t *index, char *key);
+void hash_index_free(hash_index_t *index);
+
+#endif
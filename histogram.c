@@ -0,0 +1,241 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "histogram.h"
+
+
+/* Log-linear histograms.
+ *
+ * Buckets are fine enough for percentiles to within about 6% at any scale
+ * and few enough (976) that merging or dumping one is cheap. Recording is an
+ * index computation and two increments, with no locks or atomic
+ * read-modify-writes, since each histogram has a single writer. */
+
+uint64_t histogram_bucket_low(size_t bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    size_t shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    return (uint64_t)(HISTOGRAM_SUB_BUCKETS + (bucket & (HISTOGRAM_SUB_BUCKETS - 1))) << shift;
+}
+
+uint64_t histogram_bucket_high(size_t bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    size_t shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    return histogram_bucket_low(bucket) + (((uint64_t)1 << shift) - 1);
+}
+
+void histogram_merge(histogram_t *into, histogram_t *from)
+{
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+    into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max)
+        into->max = max;
+}
+
+/* The highest value in the bucket holding quantile p, but no more than the
+ * largest value recorded. 0 for an empty histogram. */
+uint64_t histogram_percentile(histogram_t *histogram, double p)
+{
+    if (histogram->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(p * histogram->count);
+    if (rank >= histogram->count)
+        rank = histogram->count - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen > rank) {
+            uint64_t high = histogram_bucket_high(i);
+            return high < histogram->max ? high : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+// Takes each value as the middle of its bucket.
+double histogram_mean(histogram_t *histogram)
+{
+    if (histogram->count == 0)
+        return 0;
+    double sum = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (histogram->counts[i] > 0)
+            sum += histogram->counts[i] * ((histogram_bucket_low(i) + (double)histogram_bucket_high(i)) / 2);
+    }
+    return sum / histogram->count;
+}
+
+/* A summary line, then one line per non-empty bucket with its bounds and
+ * the fraction of values at or below it. */
+void histogram_print(histogram_t *histogram, const char *name, FILE *out)
+{
+    fprintf(out, "%s: count %llu  mean %.0f  p50 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+            name, (unsigned long long)histogram->count, histogram_mean(histogram),
+            (unsigned long long)histogram_percentile(histogram, 0.5),
+            (unsigned long long)histogram_percentile(histogram, 0.99),
+            (unsigned long long)histogram_percentile(histogram, 0.999),
+            (unsigned long long)histogram->max);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (histogram->counts[i] == 0)
+            continue;
+        seen += histogram->counts[i];
+        fprintf(out, "  %12llu %12llu %12llu  %.6f\n",
+                (unsigned long long)histogram_bucket_low(i), (unsigned long long)histogram_bucket_high(i),
+                (unsigned long long)histogram->counts[i], (double)seen / histogram->count);
+    }
+}
+
+int histogram_write(histogram_t *histograms, size_t count, FILE *out)
+{
+    histogram_file_header_t header = {HISTOGRAM_MAGIC, HISTOGRAM_SUB_BITS, count};
+    if (fwrite(&header, sizeof(header), 1, out) != 1
+            || fwrite(histograms, sizeof(histogram_t), count, out) != count) {
+        printf("Failed to write histograms\n");
+        return -1;
+    }
+    return 0;
+}
+
+int histogram_read(histogram_t *histograms, size_t count, FILE *in)
+{
+    histogram_file_header_t header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != HISTOGRAM_MAGIC) {
+        printf("Not a histogram dump\n");
+        return -1;
+    }
+    if (header.sub_bits != HISTOGRAM_SUB_BITS || header.count != count) {
+        printf("Expected %zu histograms with %d sub-bucket bits, found %llu with %llu\n",
+               count, HISTOGRAM_SUB_BITS, (unsigned long long)header.count,
+               (unsigned long long)header.sub_bits);
+        return -1;
+    }
+    if (fread(histograms, sizeof(histogram_t), count, in) != count) {
+        printf("Histogram dump is truncated\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Per-thread operation latencies.
+ *
+ * A thread's histograms are allocated the first time it records and pushed
+ * onto a list that is never shrunk, so collecting needs no coordination with
+ * threads that come and go. Ticks are the time stamp counter where there is
+ * one, converted to nanoseconds with a rate measured when recording is
+ * first enabled. */
+
+typedef struct latency_thread {
+    struct latency_thread *next;
+    histogram_t histograms[LATENCY_OPS];
+} latency_thread_t;
+
+int latency_enabled = 0;
+static double latency_ns_per_tick = 0;
+static latency_thread_t *latency_threads = NULL;
+static __thread latency_thread_t *latency_local = NULL;
+
+static uint64_t latency_clock_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+uint64_t latency_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return latency_clock_ns();
+#endif
+}
+
+static void latency_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t start_ns = latency_clock_ns(), start = latency_ticks();
+    while (latency_clock_ns() - start_ns < 2000000)
+        ;
+    uint64_t ns = latency_clock_ns() - start_ns, ticks = latency_ticks() - start;
+    double ns_per_tick = ticks > 0 ? (double)ns / ticks : 1.0;
+#else
+    double ns_per_tick = 1.0;
+#endif
+    __atomic_store(&latency_ns_per_tick, &ns_per_tick, __ATOMIC_RELAXED);
+}
+
+static latency_thread_t* latency_register(void)
+{
+    latency_thread_t *local = (latency_thread_t*)calloc(1, sizeof(latency_thread_t));
+    if (local == NULL) {
+        printf("Failed to allocate latency histograms\n");
+        return NULL;
+    }
+    local->next = __atomic_load_n(&latency_threads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&latency_threads, &local->next, local, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    latency_local = local;
+    return local;
+}
+
+void latency_record(latency_op_t op, uint64_t ticks)
+{
+    latency_thread_t *local = latency_local;
+    if (local == NULL && (local = latency_register()) == NULL)
+        return;
+    double ns_per_tick;
+    __atomic_load(&latency_ns_per_tick, &ns_per_tick, __ATOMIC_RELAXED);
+    histogram_record(&local->histograms[op], (uint64_t)(ticks * ns_per_tick));
+}
+
+void latency_enable(int enabled)
+{
+    double ns_per_tick;
+    __atomic_load(&latency_ns_per_tick, &ns_per_tick, __ATOMIC_RELAXED);
+    if (enabled && ns_per_tick == 0)
+        latency_calibrate();
+    __atomic_store_n(&latency_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+void latency_collect(histogram_t *histograms)
+{
+    memset(histograms, 0, LATENCY_OPS * sizeof(histogram_t));
+    latency_thread_t *thread = __atomic_load_n(&latency_threads, __ATOMIC_ACQUIRE);
+    for (; thread != NULL; thread = thread->next) {
+        for (size_t op = 0; op < LATENCY_OPS; op++)
+            histogram_merge(&histograms[op], &thread->histograms[op]);
+    }
+}
+
+void latency_reset(void)
+{
+    latency_thread_t *thread = __atomic_load_n(&latency_threads, __ATOMIC_ACQUIRE);
+    for (; thread != NULL; thread = thread->next)
+        memset(thread->histograms, 0, sizeof(thread->histograms));
+}
+
+void latency_print(FILE *out)
+{
+    static const char *names[LATENCY_OPS] = {"insert", "search", "split", "page_create"};
+    histogram_t *histograms = (histogram_t*)malloc(LATENCY_OPS * sizeof(histogram_t));
+    if (histograms == NULL) {
+        printf("Failed to allocate latency histograms\n");
+        return;
+    }
+    latency_collect(histograms);
+    for (size_t op = 0; op < LATENCY_OPS; op++)
+        histogram_print(&histograms[op], names[op], out);
+    free(histograms);
+}
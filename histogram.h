@@ -0,0 +1,95 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HISTOGRAM_MAGIC 0x0031545349484c51ULL // "QLHIST1" in little endian
+// Each power of two is cut into 2^HISTOGRAM_SUB_BITS buckets, so a value is
+// known to within 1/16 of itself.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// Values below HISTOGRAM_SUB_BUCKETS get a bucket each; above that, bucket
+// (e - HISTOGRAM_SUB_BITS + 1, s) holds values whose top bit is e and whose
+// next HISTOGRAM_SUB_BITS bits are s.
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t counts[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+typedef enum {
+    LATENCY_INSERT,
+    LATENCY_SEARCH,
+    LATENCY_SPLIT,
+    LATENCY_PAGE_CREATE,
+    LATENCY_OPS
+} latency_op_t;
+
+// A binary dump is this header followed by count histograms.
+typedef struct {
+    uint64_t magic;
+    uint64_t sub_bits;
+    uint64_t count;
+} histogram_file_header_t;
+
+static inline size_t histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+    size_t top = 63 - __builtin_clzll(value);
+    size_t shift = top - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Only one thread may record into a histogram, but any thread may read it
+// at the same time: the relaxed accesses are plain loads and stores.
+static inline void histogram_record(histogram_t *histogram, uint64_t value)
+{
+    uint64_t *count = &histogram->counts[histogram_bucket(value)];
+    __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, __atomic_load_n(&histogram->count, __ATOMIC_RELAXED) + 1,
+                     __ATOMIC_RELAXED);
+    if (value > __atomic_load_n(&histogram->max, __ATOMIC_RELAXED))
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+uint64_t histogram_bucket_low(size_t bucket);
+uint64_t histogram_bucket_high(size_t bucket);
+void histogram_merge(histogram_t *into, histogram_t *from);
+uint64_t histogram_percentile(histogram_t *histogram, double p);
+double histogram_mean(histogram_t *histogram);
+void histogram_print(histogram_t *histogram, const char *name, FILE *out);
+int histogram_write(histogram_t *histograms, size_t count, FILE *out);
+int histogram_read(histogram_t *histograms, size_t count, FILE *in);
+
+/* Operation latencies in nanoseconds, recorded by each thread into its own
+ * histograms while enabled. */
+extern int latency_enabled;
+
+uint64_t latency_ticks(void);
+void latency_record(latency_op_t op, uint64_t ticks);
+
+// Zero when disabled, so the matching latency_end records nothing.
+static inline uint64_t latency_start(void)
+{
+    return __atomic_load_n(&latency_enabled, __ATOMIC_RELAXED) ? latency_ticks() : 0;
+}
+
+static inline void latency_end(latency_op_t op, uint64_t start)
+{
+    if (start != 0)
+        latency_record(op, latency_ticks() - start);
+}
+
+void latency_enable(int enabled);
+// Merges every thread's histograms, including those of threads that have
+// exited, into histograms[LATENCY_OPS].
+void latency_collect(histogram_t *histograms);
+// Only meant for when no thread is recording.
+void latency_reset(void);
+void latency_print(FILE *out);
+
+#endif
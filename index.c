@@ -1,8 +1,22 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "bloom.h"
+#include "frozen.h"
+#include "histogram.h"
 #include "index.h"
+#include "page_io.h"
+#include "page_numa.h"
+#include "trace.h"
+#include "vlog.h"
 
 
 page_pool_t* page_pool_init(size_t max_len)
@@ -16,67 +30,3100 @@ page_pool_t* page_pool_init(size_t max_len)
         printf("Failed to allocate page_pool_t\n");
         return NULL;
     }
+    pool->meta = (page_meta_t*)calloc(max_len, sizeof(page_meta_t));
+    if (pool->meta == NULL) {
+        printf("Failed to allocate page_meta_t array\n");
+        free(pool);
+        return NULL;
+    }
     memset(pool->pages, 0, sizeof(page_t*) * max_len);
     pool->max_len = max_len;
     pool->len = 0;
+    pool->fd = -1;
+    pool->io = NULL;
+    pool->numa = NULL;
+    pool->epoch = 0;
+    pool->readahead = 0;
+    pool->last_index = 0;
+    pool->sequential = 0;
+    pool->misses = 0;
+    return pool;
+}
+
+page_pool_t* page_pool_open(const char *path, size_t max_len)
+{
+    page_pool_t *pool = page_pool_init(max_len);
+    if (pool == NULL)
+        return NULL;
+
+    pool->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (pool->fd < 0) {
+        printf("Cannot open page file %s: %s\n", path, strerror(errno));
+        page_pool_free(pool);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(pool->fd, &st) != 0 || st.st_size % PAGE_SIZE != 0) {
+        printf("Page file %s is not a whole number of pages\n", path);
+        page_pool_free(pool);
+        return NULL;
+    }
+    if (st.st_size / PAGE_SIZE > max_len) {
+        printf("Page file %s holds more than %zu pages\n", path, max_len);
+        page_pool_free(pool);
+        return NULL;
+    }
+    // Pages already in the file are allocated but not resident.
+    pool->len = st.st_size / PAGE_SIZE;
+    pool->readahead = PAGE_POOL_READAHEAD;
+
+    pool->io = page_io_init(pool->fd, PAGE_POOL_IO_DEPTH, PAGE_IO_AUTO);
+    if (pool->io == NULL) {
+        page_pool_free(pool);
+        return NULL;
+    }
     return pool;
 }
 
+// Returns zeroed memory for the page at index, placed by the NUMA policy.
+static page_t* page_pool_alloc_page(page_pool_t *pool, size_t index)
+{
+    page_t *page;
+    if (pool->numa != NULL) {
+        size_t node = page_numa_node_for(pool->numa, index, pool->max_len);
+        page = page_numa_alloc(pool->numa, node);
+        pool->meta[index].node = node;
+    } else {
+        page = (page_t*)calloc(1, sizeof(page_t));
+    }
+    if (page == NULL)
+        printf("Cannot allocate memory for page_t\n");
+    return page;
+}
+
+static void page_pool_release_page(page_pool_t *pool, size_t index)
+{
+    if (pool->numa != NULL)
+        page_numa_release(pool->numa, pool->meta[index].node, pool->pages[index]);
+    else
+        free(pool->pages[index]);
+    pool->pages[index] = NULL;
+    pool->epoch++;
+}
+
 page_t* page_pool_create_page(page_pool_t *pool, size_t *index)
 {
+    uint64_t start = latency_start();
     if (pool->len >= pool->max_len) {
         printf("Cannot allocate page, pool is full\n");
         return NULL;
     }
-    page_t *page = (page_t*)malloc(sizeof(page_t));
-    if (page == NULL) {
-        printf("Cannot allocate memory for page_t\n");
+    page_t *page = page_pool_alloc_page(pool, pool->len);
+    if (page == NULL)
         return NULL;
-    }
-    memset(page, 0, sizeof(page_t));
     *index = pool->len++;
     pool->pages[*index] = page;
+    // A new page only exists in memory until the pool is synced.
+    if (pool->fd >= 0)
+        pool->meta[*index].dirty = 1;
+    latency_end(LATENCY_PAGE_CREATE, start);
     return page;
 }
 
+static int page_pool_start_read(page_pool_t *pool, size_t index)
+{
+    page_t *page = page_pool_alloc_page(pool, index);
+    if (page == NULL)
+        return -1;
+    pool->pages[index] = page;
+    if (page_io_submit_read(pool->io, page, index) != 0) {
+        page_pool_release_page(pool, index);
+        return -1;
+    }
+    pool->meta[index].reading = 1;
+    pool->meta[index].loaded = 1;
+    return 0;
+}
+
+// Leaves the page non-resident so the next access retries the read.
+static void page_pool_fail_read(page_pool_t *pool, size_t index)
+{
+    pool->meta[index].reading = 0;
+    page_pool_release_page(pool, index);
+}
+
+// Collects one completed read. Returns -1 when no completion could be
+// collected at all, in which case the caller has to give up on its page
+// rather than wait for it again.
+static int page_pool_reap(page_pool_t *pool)
+{
+    size_t index = pool->len;
+    int ret = page_io_wait(pool->io, &index);
+    if (index >= pool->len)
+        return ret;
+    if (!pool->meta[index].reading)
+        return 0;
+    if (ret != 0)
+        page_pool_fail_read(pool, index);
+    else
+        pool->meta[index].reading = 0;
+    return 0;
+}
+
+void page_pool_prefetch(page_pool_t *pool, size_t index, size_t count)
+{
+    if (pool->fd < 0)
+        return;
+    for (size_t i = index; i < index + count && i < pool->len; i++) {
+        if (pool->pages[i] != NULL)
+            continue;
+        if (page_io_in_flight(pool->io) >= PAGE_POOL_IO_DEPTH)
+            break;
+        if (page_pool_start_read(pool, i) != 0)
+            break;
+    }
+    page_io_flush(pool->io);
+}
+
+page_t* page_pool_try_get_page(page_pool_t *pool, size_t index)
+{
+    if (index >= pool->len) {
+        printf("Page %zu is not allocated\n", index);
+        return NULL;
+    }
+    if (pool->fd >= 0 && pool->meta[index].reading)
+        return NULL;
+    return pool->pages[index];
+}
+
+int page_pool_wait(page_pool_t *pool)
+{
+    if (pool->fd < 0 || page_io_in_flight(pool->io) == 0)
+        return -1;
+    do {
+        if (page_pool_reap(pool) != 0)
+            return -1;
+    } while (page_io_in_flight(pool->io) > 0 && page_io_ready(pool->io) > 0);
+    return 0;
+}
+
 page_t* page_pool_get_page(page_pool_t *pool, size_t index)
 {
     if (index >= pool->len) {
         printf("Page %zu is not allocated\n", index);
         return NULL;
     }
+    if (pool->fd < 0)
+        return pool->pages[index];
+
+    // Two consecutive accesses in page order start a read-ahead stream, which
+    // keeps the next `readahead` pages in flight for as long as it continues.
+    if (index == pool->last_index + 1)
+        pool->sequential++;
+    else
+        pool->sequential = 0;
+    pool->last_index = index;
+
+    if (pool->pages[index] == NULL) {
+        pool->misses++;
+        // Make room for the read we are about to block on.
+        while (page_io_in_flight(pool->io) >= PAGE_POOL_IO_DEPTH) {
+            if (page_pool_reap(pool) != 0) {
+                printf("Failed to read page %zu\n", index);
+                return NULL;
+            }
+        }
+        if (page_pool_start_read(pool, index) != 0)
+            return NULL;
+    }
+    if (pool->sequential > 0)
+        page_pool_prefetch(pool, index + 1, pool->readahead);
+    else
+        page_io_flush(pool->io);
+
+    while (pool->meta[index].reading) {
+        if (page_pool_reap(pool) != 0)
+            page_pool_fail_read(pool, index);
+    }
+    if (pool->pages[index] == NULL)
+        printf("Failed to read page %zu\n", index);
     return pool->pages[index];
 }
 
+void page_pool_mark_dirty(page_pool_t *pool, size_t index)
+{
+    if (index >= pool->len) {
+        printf("Page %zu is not allocated\n", index);
+        return;
+    }
+    pool->meta[index].dirty = 1;
+    pool->meta[index].version++;
+}
+
+int page_pool_pin(page_pool_t *pool, size_t index)
+{
+    if (page_pool_get_page(pool, index) == NULL)
+        return -1;
+    pool->meta[index].pins++;
+    return 0;
+}
+
+void page_pool_unpin(page_pool_t *pool, size_t index)
+{
+    if (index >= pool->len || pool->meta[index].pins == 0) {
+        printf("Page %zu is not pinned\n", index);
+        return;
+    }
+    pool->meta[index].pins--;
+}
+
+static int page_pool_write_page(page_pool_t *pool, size_t index)
+{
+    ssize_t written = pwrite(pool->fd, pool->pages[index]->data, PAGE_SIZE, index * PAGE_SIZE);
+    if (written != PAGE_SIZE) {
+        printf("Failed to write page %zu\n", index);
+        return -1;
+    }
+    pool->meta[index].dirty = 0;
+    return 0;
+}
+
+int page_pool_evict(page_pool_t *pool, size_t index)
+{
+    if (pool->fd < 0) {
+        printf("Cannot evict page %zu, pool has no backing file\n", index);
+        return -1;
+    }
+    if (index >= pool->len) {
+        printf("Page %zu is not allocated\n", index);
+        return -1;
+    }
+    if (pool->meta[index].pins > 0) {
+        printf("Cannot evict page %zu, it is pinned\n", index);
+        return -1;
+    }
+    while (pool->meta[index].reading) {
+        if (page_pool_reap(pool) != 0) {
+            page_pool_fail_read(pool, index);
+            return -1;
+        }
+    }
+    if (pool->pages[index] == NULL)
+        return 0;
+    if (pool->meta[index].dirty && page_pool_write_page(pool, index) != 0)
+        return -1;
+    page_pool_release_page(pool, index);
+    return 0;
+}
+
+int page_pool_sync(page_pool_t *pool)
+{
+    if (pool->fd < 0) {
+        printf("Cannot sync a pool with no backing file\n");
+        return -1;
+    }
+    for (size_t i = 0; i < pool->len; i++) {
+        if (pool->pages[i] == NULL || !pool->meta[i].dirty)
+            continue;
+        if (page_pool_write_page(pool, i) != 0)
+            return -1;
+    }
+    if (fdatasync(pool->fd) != 0) {
+        printf("Failed to sync page file: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int page_pool_set_numa_policy(page_pool_t *pool, page_pool_numa_policy_t policy)
+{
+    // Existing pages cannot be moved, so the policy has to come first.
+    for (size_t i = 0; i < pool->len; i++) {
+        if (pool->pages[i] != NULL) {
+            printf("Cannot set a NUMA policy on a pool with resident pages\n");
+            return -1;
+        }
+    }
+    if (pool->numa != NULL) {
+        pool->numa->policy = policy;
+        return 0;
+    }
+    size_t node_ids[PAGE_NUMA_MAX_NODES];
+    size_t num_nodes = page_numa_detect_nodes(node_ids);
+    pool->numa = page_numa_init(policy, node_ids, num_nodes);
+    return pool->numa == NULL ? -1 : 0;
+}
+
+size_t page_pool_numa_nodes(page_pool_t *pool)
+{
+    return pool->numa == NULL ? 1 : pool->numa->num_nodes;
+}
+
+size_t page_pool_numa_pages(page_pool_t *pool, size_t node)
+{
+    if (pool->numa == NULL || node >= pool->numa->num_nodes)
+        return 0;
+    return pool->numa->nodes[node].pages;
+}
+
 void page_pool_free(page_pool_t *pool)
 {
     if (pool == NULL) {
         printf("Warning: tried to free NULL page_pool_t*\n");
         return;
     }
+    // Outstanding reads still target pages[], so let them land first.
+    if (pool->io != NULL)
+        page_io_free(pool->io);
+    // Anything changed since the last sync would be lost otherwise.
+    if (pool->fd >= 0 && page_pool_sync(pool) != 0)
+        printf("Failed to write back pages when freeing a pool\n");
     for (int i = 0; i < pool->len; i++) {
         if (pool->pages[i] == NULL) {
-            printf("Found a NULL pointer to a page when freeing a pool\n");
+            if (pool->fd < 0)
+                printf("Found a NULL pointer to a page when freeing a pool\n");
             continue;
         }
-        free(pool->pages[i]);
+        if (pool->numa == NULL)
+            free(pool->pages[i]);
     }
+    // Slab pages go back all at once.
+    if (pool->numa != NULL)
+        page_numa_free(pool->numa);
+    if (pool->fd >= 0)
+        close(pool->fd);
+    free(pool->meta);
     free(pool);
 }
 
-btree_t* btree_allocate(page_pool_t *pool, size_t key_size, size_t data_size)
+/* btree node layout */
+
+static leaf_node_t* btree_leaf(btree_t *tree, size_t index)
 {
-    return NULL;
+    page_t *page = page_pool_get_page(tree->pool, index);
+    if (page == NULL)
+        return NULL;
+    return (leaf_node_t*)page->data;
 }
 
-void btree_insert(btree_t *tree, char *key, char *data)
+static internal_node_t* btree_internal(btree_t *tree, size_t index)
 {
+    page_t *page = page_pool_get_page(tree->pool, index);
+    if (page == NULL)
+        return NULL;
+    return (internal_node_t*)page->data;
 }
 
-void btree_search(btree_t *tree, char *key, char **data)
+static char* leaf_key(btree_t *tree, leaf_node_t *leaf, size_t i)
 {
+    return leaf->keys + i * tree->key_size;
 }
 
-void btree_free(btree_t *tree)
+static char* leaf_data(btree_t *tree, leaf_node_t *leaf, size_t i)
+{
+    return leaf->keys + tree->leaf_capacity * tree->key_size + i * tree->data_size;
+}
+
+static size_t* internal_counts(btree_t *tree, internal_node_t *node)
+{
+    return (size_t*)&node->children[tree->internal_capacity + 1];
+}
+
+static char* internal_key(btree_t *tree, internal_node_t *node, size_t i)
+{
+    return (char*)(internal_counts(tree, node) + tree->internal_capacity + 1) + i * tree->key_size;
+}
+
+static size_t btree_message_size(btree_t *tree)
 {
+    return 1 + tree->key_size + tree->data_size;
+}
+
+static char* message_key(char *message)
+{
+    return message + 1;
+}
+
+static char* message_data(btree_t *tree, char *message)
+{
+    return message + 1 + tree->key_size;
+}
+
+static size_t* internal_num_messages(btree_t *tree, internal_node_t *node)
+{
+    return (size_t*)((char*)node + tree->buffer_offset);
+}
+
+static char* internal_message(btree_t *tree, internal_node_t *node, size_t i)
+{
+    return (char*)node + tree->buffer_offset + sizeof(size_t) + i * btree_message_size(tree);
+}
+
+static size_t* internal_swizzle_epoch(btree_t *tree, internal_node_t *node)
+{
+    return (size_t*)((char*)node + tree->swizzle_offset);
+}
+
+static page_t** internal_child_pages(btree_t *tree, internal_node_t *node)
+{
+    return (page_t**)((char*)node + tree->swizzle_offset + sizeof(size_t));
+}
+
+/* Drops a node's cached child pointers, for when its children move. */
+static void btree_unswizzle(btree_t *tree, internal_node_t *node)
+{
+    if (tree->flags & BTREE_SWIZZLE)
+        *internal_swizzle_epoch(tree, node) = tree->pool->epoch - 1;
+}
+
+/* The page of a child of the node at index. Swizzled trees remember the
+ * pointer in the node, so later descents skip the pool; the cache is only
+ * trusted while the pool's epoch says no page memory has been released or
+ * moved since it was filled, and is always refilled in a page just read
+ * from the file, whose pointers were written out along with it. */
+static page_t* btree_child_page(btree_t *tree, size_t index, internal_node_t *node, size_t slot)
+{
+    if (!(tree->flags & BTREE_SWIZZLE))
+        return page_pool_get_page(tree->pool, node->children[slot].index);
+    size_t *epoch = internal_swizzle_epoch(tree, node);
+    page_t **pages = internal_child_pages(tree, node);
+    page_meta_t *meta = &tree->pool->meta[index];
+    if (*epoch != tree->pool->epoch || meta->loaded) {
+        memset(pages, 0, (tree->internal_capacity + 1) * sizeof(page_t*));
+        *epoch = tree->pool->epoch;
+        meta->loaded = 0;
+    }
+    if (pages[slot] == NULL)
+        pages[slot] = page_pool_get_page(tree->pool, node->children[slot].index);
+    return pages[slot];
+}
+
+/* Index of the first key in keys[0..n) that is >= key. */
+static size_t btree_lower_bound(btree_t *tree, char *keys, size_t n, char *key)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (memcmp(keys + mid * tree->key_size, key, tree->key_size) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Index of the first key in keys[0..n) that is > key. */
+static size_t btree_upper_bound(btree_t *tree, char *keys, size_t n, char *key)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (memcmp(keys + mid * tree->key_size, key, tree->key_size) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static leaf_model_t* leaf_model(leaf_node_t *leaf)
+{
+    return (leaf_model_t*)((char*)leaf + PAGE_SIZE - sizeof(leaf_model_t));
+}
+
+static unsigned long long leaf_model_key(btree_t *tree, char *key)
+{
+    unsigned long long value = 0;
+    for (size_t i = 0; i < tree->key_size; i++)
+        value = (value << 8) | (unsigned char)key[i];
+    return value;
+}
+
+/* Predicted slot of key. The prediction never decreases as the key grows,
+ * which is what lets a lookup trust the model for keys not in the leaf. */
+static size_t leaf_model_predict(btree_t *tree, leaf_model_t *model, char *key)
+{
+    unsigned long long value = leaf_model_key(tree, key);
+    double x = value >= model->base ? (double)(value - model->base)
+                                    : -(double)(model->base - value);
+    double slot = model->intercept + model->slope * x;
+    if (!(slot > 0))
+        return 0;
+    if (slot > tree->leaf_capacity)
+        return tree->leaf_capacity;
+    return (size_t)slot;
+}
+
+static size_t leaf_model_distance(size_t a, size_t b)
+{
+    return a > b ? a - b : b - a;
+}
+
+/* Least-squares fit of slot against key over the whole leaf. */
+static void leaf_model_fit(btree_t *tree, leaf_node_t *leaf)
+{
+    leaf_model_t *model = leaf_model(leaf);
+    size_t n = leaf->header.num_keys;
+    model->valid = 0;
+    if (n == 0)
+        return;
+    model->base = leaf_model_key(tree, leaf_key(tree, leaf, 0));
+    double mean_x = 0, mean_y = (n - 1) / 2.0;
+    for (size_t i = 0; i < n; i++)
+        mean_x += (double)(leaf_model_key(tree, leaf_key(tree, leaf, i)) - model->base);
+    mean_x /= n;
+    double covariance = 0, variance = 0;
+    for (size_t i = 0; i < n; i++) {
+        double dx = (double)(leaf_model_key(tree, leaf_key(tree, leaf, i)) - model->base) - mean_x;
+        covariance += dx * (i - mean_y);
+        variance += dx * dx;
+    }
+    // Sorted keys give a non-negative slope up to rounding; it must not go
+    // below zero or predictions would stop being monotonic.
+    model->slope = variance > 0 && covariance > 0 ? covariance / variance : 0;
+    model->intercept = mean_y - model->slope * mean_x;
+
+    size_t error = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t d = leaf_model_distance(leaf_model_predict(tree, model, leaf_key(tree, leaf, i)), i);
+        if (d > error)
+            error = d;
+    }
+    model->error = error;
+    model->valid = error <= LEAF_MODEL_MAX_ERROR;
+}
+
+/* Keeps the error bound true after key was put at or taken from slot pos,
+ * moving the keys after it, and refits once the bound gets too loose. */
+static void leaf_model_update(btree_t *tree, leaf_node_t *leaf, size_t pos, char *key, int inserted)
+{
+    if (!(tree->flags & BTREE_LEARNED))
+        return;
+    leaf_model_t *model = leaf_model(leaf);
+    if (!model->valid)
+        return;
+    size_t error = model->error;
+    size_t n = leaf->header.num_keys;
+    if (inserted ? pos + 1 < n : pos < n)
+        error++;
+    if (inserted) {
+        size_t d = leaf_model_distance(leaf_model_predict(tree, model, key), pos);
+        if (d > error)
+            error = d;
+    }
+    if (error > LEAF_MODEL_MAX_ERROR)
+        leaf_model_fit(tree, leaf);
+    else
+        model->error = error;
+}
+
+/* Index of the first key in the leaf that is >= key, searching only the
+ * slots the leaf's model allows for when it has one. */
+static size_t leaf_lower_bound(btree_t *tree, leaf_node_t *leaf, char *key)
+{
+    size_t n = leaf->header.num_keys;
+    if (!(tree->flags & BTREE_LEARNED) || !leaf_model(leaf)->valid)
+        return btree_lower_bound(tree, leaf->keys, n, key);
+    leaf_model_t *model = leaf_model(leaf);
+    size_t slot = leaf_model_predict(tree, model, key);
+    size_t lo = slot > model->error ? slot - model->error : 0;
+    size_t hi = slot + model->error + 1;
+    if (hi > n)
+        hi = n;
+    if (lo > hi)
+        lo = hi;
+    return lo + btree_lower_bound(tree, leaf_key(tree, leaf, lo), hi - lo, key);
+}
+
+/* Index of the first buffered message whose key is >= key. */
+static size_t buffer_lower_bound(btree_t *tree, internal_node_t *node, char *key)
+{
+    size_t lo = 0, hi = *internal_num_messages(tree, node);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (memcmp(message_key(internal_message(tree, node, mid)), key, tree->key_size) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Child of an internal node whose subtree covers key. Separator i is the
+ * smallest key in children[i + 1]. */
+static size_t internal_child_slot(btree_t *tree, internal_node_t *node, char *key)
+{
+    return btree_upper_bound(tree, internal_key(tree, node, 0), node->header.num_keys, key);
+}
+
+static leaf_node_t* btree_first_leaf(btree_t *tree, size_t *leaf_index)
+{
+    relation_t node = tree->root;
+    page_t *page = page_pool_get_page(tree->pool, node.index);
+    while (node.node_type == NODE_TYPE_INTERNAL) {
+        if (page == NULL)
+            return NULL;
+        internal_node_t *internal = (internal_node_t*)page->data;
+        page = btree_child_page(tree, node.index, internal, 0);
+        node = internal->children[0];
+    }
+    if (page == NULL)
+        return NULL;
+    if (leaf_index != NULL)
+        *leaf_index = node.index;
+    return (leaf_node_t*)page->data;
+}
+
+/* Starts reads for up to count children of node from slot first on, and
+ * returns how many it asked for. Siblings need not be near each other in the
+ * file, so the pool's sequential readahead does not find them. */
+static size_t btree_prefetch_children(btree_t *tree, internal_node_t *node, size_t first, size_t count)
+{
+    size_t i = first;
+    for (; i <= node->header.num_keys && i - first < count; i++)
+        page_pool_prefetch(tree->pool, node->children[i].index, 1);
+    return i - first;
+}
+
+/* Readahead for walks along the leaf chain, called with each leaf they
+ * reach. *ahead counts the leaves already asked for; once the walk is past
+ * them, the leaves after this one in its parent are asked for next. */
+static void btree_leaf_readahead(btree_t *tree, leaf_node_t *leaf, size_t *ahead)
+{
+    if (tree->pool->fd < 0)
+        return;
+    if (*ahead > 0) {
+        (*ahead)--;
+        return;
+    }
+    // An empty leaf has no key to find its parent by; the next one will.
+    if (tree->root.node_type == NODE_TYPE_LEAF || leaf->header.num_keys == 0)
+        return;
+    char *key = leaf_key(tree, leaf, 0);
+    relation_t node = tree->root;
+    internal_node_t *parent;
+    size_t slot;
+    do {
+        if ((parent = btree_internal(tree, node.index)) == NULL)
+            return;
+        slot = internal_child_slot(tree, parent, key);
+        node = parent->children[slot];
+    } while (node.node_type == NODE_TYPE_INTERNAL);
+    *ahead = btree_prefetch_children(tree, parent, slot + 1, tree->pool->readahead);
+}
+
+/* A zeroed page for a new node, taken from the tree's free pages first. */
+static page_t* btree_create_page(btree_t *tree, size_t *index)
+{
+    if (tree->free_page == PAGE_INDEX_NONE)
+        return page_pool_create_page(tree->pool, index);
+    page_t *page = page_pool_get_page(tree->pool, tree->free_page);
+    if (page == NULL)
+        return NULL;
+    *index = tree->free_page;
+    memcpy(&tree->free_page, page->data, sizeof(size_t));
+    if (tree->deferred != NULL && tree->deferred->spares > 0)
+        tree->deferred->spares--;
+    memset(page, 0, sizeof(page_t));
+    page_pool_mark_dirty(tree->pool, *index);
+    return page;
+}
+
+static leaf_node_t* btree_create_leaf(btree_t *tree, size_t *index)
+{
+    page_t *page = btree_create_page(tree, index);
+    if (page == NULL)
+        return NULL;
+    leaf_node_t *leaf = (leaf_node_t*)page->data;
+    leaf->header.node_type = NODE_TYPE_LEAF;
+    leaf->header.pending_split = 0;
+    leaf->header.num_keys = 0;
+    leaf->next = PAGE_INDEX_NONE;
+    leaf->prev = PAGE_INDEX_NONE;
+    if (tree->flags & BTREE_LEARNED)
+        leaf_model(leaf)->valid = 0;
+    return leaf;
+}
+
+static internal_node_t* btree_create_internal(btree_t *tree, size_t *index)
+{
+    page_t *page = btree_create_page(tree, index);
+    if (page == NULL)
+        return NULL;
+    internal_node_t *node = (internal_node_t*)page->data;
+    node->header.node_type = NODE_TYPE_INTERNAL;
+    node->header.num_keys = 0;
+    btree_unswizzle(tree, node);
+    return node;
+}
+
+
+/* btree */
+
+btree_t* btree_allocate(page_pool_t *pool, size_t key_size, size_t data_size)
+{
+    return btree_allocate_with_flags(pool, key_size, data_size, 0);
+}
+
+btree_t* btree_allocate_with_flags(page_pool_t *pool, size_t key_size, size_t data_size, int flags)
+{
+    if (pool == NULL) {
+        printf("Cannot allocate btree without a page_pool\n");
+        return NULL;
+    }
+    if (key_size == 0 || data_size == 0) {
+        printf("Cannot allocate btree with key_size or data_size 0\n");
+        return NULL;
+    }
+    if ((flags & BTREE_LEARNED) && key_size > sizeof(unsigned long long)) {
+        printf("Cannot allocate learned btree with keys over %zu bytes\n", sizeof(unsigned long long));
+        return NULL;
+    }
+    size_t leaf_space = PAGE_SIZE - sizeof(leaf_node_t);
+    if (flags & BTREE_LEARNED)
+        leaf_space -= sizeof(leaf_model_t);
+    size_t leaf_capacity = leaf_space / (key_size + data_size);
+    size_t internal_space = PAGE_SIZE - sizeof(internal_node_t);
+    // Buffered trees give half of each internal page to pending messages.
+    if (flags & BTREE_BUFFERED)
+        internal_space /= 2;
+    size_t child_size = sizeof(relation_t) + sizeof(size_t);
+    size_t swizzle_size = 0;
+    // Swizzled trees also cache a pointer per child, behind an epoch and
+    // whatever padding aligns it.
+    if (flags & BTREE_SWIZZLE) {
+        swizzle_size = sizeof(page_t*);
+        internal_space -= 2 * sizeof(size_t);
+    }
+    size_t internal_capacity = (internal_space - child_size - swizzle_size)
+                             / (key_size + child_size + swizzle_size);
+
+    size_t end = sizeof(internal_node_t) + (internal_capacity + 1) * child_size
+               + internal_capacity * key_size;
+    end = (end + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+    size_t swizzle_offset = 0;
+    if (flags & BTREE_SWIZZLE) {
+        swizzle_offset = end;
+        end += sizeof(size_t) + (internal_capacity + 1) * sizeof(page_t*);
+    }
+    size_t buffer_offset = 0;
+    size_t message_capacity = 0;
+    if (flags & BTREE_BUFFERED) {
+        buffer_offset = end;
+        message_capacity = (PAGE_SIZE - buffer_offset - sizeof(size_t)) / (1 + key_size + data_size);
+    }
+
+    // Splits need at least one key left on each side, and a flush needs a
+    // buffer that holds more than the message that triggered it.
+    if (leaf_capacity < 3 || internal_capacity < 3 || ((flags & BTREE_BUFFERED) && message_capacity < 2)) {
+        printf("Cannot allocate btree, keys and data are too large for a page\n");
+        return NULL;
+    }
+
+    btree_t *tree = (btree_t*)malloc(sizeof(btree_t));
+    if (tree == NULL) {
+        printf("Failed to allocate btree_t\n");
+        return NULL;
+    }
+    tree->key_size = key_size;
+    tree->data_size = data_size;
+    tree->flags = flags;
+    tree->leaf_capacity = leaf_capacity;
+    tree->internal_capacity = internal_capacity;
+    tree->message_capacity = message_capacity;
+    tree->buffer_offset = buffer_offset;
+    tree->swizzle_offset = swizzle_offset;
+    tree->num_keys = 0;
+    tree->pending_appends = 0;
+    tree->free_page = PAGE_INDEX_NONE;
+    tree->pool = pool;
+    tree->bloom = NULL;
+    tree->bloom_capacity = 0;
+    tree->bloom_deletes = 0;
+    tree->vlog = NULL;
+    tree->value_size = data_size;
+    tree->trace = NULL;
+    tree->deferred = NULL;
+
+    tree->root.node_type = NODE_TYPE_LEAF;
+    if (btree_create_leaf(tree, &tree->root.index) == NULL) {
+        free(tree);
+        return NULL;
+    }
+    tree->rightmost_leaf = tree->root.index;
+    return tree;
+}
+
+btree_t* btree_allocate_separated(page_pool_t *pool, vlog_t *vlog, size_t key_size, size_t value_size, int flags)
+{
+    if (vlog == NULL) {
+        printf("Cannot allocate separated btree without a value log\n");
+        return NULL;
+    }
+    if (value_size == 0) {
+        printf("Cannot allocate btree with key_size or data_size 0\n");
+        return NULL;
+    }
+    // Collection takes every record the tree does not point at for garbage.
+    if (vlog->owner != NULL) {
+        printf("Cannot allocate separated btree on a value log another btree uses\n");
+        return NULL;
+    }
+    // Leaves and messages carry handles; the values only exist in the log.
+    btree_t *tree = btree_allocate_with_flags(pool, key_size, sizeof(vlog_handle_t), flags);
+    if (tree == NULL)
+        return NULL;
+    tree->vlog = vlog;
+    vlog->owner = tree;
+    tree->value_size = value_size;
+    return tree;
+}
+
+/* A split hands its caller the separator (written to key, which must hold
+ * key_size bytes), the new right-hand sibling and how many entries ended up
+ * under it. */
+typedef struct {
+    int split;
+    char *key;
+    relation_t right;
+    size_t right_count;
+} btree_split_t;
+
+/* Deferred splits.
+ *
+ * While splits are deferred, an insert into a full leaf puts its key in a
+ * side page of the leaf instead, taken from spare pages the maintenance
+ * thread keeps on the tree's free list. The two pages are sorted on their
+ * own and share the leaf's parent slot; searches, overwrites and deletes
+ * look in both. The maintenance thread later shares their keys out between
+ * the leaf and the side page, which becomes the leaf's right half, and posts
+ * the split to the parent.
+ *
+ * The right half is linked in after the left one, as in a B-link tree: the
+ * left leaf keeps a pending split, with the separator, until the separator
+ * is in the parent (along with any splits that causes further up). Until
+ * then the parent's slot for the left leaf counts and covers both halves,
+ * and a key that reaches a leaf with a pending split moves right while it is
+ * at or above the separator. A leaf that fills up again in the meantime, or
+ * when every slot is taken, splits on the spot.
+ *
+ * The maintenance thread makes one split at a time and steps aside for any
+ * operation waiting for the lock, so operations never wait on more than the
+ * split in progress. While splits keep coming it polls for them, and only
+ * once it has gone to sleep does an insert pay for waking it. */
+
+static void btree_lock(btree_t *tree)
+{
+    btree_deferred_t *deferred = tree->deferred;
+    if (deferred == NULL)
+        return;
+    __atomic_add_fetch(&deferred->waiting, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&deferred->lock);
+    __atomic_sub_fetch(&deferred->waiting, 1, __ATOMIC_RELAXED);
+}
+
+static void btree_unlock(btree_t *tree)
+{
+    btree_deferred_t *deferred = tree->deferred;
+    if (deferred == NULL)
+        return;
+    // The maintenance thread stepped aside; hand it back the tree once no
+    // other operation is waiting.
+    if (deferred->yielded && __atomic_load_n(&deferred->waiting, __ATOMIC_RELAXED) == 0) {
+        deferred->yielded = 0;
+        pthread_cond_signal(&deferred->wake);
+    }
+    pthread_mutex_unlock(&deferred->lock);
+}
+
+static char* btree_deferred_key(btree_t *tree, size_t slot)
+{
+    return tree->deferred->keys + slot * tree->key_size;
+}
+
+/* The side page of a leaf whose split is still to be made, or NULL. */
+static leaf_node_t* btree_leaf_side(btree_t *tree, leaf_node_t *leaf, size_t *side_index)
+{
+    if (tree->deferred == NULL || leaf->header.pending_split == 0)
+        return NULL;
+    *side_index = tree->deferred->side[leaf->header.pending_split - 1];
+    if (*side_index == PAGE_INDEX_NONE)
+        return NULL;
+    return btree_leaf(tree, *side_index);
+}
+
+/* The separator of a split of the leaf that is made but not posted, or
+ * NULL. */
+static char* btree_leaf_pending_key(btree_t *tree, leaf_node_t *leaf)
+{
+    if (tree->deferred == NULL || leaf->header.pending_split == 0)
+        return NULL;
+    size_t slot = leaf->header.pending_split - 1;
+    if (tree->deferred->side[slot] != PAGE_INDEX_NONE)
+        return NULL;
+    return btree_deferred_key(tree, slot);
+}
+
+/* Follows pending splits right from the leaf at index to the leaf that
+ * holds key. */
+static size_t btree_leaf_chase(btree_t *tree, size_t index, char *key)
+{
+    if (tree->deferred == NULL)
+        return index;
+    leaf_node_t *leaf = btree_leaf(tree, index);
+    char *separator;
+    while (leaf != NULL && (separator = btree_leaf_pending_key(tree, leaf)) != NULL
+           && memcmp(key, separator, tree->key_size) >= 0) {
+        index = leaf->next;
+        leaf = btree_leaf(tree, index);
+    }
+    return index;
+}
+
+/* Keys in the leaf at index, its side page and the right halves of its
+ * pending splits, which are all under the same parent slot. */
+static size_t btree_leaf_chain_keys(btree_t *tree, size_t index)
+{
+    size_t count = 0;
+    for (;;) {
+        leaf_node_t *leaf = btree_leaf(tree, index);
+        if (leaf == NULL)
+            return count;
+        count += leaf->header.num_keys;
+        size_t side_index;
+        leaf_node_t *side = btree_leaf_side(tree, leaf, &side_index);
+        if (side != NULL)
+            return count + side->header.num_keys;
+        if (leaf->header.pending_split == 0)
+            return count;
+        index = leaf->next;
+    }
+}
+
+/* Queues a split of the leaf at left_index in a free slot, which the caller
+ * has made sure there is, and returns the slot. */
+static size_t btree_deferred_queue(btree_t *tree, size_t left_index)
+{
+    btree_deferred_t *deferred = tree->deferred;
+    size_t slot = 0;
+    while (deferred->left[slot] != PAGE_INDEX_NONE)
+        slot++;
+    deferred->left[slot] = left_index;
+    deferred->side[slot] = PAGE_INDEX_NONE;
+    deferred->queue[(deferred->head + deferred->len++) % BTREE_DEFERRED_SPLITS] = slot;
+    deferred->deferred++;
+    btree_leaf(tree, left_index)->header.pending_split = slot + 1;
+    page_pool_mark_dirty(tree->pool, left_index);
+    // Waking the thread costs the waker a system call, more than a split,
+    // so let a few gather first; while splits keep coming it polls instead.
+    if (deferred->sleeping && deferred->len == BTREE_DEFERRED_WAKE)
+        pthread_cond_signal(&deferred->wake);
+    return slot;
+}
+
+/* Queues the parent update for a split of the leaf at left_index, if a slot
+ * is free. Returns -1 if the caller has to make it now. */
+static int btree_defer_split(btree_t *tree, size_t left_index, btree_split_t *split)
+{
+    if (tree->deferred->len == BTREE_DEFERRED_SPLITS) {
+        tree->deferred->inline_splits++;
+        return -1;
+    }
+    size_t slot = btree_deferred_queue(tree, left_index);
+    memcpy(btree_deferred_key(tree, slot), split->key, tree->key_size);
+    return 0;
+}
+
+/* Puts key at pos in the leaf at index, which has room for it. */
+static void btree_leaf_put(btree_t *tree, size_t index, leaf_node_t *leaf, size_t pos, char *key, char *data)
+{
+    size_t n = leaf->header.num_keys;
+    memmove(leaf_key(tree, leaf, pos + 1), leaf_key(tree, leaf, pos), (n - pos) * tree->key_size);
+    memmove(leaf_data(tree, leaf, pos + 1), leaf_data(tree, leaf, pos), (n - pos) * tree->data_size);
+    memcpy(leaf_key(tree, leaf, pos), key, tree->key_size);
+    memcpy(leaf_data(tree, leaf, pos), data, tree->data_size);
+    leaf->header.num_keys++;
+    page_pool_mark_dirty(tree->pool, index);
+    tree->num_keys++;
+}
+
+/* Gives the full leaf at index a side page holding key, and queues its
+ * split. Returns -1 if the caller has to split the leaf now. */
+static int btree_leaf_overflow(btree_t *tree, size_t index, char *key, char *data)
+{
+    if (tree->deferred->len == BTREE_DEFERRED_SPLITS)
+        return -1;
+    size_t side_index;
+    leaf_node_t *side = btree_create_leaf(tree, &side_index);
+    if (side == NULL)
+        return -1;
+    size_t slot = btree_deferred_queue(tree, index);
+    tree->deferred->side[slot] = side_index;
+    btree_leaf_put(tree, side_index, side, 0, key, data);
+    return 0;
+}
+
+/* Makes the split of the leaf with slot's side page: the keys of both are
+ * shared out between them and the side page is linked in as the leaf's
+ * right half. The side page must not be empty. */
+static int btree_split_side(btree_t *tree, size_t slot)
+{
+    btree_deferred_t *deferred = tree->deferred;
+    size_t index = deferred->left[slot];
+    size_t right_index = deferred->side[slot];
+    leaf_node_t *leaf = btree_leaf(tree, index);
+    leaf_node_t *right = btree_leaf(tree, right_index);
+    if (leaf == NULL || right == NULL)
+        return -1;
+    uint64_t split_start = latency_start();
+
+    // A side page that sorts after all of the leaf, as ascending inserts
+    // leave it, already is the right half.
+    size_t n = leaf->header.num_keys;
+    size_t m = right->header.num_keys;
+    if (n > 0 && memcmp(leaf_key(tree, leaf, n - 1), leaf_key(tree, right, 0), tree->key_size) > 0) {
+        size_t total = n + m;
+        size_t mid = total / 2;
+        char keys[total * tree->key_size];
+        char data[total * tree->data_size];
+        size_t i = 0, j = 0;
+        for (size_t k = 0; k < total; k++) {
+            leaf_node_t *from = right;
+            size_t pos;
+            if (j == m || (i < n && memcmp(leaf_key(tree, leaf, i), leaf_key(tree, right, j), tree->key_size) < 0)) {
+                from = leaf;
+                pos = i++;
+            } else {
+                pos = j++;
+            }
+            memcpy(keys + k * tree->key_size, leaf_key(tree, from, pos), tree->key_size);
+            memcpy(data + k * tree->data_size, leaf_data(tree, from, pos), tree->data_size);
+        }
+        memcpy(leaf_key(tree, leaf, 0), keys, mid * tree->key_size);
+        memcpy(leaf_data(tree, leaf, 0), data, mid * tree->data_size);
+        memcpy(leaf_key(tree, right, 0), keys + mid * tree->key_size, (total - mid) * tree->key_size);
+        memcpy(leaf_data(tree, right, 0), data + mid * tree->data_size, (total - mid) * tree->data_size);
+        leaf->header.num_keys = mid;
+        right->header.num_keys = total - mid;
+    }
+
+    right->next = leaf->next;
+    right->prev = index;
+    if (leaf->next != PAGE_INDEX_NONE) {
+        leaf_node_t *next = btree_leaf(tree, leaf->next);
+        if (next == NULL)
+            return -1;
+        next->prev = right_index;
+        page_pool_mark_dirty(tree->pool, leaf->next);
+    }
+    leaf->next = right_index;
+    if (tree->rightmost_leaf == index)
+        tree->rightmost_leaf = right_index;
+    memcpy(btree_deferred_key(tree, slot), leaf_key(tree, right, 0), tree->key_size);
+    deferred->side[slot] = PAGE_INDEX_NONE;
+    if (tree->flags & BTREE_LEARNED) {
+        leaf_model_fit(tree, leaf);
+        leaf_model_fit(tree, right);
+    }
+    page_pool_mark_dirty(tree->pool, index);
+    page_pool_mark_dirty(tree->pool, right_index);
+    latency_end(LATENCY_SPLIT, split_start);
+    return 0;
+}
+
+static int btree_leaf_insert(btree_t *tree, size_t index, char *key, char *data, btree_split_t *split)
+{
+    index = btree_leaf_chase(tree, index, key);
+    leaf_node_t *leaf = btree_leaf(tree, index);
+    if (leaf == NULL)
+        return -1;
+    size_t n = leaf->header.num_keys;
+    size_t pos = leaf_lower_bound(tree, leaf, key);
+
+    if (pos < n && memcmp(leaf_key(tree, leaf, pos), key, tree->key_size) == 0) {
+        memcpy(leaf_data(tree, leaf, pos), data, tree->data_size);
+        page_pool_mark_dirty(tree->pool, index);
+        return 0;
+    }
+
+    size_t side_index;
+    leaf_node_t *side = btree_leaf_side(tree, leaf, &side_index);
+    if (side != NULL) {
+        size_t m = side->header.num_keys;
+        size_t side_pos = leaf_lower_bound(tree, side, key);
+        if (side_pos < m && memcmp(leaf_key(tree, side, side_pos), key, tree->key_size) == 0) {
+            memcpy(leaf_data(tree, side, side_pos), data, tree->data_size);
+            page_pool_mark_dirty(tree->pool, side_index);
+            return 0;
+        }
+        if (n == tree->leaf_capacity && m < tree->leaf_capacity) {
+            btree_leaf_put(tree, side_index, side, side_pos, key, data);
+            leaf_model_update(tree, side, side_pos, key, 1);
+            return 0;
+        }
+        // With both pages full, the split cannot wait: make it, then insert
+        // into whichever half the key belongs in.
+        if (n == tree->leaf_capacity) {
+            if (btree_split_side(tree, leaf->header.pending_split - 1) != 0)
+                return -1;
+            return btree_leaf_insert(tree, index, key, data, split);
+        }
+    } else if (n == tree->leaf_capacity && tree->deferred != NULL && leaf->header.pending_split == 0
+               && btree_leaf_overflow(tree, index, key, data) == 0) {
+        return 0;
+    }
+
+    uint64_t split_start = 0;
+    if (n == tree->leaf_capacity) {
+        split_start = latency_start();
+        size_t right_index;
+        leaf_node_t *right = btree_create_leaf(tree, &right_index);
+        if (right == NULL)
+            return -1;
+
+        // Appending past the end of the last leaf starts a new leaf and leaves
+        // this one full, so ascending inserts pack leaves completely.
+        size_t mid = (leaf->next == PAGE_INDEX_NONE && pos == n) ? n : n / 2;
+        size_t moved = n - mid;
+        memcpy(leaf_key(tree, right, 0), leaf_key(tree, leaf, mid), moved * tree->key_size);
+        memcpy(leaf_data(tree, right, 0), leaf_data(tree, leaf, mid), moved * tree->data_size);
+        right->header.num_keys = moved;
+        leaf->header.num_keys = mid;
+
+        right->next = leaf->next;
+        right->prev = index;
+        if (leaf->next != PAGE_INDEX_NONE) {
+            leaf_node_t *next = btree_leaf(tree, leaf->next);
+            if (next == NULL)
+                return -1;
+            next->prev = right_index;
+            page_pool_mark_dirty(tree->pool, leaf->next);
+        }
+        leaf->next = right_index;
+        page_pool_mark_dirty(tree->pool, index);
+        if (tree->rightmost_leaf == index)
+            tree->rightmost_leaf = right_index;
+
+        split->split = 1;
+        split->right.node_type = NODE_TYPE_LEAF;
+        split->right.index = right_index;
+        if (moved > 0)
+            memcpy(split->key, leaf_key(tree, right, 0), tree->key_size);
+        else
+            memcpy(split->key, key, tree->key_size);
+
+        if (pos > mid || moved == 0) {
+            pos -= mid;
+            leaf = right;
+            index = right_index;
+        }
+    }
+
+    btree_leaf_put(tree, index, leaf, pos, key, data);
+    if (split->split) {
+        leaf_node_t *right = btree_leaf(tree, split->right.index);
+        leaf_node_t *left = btree_leaf(tree, right->prev);
+        // A pending split of the left half now separates the right half from
+        // its next leaf.
+        right->header.pending_split = left->header.pending_split;
+        left->header.pending_split = 0;
+        if (right->header.pending_split != 0)
+            tree->deferred->left[right->header.pending_split - 1] = split->right.index;
+        split->right_count = btree_leaf_chain_keys(tree, split->right.index);
+        // Both halves get a fresh model, so splits are where models are fit.
+        if (tree->flags & BTREE_LEARNED) {
+            leaf_model_fit(tree, right);
+            leaf_model_fit(tree, left);
+        }
+        if (tree->deferred != NULL && btree_defer_split(tree, right->prev, split) == 0)
+            split->split = 0;
+        latency_end(LATENCY_SPLIT, split_start);
+    } else {
+        leaf_model_update(tree, leaf, pos, key, 1);
+    }
+    return 0;
+}
+
+static int btree_leaf_remove(btree_t *tree, size_t index, char *key)
+{
+    index = btree_leaf_chase(tree, index, key);
+    leaf_node_t *leaf = btree_leaf(tree, index);
+    if (leaf == NULL)
+        return -1;
+    size_t n = leaf->header.num_keys;
+    size_t pos = leaf_lower_bound(tree, leaf, key);
+    if (pos == n || memcmp(leaf_key(tree, leaf, pos), key, tree->key_size) != 0) {
+        size_t side_index;
+        leaf_node_t *side = btree_leaf_side(tree, leaf, &side_index);
+        if (side == NULL)
+            return -1;
+        n = side->header.num_keys;
+        pos = leaf_lower_bound(tree, side, key);
+        if (pos == n || memcmp(leaf_key(tree, side, pos), key, tree->key_size) != 0)
+            return -1;
+        leaf = side;
+        index = side_index;
+    }
+
+    // Leaves are allowed to underflow; separators above stay valid bounds.
+    memmove(leaf_key(tree, leaf, pos), leaf_key(tree, leaf, pos + 1), (n - pos - 1) * tree->key_size);
+    memmove(leaf_data(tree, leaf, pos), leaf_data(tree, leaf, pos + 1), (n - pos - 1) * tree->data_size);
+    leaf->header.num_keys--;
+    page_pool_mark_dirty(tree->pool, index);
+    tree->num_keys--;
+    leaf_model_update(tree, leaf, pos, key, 0);
+    // Deleted keys stay set in the filter until it is rebuilt.
+    if (tree->bloom != NULL)
+        tree->bloom_deletes++;
+    return 0;
+}
+
+static void buffer_put(btree_t *tree, internal_node_t *node, char *message)
+{
+    size_t *n = internal_num_messages(tree, node);
+    size_t pos = buffer_lower_bound(tree, node, message_key(message));
+    if (pos == *n || memcmp(message_key(internal_message(tree, node, pos)), message_key(message), tree->key_size) != 0) {
+        memmove(internal_message(tree, node, pos + 1), internal_message(tree, node, pos),
+                (*n - pos) * btree_message_size(tree));
+        (*n)++;
+    }
+    memcpy(internal_message(tree, node, pos), message, btree_message_size(tree));
+}
+
+static void buffer_remove(btree_t *tree, internal_node_t *node, size_t pos)
+{
+    size_t *n = internal_num_messages(tree, node);
+    memmove(internal_message(tree, node, pos), internal_message(tree, node, pos + 1),
+            (*n - pos - 1) * btree_message_size(tree));
+    (*n)--;
+}
+
+/* Inserts the separator and right child of a split child at slot. rightmost
+ * is set when this node is the last on its level. */
+static int btree_internal_insert_child(btree_t *tree, size_t index, size_t slot, int rightmost,
+                                       char *key, relation_t right, size_t right_count,
+                                       btree_split_t *split)
+{
+    internal_node_t *node = btree_internal(tree, index);
+    if (node == NULL)
+        return -1;
+    size_t n = node->header.num_keys;
+    uint64_t split_start = n == tree->internal_capacity ? latency_start() : 0;
+
+    if (n == tree->internal_capacity && rightmost && slot == n && !(tree->flags & BTREE_BUFFERED)) {
+        // As for leaves, a new last child starts a new node of its own.
+        size_t right_index;
+        internal_node_t *sibling = btree_create_internal(tree, &right_index);
+        if (sibling == NULL)
+            return -1;
+        sibling->children[0] = right;
+        internal_counts(tree, sibling)[0] = right_count;
+        memcpy(split->key, key, tree->key_size);
+        split->split = 1;
+        split->right.node_type = NODE_TYPE_INTERNAL;
+        split->right.index = right_index;
+        split->right_count = right_count;
+        latency_end(LATENCY_SPLIT, split_start);
+        return 0;
+    }
+
+    if (n == tree->internal_capacity) {
+        size_t right_index;
+        internal_node_t *sibling = btree_create_internal(tree, &right_index);
+        if (sibling == NULL)
+            return -1;
+
+        // keys[mid] moves up; everything after it moves right.
+        size_t mid = n / 2;
+        size_t moved = n - mid - 1;
+        memcpy(split->key, internal_key(tree, node, mid), tree->key_size);
+        memcpy(internal_key(tree, sibling, 0), internal_key(tree, node, mid + 1), moved * tree->key_size);
+        memcpy(sibling->children, &node->children[mid + 1], (moved + 1) * sizeof(relation_t));
+        btree_unswizzle(tree, node);
+        memcpy(internal_counts(tree, sibling), &internal_counts(tree, node)[mid + 1], (moved + 1) * sizeof(size_t));
+        sibling->header.num_keys = moved;
+        node->header.num_keys = mid;
+
+        if (tree->flags & BTREE_BUFFERED) {
+            // Pending messages follow their keys to whichever half covers them.
+            size_t *num_messages = internal_num_messages(tree, node);
+            size_t first = buffer_lower_bound(tree, node, split->key);
+            size_t moved_messages = *num_messages - first;
+            memcpy(internal_message(tree, sibling, 0), internal_message(tree, node, first),
+                   moved_messages * btree_message_size(tree));
+            *internal_num_messages(tree, sibling) = moved_messages;
+            *num_messages = first;
+        }
+        page_pool_mark_dirty(tree->pool, index);
+
+        split->split = 1;
+        split->right.node_type = NODE_TYPE_INTERNAL;
+        split->right.index = right_index;
+
+        if (slot > mid) {
+            slot -= mid + 1;
+            node = sibling;
+            index = right_index;
+        }
+        n = node->header.num_keys;
+    }
+
+    btree_unswizzle(tree, node);
+    memmove(internal_key(tree, node, slot + 1), internal_key(tree, node, slot), (n - slot) * tree->key_size);
+    memmove(&node->children[slot + 2], &node->children[slot + 1], (n - slot) * sizeof(relation_t));
+    size_t *counts = internal_counts(tree, node);
+    memmove(&counts[slot + 2], &counts[slot + 1], (n - slot) * sizeof(size_t));
+    memcpy(internal_key(tree, node, slot), key, tree->key_size);
+    node->children[slot + 1] = right;
+    counts[slot + 1] = right_count;
+    node->header.num_keys++;
+    page_pool_mark_dirty(tree->pool, index);
+
+    if (split->split) {
+        internal_node_t *sibling = btree_internal(tree, split->right.index);
+        size_t *sibling_counts = internal_counts(tree, sibling);
+        split->right_count = 0;
+        for (size_t i = 0; i <= sibling->header.num_keys; i++)
+            split->right_count += sibling_counts[i];
+        latency_end(LATENCY_SPLIT, split_start);
+    }
+    return 0;
+}
+
+/* Folds the entries a child gained or lost (seen as the change in num_keys
+ * since before) into its count, and splits the count if the child split. */
+static void btree_update_count(btree_t *tree, internal_node_t *node, size_t slot,
+                               size_t before, btree_split_t *child_split)
+{
+    size_t *counts = internal_counts(tree, node);
+    counts[slot] += tree->num_keys - before;
+    if (child_split->split)
+        counts[slot] -= child_split->right_count;
+}
+
+static int btree_leaf_apply(btree_t *tree, size_t index, char *message, btree_split_t *split)
+{
+    if (message[0] == BTREE_MESSAGE_DELETE) {
+        // Nothing to do if the key was never there.
+        btree_leaf_remove(tree, index, message_key(message));
+        return 0;
+    }
+    return btree_leaf_insert(tree, index, message_key(message), message_data(tree, message), split);
+}
+
+/* Applies a message at the leaf level straight away, dropping any older
+ * message for the same key from buffers on the way down. */
+static int btree_node_apply(btree_t *tree, relation_t node, int rightmost, char *message, btree_split_t *split)
+{
+    if (node.node_type == NODE_TYPE_LEAF)
+        return btree_leaf_apply(tree, node.index, message, split);
+
+    internal_node_t *internal = btree_internal(tree, node.index);
+    if (internal == NULL)
+        return -1;
+    if (tree->flags & BTREE_BUFFERED) {
+        size_t pos = buffer_lower_bound(tree, internal, message_key(message));
+        if (pos < *internal_num_messages(tree, internal)
+            && memcmp(message_key(internal_message(tree, internal, pos)), message_key(message), tree->key_size) == 0) {
+            buffer_remove(tree, internal, pos);
+            page_pool_mark_dirty(tree->pool, node.index);
+        }
+    }
+    size_t slot = internal_child_slot(tree, internal, message_key(message));
+
+    char child_key[tree->key_size];
+    btree_split_t child_split = { 0, child_key };
+    rightmost = rightmost && slot == internal->header.num_keys;
+    size_t before = tree->num_keys;
+    if (btree_node_apply(tree, internal->children[slot], rightmost, message, &child_split) != 0)
+        return -1;
+    btree_update_count(tree, internal, slot, before, &child_split);
+    page_pool_mark_dirty(tree->pool, node.index);
+    if (!child_split.split)
+        return 0;
+    return btree_internal_insert_child(tree, node.index, slot, rightmost, child_key,
+                                       child_split.right, child_split.right_count, split);
+}
+
+static int btree_node_put(btree_t *tree, relation_t node, char *message, btree_split_t *split);
+
+/* Moves the messages bound for the child with the most of them down a level.
+ * Stops early if that child splits, since this node may then have to split
+ * too; at least one message has always left the buffer by then. */
+static int btree_flush_node(btree_t *tree, size_t index, btree_split_t *split)
+{
+    internal_node_t *node = btree_internal(tree, index);
+    if (node == NULL)
+        return -1;
+
+    // Messages are sorted, so each child's are contiguous.
+    size_t n = *internal_num_messages(tree, node);
+    size_t best_slot = 0, best_start = 0, best_count = 0;
+    size_t start = 0;
+    while (start < n) {
+        size_t slot = internal_child_slot(tree, node, message_key(internal_message(tree, node, start)));
+        size_t end = start + 1;
+        while (end < n && internal_child_slot(tree, node, message_key(internal_message(tree, node, end))) == slot)
+            end++;
+        if (end - start > best_count) {
+            best_slot = slot;
+            best_start = start;
+            best_count = end - start;
+        }
+        start = end;
+    }
+
+    char message[btree_message_size(tree)];
+    for (size_t i = 0; i < best_count; i++) {
+        memcpy(message, internal_message(tree, node, best_start), sizeof(message));
+        buffer_remove(tree, node, best_start);
+        page_pool_mark_dirty(tree->pool, index);
+
+        char child_key[tree->key_size];
+        btree_split_t child_split = { 0, child_key };
+        size_t before = tree->num_keys;
+        if (btree_node_put(tree, node->children[best_slot], message, &child_split) != 0)
+            return -1;
+        btree_update_count(tree, node, best_slot, before, &child_split);
+        if (child_split.split)
+            return btree_internal_insert_child(tree, index, best_slot, 0, child_key,
+                                               child_split.right, child_split.right_count, split);
+    }
+    return 0;
+}
+
+/* Adds a message to a node's buffer, flushing first if it is full. Leaves
+ * have no buffer and apply the message immediately. */
+static int btree_node_put(btree_t *tree, relation_t node, char *message, btree_split_t *split)
+{
+    if (node.node_type == NODE_TYPE_LEAF)
+        return btree_leaf_apply(tree, node.index, message, split);
+
+    internal_node_t *internal = btree_internal(tree, node.index);
+    if (internal == NULL)
+        return -1;
+    size_t index = node.index;
+    size_t n = *internal_num_messages(tree, internal);
+    size_t pos = buffer_lower_bound(tree, internal, message_key(message));
+    int replaces = pos < n
+        && memcmp(message_key(internal_message(tree, internal, pos)), message_key(message), tree->key_size) == 0;
+
+    if (!replaces && n == tree->message_capacity) {
+        if (btree_flush_node(tree, index, split) != 0)
+            return -1;
+        if (split->split && memcmp(message_key(message), split->key, tree->key_size) >= 0) {
+            index = split->right.index;
+            internal = btree_internal(tree, index);
+            if (internal == NULL)
+                return -1;
+        }
+    }
+    buffer_put(tree, internal, message);
+    page_pool_mark_dirty(tree->pool, index);
+    return 0;
+}
+
+static int btree_grow_root(btree_t *tree, btree_split_t *split)
+{
+    size_t root_index;
+    internal_node_t *root = btree_create_internal(tree, &root_index);
+    if (root == NULL) {
+        printf("Failed to grow btree root\n");
+        return -1;
+    }
+    root->header.num_keys = 1;
+    root->children[0] = tree->root;
+    root->children[1] = split->right;
+    internal_counts(tree, root)[0] = tree->num_keys - split->right_count;
+    internal_counts(tree, root)[1] = split->right_count;
+    memcpy(internal_key(tree, root, 0), split->key, tree->key_size);
+    tree->root.node_type = NODE_TYPE_INTERNAL;
+    tree->root.index = root_index;
+    return 0;
+}
+
+/* Adds keys appended by the fast path to the counts down the right edge,
+ * which it skips to avoid descending. */
+static int btree_settle_appends(btree_t *tree)
+{
+    if (tree->pending_appends == 0)
+        return 0;
+    relation_t node = tree->root;
+    while (node.node_type == NODE_TYPE_INTERNAL) {
+        internal_node_t *internal = btree_internal(tree, node.index);
+        if (internal == NULL)
+            return -1;
+        internal_counts(tree, internal)[internal->header.num_keys] += tree->pending_appends;
+        page_pool_mark_dirty(tree->pool, node.index);
+        node = internal->children[internal->header.num_keys];
+    }
+    tree->pending_appends = 0;
+    return 0;
+}
+
+/* Applies a message at its leaf, even in a buffered tree. */
+static int btree_root_apply(btree_t *tree, char *message)
+{
+    if (btree_settle_appends(tree) != 0)
+        return -1;
+    char split_key[tree->key_size];
+    btree_split_t split = { 0, split_key };
+    if (btree_node_apply(tree, tree->root, 1, message, &split) != 0)
+        return -1;
+    if (split.split)
+        return btree_grow_root(tree, &split);
+    return 0;
+}
+
+/* Sends a message into the tree from the root, buffering it if the tree
+ * is buffered and applying it to its leaf otherwise. */
+static int btree_root_message(btree_t *tree, char *message)
+{
+    if (!(tree->flags & BTREE_BUFFERED))
+        return btree_root_apply(tree, message);
+
+    char split_key[tree->key_size];
+    btree_split_t split = { 0, split_key };
+    if (btree_node_put(tree, tree->root, message, &split) != 0)
+        return -1;
+    if (split.split)
+        return btree_grow_root(tree, &split);
+    return 0;
+}
+
+/* Appends key to the last leaf without descending, if it sorts after
+ * everything in the tree and there is room. Returns 1 if it did. */
+static int btree_try_append(btree_t *tree, char *key, char *data)
+{
+    // A buffered tree may hold a newer message for key above the leaf.
+    if (tree->flags & BTREE_BUFFERED)
+        return 0;
+    leaf_node_t *leaf = btree_leaf(tree, tree->rightmost_leaf);
+    if (leaf == NULL)
+        return 0;
+    size_t n = leaf->header.num_keys;
+    // An empty last leaf doesn't say where its range starts.
+    if (n == 0 || n == tree->leaf_capacity)
+        return 0;
+    if (memcmp(key, leaf_key(tree, leaf, n - 1), tree->key_size) <= 0)
+        return 0;
+    // Keys in a side page do not sort after the leaf's, so key may be there.
+    size_t side_index;
+    if (btree_leaf_side(tree, leaf, &side_index) != NULL)
+        return 0;
+
+    memcpy(leaf_key(tree, leaf, n), key, tree->key_size);
+    memcpy(leaf_data(tree, leaf, n), data, tree->data_size);
+    leaf->header.num_keys++;
+    page_pool_mark_dirty(tree->pool, tree->rightmost_leaf);
+    leaf_model_update(tree, leaf, n, key, 1);
+    tree->num_keys++;
+    tree->pending_appends++;
+    return 1;
+}
+
+static void btree_bloom_add(btree_t *tree, char *key);
+static void btree_bloom_refresh(btree_t *tree);
+static int btree_bloom_fill(btree_t *tree);
+static int btree_post_splits(btree_t *tree);
+
+static void btree_insert_pair(btree_t *tree, char *key, char *data)
+{
+    vlog_handle_t handle;
+    if (tree->vlog != NULL) {
+        if (vlog_append(tree->vlog, key, tree->key_size, data, tree->value_size, &handle) != 0) {
+            printf("Failed to insert into btree\n");
+            return;
+        }
+        data = (char*)&handle;
+    }
+
+    if (btree_try_append(tree, key, data)) {
+        btree_bloom_add(tree, key);
+        return;
+    }
+
+    char message[btree_message_size(tree)];
+    message[0] = BTREE_MESSAGE_INSERT;
+    memcpy(message_key(message), key, tree->key_size);
+    memcpy(message_data(tree, message), data, tree->data_size);
+
+    if (btree_root_message(tree, message) != 0) {
+        printf("Failed to insert into btree\n");
+        return;
+    }
+    btree_bloom_add(tree, key);
+}
+
+void btree_insert(btree_t *tree, char *key, char *data)
+{
+    uint64_t start = latency_start();
+    btree_lock(tree);
+    if (tree->trace != NULL)
+        trace_record(tree->trace, TRACE_INSERT, key, data);
+    btree_insert_pair(tree, key, data);
+    btree_unlock(tree);
+    latency_end(LATENCY_INSERT, start);
+}
+
+/* Batched inserts are sorted by key, then by position in the batch so that
+ * the last of several pairs for one key can be picked out. */
+typedef struct {
+    char *key;
+    char *data;
+    size_t key_size;
+    size_t order;
+} btree_batch_entry_t;
+
+static int btree_batch_compare(const void *a, const void *b)
+{
+    const btree_batch_entry_t *x = a, *y = b;
+    int cmp = memcmp(x->key, y->key, x->key_size);
+    if (cmp != 0)
+        return cmp;
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+// Each root split adds a level and at least doubles the number of leaves,
+// so no tree in a pool of size_t-indexed pages gets deeper than this.
+#define BTREE_MAX_HEIGHT (8 * sizeof(size_t) + 1)
+
+/* Inserts every entry that belongs in the leaf for entries[*i], as long as
+ * the leaf has room, with a single descent. Returns -1 on failure. */
+static int btree_batch_leaf(btree_t *tree, btree_batch_entry_t *entries, size_t n, size_t *i)
+{
+    size_t path[BTREE_MAX_HEIGHT], slots[BTREE_MAX_HEIGHT];
+    size_t depth = 0;
+    // Keys from the smallest separator right of the path on belong elsewhere.
+    char *bound = NULL;
+    relation_t node = tree->root;
+    while (node.node_type == NODE_TYPE_INTERNAL) {
+        internal_node_t *internal = btree_internal(tree, node.index);
+        if (internal == NULL)
+            return -1;
+        size_t slot = internal_child_slot(tree, internal, entries[*i].key);
+        if (slot < internal->header.num_keys)
+            bound = internal_key(tree, internal, slot);
+        path[depth] = node.index;
+        slots[depth++] = slot;
+        node = internal->children[slot];
+    }
+    node.index = btree_leaf_chase(tree, node.index, entries[*i].key);
+    leaf_node_t *leaf = btree_leaf(tree, node.index);
+    if (leaf == NULL)
+        return -1;
+    char *separator = btree_leaf_pending_key(tree, leaf);
+    if (separator != NULL)
+        bound = separator;
+
+    size_t before = tree->num_keys;
+    char split_key[tree->key_size];
+    btree_split_t split = { 0, split_key };
+    for (; *i < n; (*i)++) {
+        char *key = entries[*i].key;
+        if (bound != NULL && memcmp(key, bound, tree->key_size) >= 0)
+            break;
+        // A full leaf only takes overwrites; a new key would split it.
+        if (leaf->header.num_keys == tree->leaf_capacity) {
+            size_t pos = leaf_lower_bound(tree, leaf, key);
+            if (pos == tree->leaf_capacity || memcmp(leaf_key(tree, leaf, pos), key, tree->key_size) != 0)
+                break;
+        }
+        if (btree_leaf_insert(tree, node.index, key, entries[*i].data, &split) != 0)
+            return -1;
+        btree_bloom_add(tree, key);
+    }
+
+    size_t added = tree->num_keys - before;
+    for (size_t d = 0; d < depth && added > 0; d++) {
+        internal_node_t *internal = btree_internal(tree, path[d]);
+        if (internal == NULL)
+            return -1;
+        internal_counts(tree, internal)[slots[d]] += added;
+        page_pool_mark_dirty(tree->pool, path[d]);
+    }
+    return 0;
+}
+
+void btree_insert_batch(btree_t *tree, kvp_t *pairs, size_t n)
+{
+    // Buffered trees already gather inserts at the root.
+    if (tree->flags & BTREE_BUFFERED) {
+        for (size_t i = 0; i < n; i++)
+            btree_insert(tree, pairs[i].key, pairs[i].data);
+        return;
+    }
+    if (n == 0)
+        return;
+    btree_lock(tree);
+    if (tree->trace != NULL) {
+        for (size_t i = 0; i < n; i++)
+            trace_record(tree->trace, TRACE_INSERT, pairs[i].key, pairs[i].data);
+    }
+    btree_batch_entry_t *entries = (btree_batch_entry_t*)malloc(n * sizeof(btree_batch_entry_t));
+    vlog_handle_t *handles = NULL;
+    if (tree->vlog != NULL)
+        handles = (vlog_handle_t*)malloc(n * sizeof(vlog_handle_t));
+    if (entries == NULL || (tree->vlog != NULL && handles == NULL)) {
+        printf("Failed to allocate btree batch of %zu pairs\n", n);
+        goto out;
+    }
+    for (size_t i = 0; i < n; i++) {
+        entries[i].key = pairs[i].key;
+        entries[i].data = pairs[i].data;
+        entries[i].key_size = tree->key_size;
+        entries[i].order = i;
+        if (handles != NULL) {
+            if (vlog_append(tree->vlog, pairs[i].key, tree->key_size, pairs[i].data,
+                            tree->value_size, &handles[i]) != 0) {
+                printf("Failed to insert batch into btree\n");
+                goto out;
+            }
+            entries[i].data = (char*)&handles[i];
+        }
+    }
+    qsort(entries, n, sizeof(btree_batch_entry_t), btree_batch_compare);
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i + 1 < n && memcmp(entries[i].key, entries[i + 1].key, tree->key_size) == 0)
+            continue;
+        entries[unique++] = entries[i];
+    }
+
+    if (btree_settle_appends(tree) != 0) {
+        printf("Failed to insert batch into btree\n");
+        goto out;
+    }
+    size_t i = 0;
+    while (i < unique) {
+        size_t start = i;
+        if (btree_batch_leaf(tree, entries, unique, &i) != 0) {
+            printf("Failed to insert batch into btree\n");
+            goto out;
+        }
+        if (i > start)
+            continue;
+        // The leaf is full: split it the usual way and descend again after.
+        char message[btree_message_size(tree)];
+        message[0] = BTREE_MESSAGE_INSERT;
+        memcpy(message_key(message), entries[i].key, tree->key_size);
+        memcpy(message_data(tree, message), entries[i].data, tree->data_size);
+        if (btree_root_apply(tree, message) != 0) {
+            printf("Failed to insert batch into btree\n");
+            goto out;
+        }
+        btree_bloom_add(tree, entries[i].key);
+        i++;
+    }
+out:
+    btree_unlock(tree);
+    free(entries);
+    free(handles);
+}
+
+/* Looks key up in one resident node. Returns the slot of the child to go
+ * on to, or PAGE_INDEX_NONE once the answer is known: then *data points at
+ * the key's data in a leaf or buffered insert message, or is NULL if the key
+ * is not in the tree. */
+static size_t btree_locate_in(btree_t *tree, relation_t node, page_t *page, char *key,
+                              char **data, size_t *page_index)
+{
+    *data = NULL;
+    if (node.node_type == NODE_TYPE_INTERNAL) {
+        internal_node_t *internal = (internal_node_t*)page->data;
+        if (tree->flags & BTREE_BUFFERED) {
+            // The first pending message on the way down is the newest.
+            size_t pos = buffer_lower_bound(tree, internal, key);
+            char *message = internal_message(tree, internal, pos);
+            if (pos < *internal_num_messages(tree, internal)
+                && memcmp(message_key(message), key, tree->key_size) == 0) {
+                if (message[0] == BTREE_MESSAGE_INSERT) {
+                    *data = message_data(tree, message);
+                    *page_index = node.index;
+                }
+                return PAGE_INDEX_NONE;
+            }
+        }
+        return internal_child_slot(tree, internal, key);
+    }
+
+    leaf_node_t *leaf = (leaf_node_t*)page->data;
+    if (leaf->header.pending_split != 0 && tree->deferred != NULL) {
+        node.index = btree_leaf_chase(tree, node.index, key);
+        if ((leaf = btree_leaf(tree, node.index)) == NULL)
+            return PAGE_INDEX_NONE;
+    }
+    size_t n = leaf->header.num_keys;
+    size_t pos = leaf_lower_bound(tree, leaf, key);
+    if (pos < n && memcmp(leaf_key(tree, leaf, pos), key, tree->key_size) == 0) {
+        *data = leaf_data(tree, leaf, pos);
+        *page_index = node.index;
+        return PAGE_INDEX_NONE;
+    }
+    size_t side_index;
+    leaf_node_t *side = btree_leaf_side(tree, leaf, &side_index);
+    if (side != NULL) {
+        n = side->header.num_keys;
+        pos = leaf_lower_bound(tree, side, key);
+        if (pos < n && memcmp(leaf_key(tree, side, pos), key, tree->key_size) == 0) {
+            *data = leaf_data(tree, side, pos);
+            *page_index = side_index;
+        }
+    }
+    return PAGE_INDEX_NONE;
+}
+
+/* Finds where key's data lives: in a leaf, or in a buffered insert message.
+ * Sets *data to NULL if the key is not in the tree. */
+static void btree_locate(btree_t *tree, char *key, char **data, size_t *page_index)
+{
+    *data = NULL;
+    // A negative answer from the filter is definite, so no page is touched.
+    if (tree->bloom != NULL && !bloom_may_contain(tree->bloom, key, tree->key_size))
+        return;
+    relation_t node = tree->root;
+    page_t *page = page_pool_get_page(tree->pool, node.index);
+    while (page != NULL) {
+        size_t slot = btree_locate_in(tree, node, page, key, data, page_index);
+        if (slot == PAGE_INDEX_NONE)
+            return;
+        internal_node_t *internal = (internal_node_t*)page->data;
+        page = btree_child_page(tree, node.index, internal, slot);
+        node = internal->children[slot];
+    }
+}
+
+/* btree_locate for the public searches, which are traced and timed; lookups
+ * made on the tree's own behalf, such as by value log collection, are not. */
+static void btree_search_locate(btree_t *tree, char *key, char **data, size_t *page_index)
+{
+    if (tree->trace != NULL)
+        trace_record(tree->trace, TRACE_SEARCH, key, NULL);
+    uint64_t start = latency_start();
+    btree_locate(tree, key, data, page_index);
+    latency_end(LATENCY_SEARCH, start);
+}
+
+void btree_search(btree_t *tree, char *key, char **data)
+{
+    size_t page_index;
+    btree_lock(tree);
+    btree_search_locate(tree, key, data, &page_index);
+    btree_unlock(tree);
+}
+
+int btree_search_value(btree_t *tree, char *key, char *value)
+{
+    char *data;
+    size_t page_index;
+    int ret = -1;
+    btree_lock(tree);
+    btree_search_locate(tree, key, &data, &page_index);
+    if (data != NULL && tree->vlog == NULL) {
+        memcpy(value, data, tree->data_size);
+        ret = 0;
+    } else if (data != NULL) {
+        // Handles in leaves and messages need not be aligned.
+        vlog_handle_t handle;
+        memcpy(&handle, data, sizeof(handle));
+        ret = vlog_read(tree->vlog, &handle, tree->key_size, value);
+    }
+    btree_unlock(tree);
+    return ret;
+}
+
+int btree_search_view(btree_t *tree, char *key, btree_view_t *view)
+{
+    char *data;
+    size_t page_index;
+    memset(view, 0, sizeof(*view));
+    btree_lock(tree);
+    btree_search_locate(tree, key, &data, &page_index);
+    int pinned = data != NULL && page_pool_pin(tree->pool, page_index) == 0;
+    btree_unlock(tree);
+    if (!pinned)
+        return -1;
+    view->pool = tree->pool;
+    view->index = page_index;
+    view->version = tree->pool->meta[page_index].version;
+    view->data = data;
+    view->size = tree->data_size;
+    return 0;
+}
+
+int btree_view_valid(btree_view_t *view)
+{
+    return view->data != NULL && view->pool->meta[view->index].version == view->version;
+}
+
+void btree_view_release(btree_view_t *view)
+{
+    if (view->data == NULL) {
+        printf("Warning: tried to release an empty btree_view_t\n");
+        return;
+    }
+    page_pool_unpin(view->pool, view->index);
+    view->data = NULL;
+}
+
+/* Lookups that overlap their reads.
+ *
+ * Each pending lookup remembers the node it has reached. Stepping a lookup
+ * descends through resident pages until one is missing, starts the read of
+ * that page and leaves the lookup where it is; polling steps every pending
+ * lookup in turn and, when all of them are waiting, blocks for a single read
+ * to land. */
+
+btree_lookups_t* btree_lookups_init(btree_t *tree, size_t capacity)
+{
+    if (capacity == 0) {
+        printf("Cannot initialize btree_lookups_t with capacity 0\n");
+        return NULL;
+    }
+    btree_lookups_t *lookups = (btree_lookups_t*)malloc(sizeof(btree_lookups_t) + capacity * sizeof(btree_lookup_t));
+    if (lookups == NULL) {
+        printf("Failed to allocate btree_lookups_t\n");
+        return NULL;
+    }
+    lookups->tree = tree;
+    lookups->capacity = capacity;
+    lookups->len = 0;
+    return lookups;
+}
+
+/* Advances a lookup through resident pages, or through every page when
+ * block is set. Returns 1 once its answer is known, and 0 while it waits
+ * for a read. */
+static int btree_lookup_step(btree_t *tree, btree_lookup_t *lookup, int block, char **data)
+{
+    size_t page_index;
+    for (;;) {
+        page_t *page;
+        if (block) {
+            page = page_pool_get_page(tree->pool, lookup->node.index);
+            if (page == NULL) {
+                *data = NULL;
+                return 1;
+            }
+        } else {
+            page = page_pool_try_get_page(tree->pool, lookup->node.index);
+            if (page == NULL) {
+                page_pool_prefetch(tree->pool, lookup->node.index, 1);
+                return 0;
+            }
+        }
+        size_t slot = btree_locate_in(tree, lookup->node, page, lookup->key, data, &page_index);
+        if (slot == PAGE_INDEX_NONE)
+            return 1;
+        lookup->node = ((internal_node_t*)page->data)->children[slot];
+    }
+}
+
+/* Steps pending lookup i, and on completion removes it before running its
+ * callback, which may submit more lookups. */
+static int btree_lookups_advance(btree_lookups_t *lookups, size_t i, int block)
+{
+    char *data;
+    if (!btree_lookup_step(lookups->tree, &lookups->lookups[i], block, &data))
+        return 0;
+    btree_lookup_t done = lookups->lookups[i];
+    lookups->lookups[i] = lookups->lookups[--lookups->len];
+    done.callback(done.arg, done.key, data);
+    return 1;
+}
+
+int btree_lookup_submit(btree_lookups_t *lookups, char *key, btree_lookup_callback_t callback, void *arg)
+{
+    if (lookups->len == lookups->capacity) {
+        printf("Cannot submit lookup, %zu are already pending\n", lookups->len);
+        return -1;
+    }
+    btree_t *tree = lookups->tree;
+    btree_lock(tree);
+    if (tree->trace != NULL)
+        trace_record(tree->trace, TRACE_SEARCH, key, NULL);
+    // Lookups in flight hold on to internal nodes, which the maintenance
+    // thread is only left alone to change while none are pending.
+    int ret = btree_post_splits(tree);
+    btree_unlock(tree);
+    if (ret != 0)
+        return -1;
+    if (tree->bloom != NULL && !bloom_may_contain(tree->bloom, key, tree->key_size)) {
+        callback(arg, key, NULL);
+        return 0;
+    }
+    btree_lookup_t *lookup = &lookups->lookups[lookups->len++];
+    lookup->key = key;
+    lookup->callback = callback;
+    lookup->arg = arg;
+    lookup->node = tree->root;
+    btree_lookups_advance(lookups, lookups->len - 1, 0);
+    return 0;
+}
+
+size_t btree_lookups_poll(btree_lookups_t *lookups)
+{
+    size_t completed = 0;
+    while (lookups->len > 0) {
+        for (size_t i = 0; i < lookups->len; ) {
+            if (btree_lookups_advance(lookups, i, 0))
+                completed++;
+            else
+                i++;
+        }
+        if (completed > 0 || lookups->len == 0)
+            break;
+        // Every lookup is waiting on a read. If none is in flight to wait
+        // for, a read could not be started, so finish one the slow way.
+        if (page_pool_wait(lookups->tree->pool) != 0)
+            completed += btree_lookups_advance(lookups, 0, 1);
+    }
+    return completed;
+}
+
+void btree_lookups_drain(btree_lookups_t *lookups)
+{
+    while (lookups->len > 0)
+        btree_lookups_poll(lookups);
+}
+
+void btree_lookups_free(btree_lookups_t *lookups)
+{
+    if (lookups == NULL) {
+        printf("Warning: tried to free NULL btree_lookups_t*\n");
+        return;
+    }
+    if (lookups->len > 0)
+        printf("Warning: freeing btree_lookups_t with %zu lookups pending\n", lookups->len);
+    free(lookups);
+}
+
+static int btree_delete_key(btree_t *tree, char *key)
+{
+    if (tree->bloom != NULL && !bloom_may_contain(tree->bloom, key, tree->key_size))
+        return -1;
+
+    char message[btree_message_size(tree)];
+    memset(message, 0, sizeof(message));
+    message[0] = BTREE_MESSAGE_DELETE;
+    memcpy(message_key(message), key, tree->key_size);
+    size_t before = tree->num_keys;
+    if (btree_root_message(tree, message) != 0)
+        return -1;
+    // Whether the key exists is only known once the delete reaches its leaf,
+    // so a buffered delete succeeds as soon as it is queued.
+    if (!(tree->flags & BTREE_BUFFERED) && tree->num_keys == before)
+        return -1;
+
+    btree_bloom_refresh(tree);
+    return 0;
+}
+
+int btree_delete(btree_t *tree, char *key)
+{
+    btree_lock(tree);
+    if (tree->trace != NULL)
+        trace_record(tree->trace, TRACE_DELETE, key, NULL);
+    int ret = btree_delete_key(tree, key);
+    btree_unlock(tree);
+    return ret;
+}
+
+int btree_trace_start(btree_t *tree, const char *path, unsigned long long sample)
+{
+    if (tree->trace != NULL) {
+        printf("Cannot start tracing a btree that is already traced\n");
+        return -1;
+    }
+    // Values are traced as the caller passed them, before any value log.
+    tree->trace = trace_open(path, tree->key_size, tree->value_size, sample);
+    return tree->trace == NULL ? -1 : 0;
+}
+
+int btree_trace_stop(btree_t *tree)
+{
+    if (tree->trace == NULL) {
+        printf("Cannot stop tracing a btree that is not traced\n");
+        return -1;
+    }
+    int ret = trace_close(tree->trace);
+    tree->trace = NULL;
+    return ret;
+}
+
+/* Inserts post, the right half of a leaf split, below node at the slot
+ * after the one key leads to, making any splits that takes on the way back
+ * up. */
+static int btree_post_in(btree_t *tree, relation_t node, int rightmost, btree_split_t *post,
+                         btree_split_t *split)
+{
+    internal_node_t *internal = btree_internal(tree, node.index);
+    if (internal == NULL)
+        return -1;
+    size_t slot = internal_child_slot(tree, internal, post->key);
+    rightmost = rightmost && slot == internal->header.num_keys;
+
+    char child_key[tree->key_size];
+    btree_split_t child_split = { 0, child_key };
+    btree_split_t *below = post;
+    if (internal->children[slot].node_type == NODE_TYPE_INTERNAL) {
+        if (btree_post_in(tree, internal->children[slot], rightmost, post, &child_split) != 0)
+            return -1;
+        if (!child_split.split)
+            return 0;
+        below = &child_split;
+    }
+    internal_counts(tree, internal)[slot] -= below->right_count;
+    page_pool_mark_dirty(tree->pool, node.index);
+    return btree_internal_insert_child(tree, node.index, slot, rightmost, below->key,
+                                       below->right, below->right_count, split);
+}
+
+static void btree_release_page(btree_t *tree, size_t index, page_t *page);
+
+/* Frees the slot of the oldest pending split. */
+static void btree_deferred_dequeue(btree_t *tree)
+{
+    btree_deferred_t *deferred = tree->deferred;
+    deferred->left[deferred->queue[deferred->head]] = PAGE_INDEX_NONE;
+    deferred->head = (deferred->head + 1) % BTREE_DEFERRED_SPLITS;
+    deferred->len--;
+}
+
+/* Makes the oldest pending split, if it is still to be made, and its parent
+ * update. */
+static int btree_post_split(btree_t *tree)
+{
+    btree_deferred_t *deferred = tree->deferred;
+    size_t slot = deferred->queue[deferred->head];
+    size_t left_index = deferred->left[slot];
+    // The right half's count below takes in keys appended to it by the fast
+    // path, so they have to be in the parent's count first.
+    if (btree_settle_appends(tree) != 0)
+        return -1;
+    leaf_node_t *left = btree_leaf(tree, left_index);
+    if (left == NULL)
+        return -1;
+    size_t side_index = deferred->side[slot];
+    if (side_index != PAGE_INDEX_NONE) {
+        page_t *side = page_pool_get_page(tree->pool, side_index);
+        if (side == NULL)
+            return -1;
+        if (((leaf_node_t*)side->data)->header.num_keys == 0) {
+            // Deletes emptied the side page, so there is nothing to split.
+            btree_release_page(tree, side_index, side);
+            left->header.pending_split = 0;
+            page_pool_mark_dirty(tree->pool, left_index);
+            btree_deferred_dequeue(tree);
+            return 0;
+        }
+        if (btree_split_side(tree, slot) != 0)
+            return -1;
+    }
+    btree_split_t post = { 1, btree_deferred_key(tree, slot) };
+    post.right.node_type = NODE_TYPE_LEAF;
+    post.right.index = left->next;
+    post.right_count = btree_leaf_chain_keys(tree, left->next);
+    left->header.pending_split = 0;
+    page_pool_mark_dirty(tree->pool, left_index);
+
+    char split_key[tree->key_size];
+    btree_split_t split = { 0, split_key };
+    int ret;
+    if (tree->root.node_type == NODE_TYPE_LEAF) {
+        ret = btree_grow_root(tree, &post);
+    } else {
+        ret = btree_post_in(tree, tree->root, 1, &post, &split);
+        if (ret == 0 && split.split)
+            ret = btree_grow_root(tree, &split);
+    }
+    if (ret != 0) {
+        left->header.pending_split = slot + 1;
+        return -1;
+    }
+    btree_deferred_dequeue(tree);
+    deferred->posted++;
+    return 0;
+}
+
+/* Makes every pending parent update, with the tree lock held. */
+static int btree_post_splits(btree_t *tree)
+{
+    if (tree->deferred == NULL)
+        return 0;
+    while (tree->deferred->len > 0) {
+        if (btree_post_split(tree) != 0) {
+            printf("Failed to post deferred btree split\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Puts a new page on the tree's free list for a side page to take, as long
+ * as the pool has more pages left than are spare already. */
+static int btree_add_spare(btree_t *tree)
+{
+    page_pool_t *pool = tree->pool;
+    if (pool->max_len - pool->len <= tree->deferred->spares)
+        return -1;
+    size_t index;
+    page_t *page = page_pool_create_page(pool, &index);
+    if (page == NULL)
+        return -1;
+    btree_release_page(tree, index, page);
+    tree->deferred->spares++;
+    return 0;
+}
+
+/* Waits up to BTREE_DEFERRED_POLL_NS for the tree, or until woken. */
+static void btree_maintenance_poll(btree_deferred_t *deferred)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_nsec += BTREE_DEFERRED_POLL_NS;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&deferred->wake, &deferred->lock, &until);
+}
+
+static void* btree_maintenance(void *arg)
+{
+    btree_t *tree = (btree_t*)arg;
+    btree_deferred_t *deferred = tree->deferred;
+    // A batch thread does not preempt the thread that wakes it, so splits
+    // are made in time the inserting threads leave over.
+    struct sched_param param = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_BATCH, &param);
+    size_t idle_polls = 0;
+    pthread_mutex_lock(&deferred->lock);
+    while (!deferred->stop) {
+        // Operations waiting for the tree go first; the last of them wakes
+        // the thread again.
+        if (__atomic_load_n(&deferred->waiting, __ATOMIC_RELAXED) > 0) {
+            deferred->yielded = 1;
+            pthread_cond_wait(&deferred->wake, &deferred->lock);
+            continue;
+        }
+        if (deferred->len > 0 && !deferred->failed) {
+            if (btree_post_split(tree) != 0) {
+                // Readers still find everything through the pending splits;
+                // btree_deferred_stop tries again.
+                printf("Failed to post deferred btree split\n");
+                deferred->failed = 1;
+            }
+            idle_polls = 0;
+            continue;
+        }
+        if (deferred->spares < BTREE_DEFERRED_SPARES && btree_add_spare(tree) == 0)
+            continue;
+        if (idle_polls++ < BTREE_DEFERRED_IDLE_POLLS) {
+            btree_maintenance_poll(deferred);
+        } else {
+            deferred->sleeping = 1;
+            pthread_cond_wait(&deferred->wake, &deferred->lock);
+            deferred->sleeping = 0;
+            idle_polls = 0;
+        }
+    }
+    pthread_mutex_unlock(&deferred->lock);
+    return NULL;
+}
+
+int btree_deferred_start(btree_t *tree)
+{
+    if (tree->deferred != NULL) {
+        printf("Cannot defer splits of a btree that already defers them\n");
+        return -1;
+    }
+    // Buffered messages split nodes on their own way down.
+    if (tree->flags & BTREE_BUFFERED) {
+        printf("Cannot defer splits of a buffered btree\n");
+        return -1;
+    }
+    // Reading a page from a file changes the pool, which readers share.
+    if (tree->pool->fd >= 0) {
+        printf("Cannot defer splits of a btree in a file-backed pool\n");
+        return -1;
+    }
+    btree_deferred_t *deferred = (btree_deferred_t*)calloc(1, sizeof(btree_deferred_t)
+                                                           + BTREE_DEFERRED_SPLITS * tree->key_size);
+    if (deferred == NULL) {
+        printf("Failed to allocate btree_deferred_t\n");
+        return -1;
+    }
+    for (size_t i = 0; i < BTREE_DEFERRED_SPLITS; i++)
+        deferred->left[i] = PAGE_INDEX_NONE;
+    pthread_mutex_init(&deferred->lock, NULL);
+    // Polls time out on the monotonic clock.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&deferred->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    tree->deferred = deferred;
+    if (pthread_create(&deferred->thread, NULL, btree_maintenance, tree) != 0) {
+        printf("Failed to start btree maintenance thread\n");
+        tree->deferred = NULL;
+        pthread_mutex_destroy(&deferred->lock);
+        pthread_cond_destroy(&deferred->wake);
+        free(deferred);
+        return -1;
+    }
+    return 0;
+}
+
+int btree_deferred_stop(btree_t *tree)
+{
+    btree_deferred_t *deferred = tree->deferred;
+    if (deferred == NULL) {
+        printf("Cannot stop deferring splits of a btree that does not defer them\n");
+        return -1;
+    }
+    if (!deferred->stop) {
+        pthread_mutex_lock(&deferred->lock);
+        deferred->stop = 1;
+        pthread_cond_signal(&deferred->wake);
+        pthread_mutex_unlock(&deferred->lock);
+        pthread_join(deferred->thread, NULL);
+    }
+    if (btree_post_splits(tree) != 0)
+        return -1;
+    tree->deferred = NULL;
+    pthread_mutex_destroy(&deferred->lock);
+    pthread_cond_destroy(&deferred->wake);
+    free(deferred);
+    btree_bloom_refresh(tree);
+    return 0;
+}
+
+/* Makes subtree counts exact: pushes pending messages to the leaves,
+ * settles fast-path appends and posts deferred splits. */
+static int btree_prepare_counts(btree_t *tree)
+{
+    if (btree_flush(tree) != 0)
+        return -1;
+    if (btree_settle_appends(tree) != 0)
+        return -1;
+    return btree_post_splits(tree);
+}
+
+static size_t btree_rank_key(btree_t *tree, char *key)
+{
+    if (btree_prepare_counts(tree) != 0)
+        return 0;
+    size_t rank = 0;
+    relation_t node = tree->root;
+    page_t *page = page_pool_get_page(tree->pool, node.index);
+    while (node.node_type == NODE_TYPE_INTERNAL) {
+        if (page == NULL)
+            return 0;
+        internal_node_t *internal = (internal_node_t*)page->data;
+        // Separators are the smallest key of the next child, so a key equal
+        // to one belongs to the right and everything to the left is smaller.
+        size_t slot = internal_child_slot(tree, internal, key);
+        size_t *counts = internal_counts(tree, internal);
+        for (size_t i = 0; i < slot; i++)
+            rank += counts[i];
+        page = btree_child_page(tree, node.index, internal, slot);
+        node = internal->children[slot];
+    }
+    if (page == NULL)
+        return 0;
+    return rank + leaf_lower_bound(tree, (leaf_node_t*)page->data, key);
+}
+
+size_t btree_rank(btree_t *tree, char *key)
+{
+    btree_lock(tree);
+    size_t rank = btree_rank_key(tree, key);
+    btree_unlock(tree);
+    return rank;
+}
+
+static int btree_select_rank(btree_t *tree, size_t rank, char **key, char **data)
+{
+    *key = NULL;
+    *data = NULL;
+    if (btree_prepare_counts(tree) != 0)
+        return -1;
+    if (rank >= tree->num_keys)
+        return -1;
+    relation_t node = tree->root;
+    page_t *page = page_pool_get_page(tree->pool, node.index);
+    while (node.node_type == NODE_TYPE_INTERNAL) {
+        if (page == NULL)
+            return -1;
+        internal_node_t *internal = (internal_node_t*)page->data;
+        size_t *counts = internal_counts(tree, internal);
+        size_t slot = 0;
+        while (slot < internal->header.num_keys && rank >= counts[slot])
+            rank -= counts[slot++];
+        page = btree_child_page(tree, node.index, internal, slot);
+        node = internal->children[slot];
+    }
+    if (page == NULL)
+        return -1;
+    leaf_node_t *leaf = (leaf_node_t*)page->data;
+    if (rank >= leaf->header.num_keys)
+        return -1;
+    *key = leaf_key(tree, leaf, rank);
+    *data = leaf_data(tree, leaf, rank);
+    return 0;
+}
+
+int btree_select(btree_t *tree, size_t rank, char **key, char **data)
+{
+    btree_lock(tree);
+    int ret = btree_select_rank(tree, rank, key, data);
+    btree_unlock(tree);
+    return ret;
+}
+
+size_t btree_count_range(btree_t *tree, char *start, char *end)
+{
+    btree_lock(tree);
+    if (tree->trace != NULL)
+        trace_record(tree->trace, TRACE_SCAN, start, end);
+    size_t start_rank = btree_rank_key(tree, start);
+    size_t end_rank = btree_rank_key(tree, end);
+    btree_unlock(tree);
+    return end_rank > start_rank ? end_rank - start_rank : 0;
+}
+
+int btree_flush(btree_t *tree)
+{
+    if (!(tree->flags & BTREE_BUFFERED))
+        return 0;
+
+    // Every buffer above the shallowest level holding messages is empty, so
+    // that level's messages are the newest for their keys and can be applied
+    // from the root. Root splits push levels down, so rescan from the top.
+    size_t *level = (size_t*)malloc(sizeof(size_t) * tree->pool->max_len);
+    size_t *next_level = (size_t*)malloc(sizeof(size_t) * tree->pool->max_len);
+    char *messages = NULL;
+    int ret = -1;
+    if (level == NULL || next_level == NULL) {
+        printf("Failed to allocate btree flush state\n");
+        goto out;
+    }
+
+    for (;;) {
+        size_t level_len = 0, total = 0;
+        if (tree->root.node_type == NODE_TYPE_INTERNAL)
+            level[level_len++] = tree->root.index;
+        while (level_len > 0) {
+            size_t next_len = 0;
+            for (size_t i = 0; i < level_len; i++) {
+                internal_node_t *node = btree_internal(tree, level[i]);
+                if (node == NULL)
+                    goto out;
+                total += *internal_num_messages(tree, node);
+                for (size_t c = 0; c <= node->header.num_keys; c++) {
+                    if (node->children[c].node_type == NODE_TYPE_INTERNAL)
+                        next_level[next_len++] = node->children[c].index;
+                }
+            }
+            if (total > 0)
+                break;
+            size_t *swap = level;
+            level = next_level;
+            next_level = swap;
+            level_len = next_len;
+        }
+        if (total == 0)
+            break;
+
+        size_t message_size = btree_message_size(tree);
+        messages = (char*)malloc(total * message_size);
+        if (messages == NULL) {
+            printf("Failed to allocate btree flush state\n");
+            goto out;
+        }
+        size_t copied = 0;
+        for (size_t i = 0; i < level_len; i++) {
+            internal_node_t *node = btree_internal(tree, level[i]);
+            size_t *n = internal_num_messages(tree, node);
+            memcpy(messages + copied * message_size, internal_message(tree, node, 0), *n * message_size);
+            copied += *n;
+            *n = 0;
+            page_pool_mark_dirty(tree->pool, level[i]);
+        }
+        for (size_t i = 0; i < total; i++) {
+            if (btree_root_apply(tree, messages + i * message_size) != 0)
+                goto out;
+        }
+        free(messages);
+        messages = NULL;
+    }
+    ret = 0;
+
+out:
+    free(messages);
+    free(level);
+    free(next_level);
+    return ret;
+}
+
+
+/* bloom filter */
+
+static void btree_bloom_add(btree_t *tree, char *key)
+{
+    if (tree->bloom == NULL)
+        return;
+    bloom_add(tree->bloom, key, tree->key_size);
+    btree_bloom_refresh(tree);
+}
+
+/* Rebuilds the filter once it has outgrown its size or its deleted keys. */
+static void btree_bloom_refresh(btree_t *tree)
+{
+    // Keys in side pages are not on the leaf chain yet, so while splits are
+    // deferred the rebuild waits for btree_deferred_stop.
+    if (tree->bloom == NULL || tree->deferred != NULL)
+        return;
+    // Past twice the sized capacity the false positive rate is too high to
+    // be worth checking, so grow the filter; once deleted keys make up half
+    // of it, it is cheaper to start again.
+    if (tree->num_keys > 2 * tree->bloom_capacity || tree->bloom_deletes > tree->num_keys)
+        btree_bloom_fill(tree);
+}
+
+int btree_bloom_enable(btree_t *tree, size_t expected_keys)
+{
+    tree->bloom_capacity = expected_keys;
+    return btree_bloom_rebuild(tree);
+}
+
+int btree_bloom_rebuild(btree_t *tree)
+{
+    if (tree->deferred != NULL) {
+        printf("Cannot build a bloom filter while btree splits are deferred\n");
+        return -1;
+    }
+    return btree_bloom_fill(tree);
+}
+
+static int btree_bloom_fill(btree_t *tree)
+{
+    // Keys still waiting in buffers must be in the filter too.
+    if (btree_flush(tree) != 0)
+        return -1;
+    if (tree->bloom_capacity < tree->num_keys)
+        tree->bloom_capacity = tree->num_keys;
+    bloom_t *bloom = bloom_init(tree->bloom_capacity, BLOOM_BITS_PER_KEY);
+    if (bloom == NULL)
+        return -1;
+
+    size_t index, ahead = 0;
+    leaf_node_t *leaf = btree_first_leaf(tree, &index);
+    while (leaf != NULL) {
+        btree_leaf_readahead(tree, leaf, &ahead);
+        for (size_t i = 0; i < leaf->header.num_keys; i++)
+            bloom_add(bloom, leaf_key(tree, leaf, i), tree->key_size);
+        if (leaf->next == PAGE_INDEX_NONE)
+            break;
+        leaf = btree_leaf(tree, leaf->next);
+    }
+    if (leaf == NULL) {
+        printf("Failed to read btree leaves while building bloom filter\n");
+        bloom_free(bloom);
+        return -1;
+    }
+
+    if (tree->bloom != NULL)
+        bloom_free(tree->bloom);
+    tree->bloom = bloom;
+    tree->bloom_deletes = 0;
+    return 0;
+}
+
+/* Reads the values of a leaf's keys from the value log into values. */
+static int btree_freeze_values(btree_t *tree, leaf_node_t *leaf, char *values)
+{
+    for (size_t i = 0; i < leaf->header.num_keys; i++) {
+        // Handles in leaves need not be aligned.
+        vlog_handle_t handle;
+        memcpy(&handle, leaf_data(tree, leaf, i), sizeof(handle));
+        if (vlog_read(tree->vlog, &handle, tree->key_size, values + i * tree->value_size) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int btree_freeze(btree_t *tree, const char *path)
+{
+    if (tree->deferred != NULL) {
+        printf("Cannot freeze a btree while its splits are deferred\n");
+        return -1;
+    }
+    // Buffered operations have to reach the leaves to be in the image.
+    if (btree_flush(tree) != 0)
+        return -1;
+    // +1 so an empty tree still gets valid buffers. The image holds values,
+    // not handles into a log that collection goes on to rewrite.
+    char *keys = (char*)malloc(tree->num_keys * tree->key_size + 1);
+    char *data = (char*)malloc(tree->num_keys * tree->value_size + 1);
+    if (keys == NULL || data == NULL) {
+        printf("Failed to allocate %zu keys to freeze\n", tree->num_keys);
+        free(keys);
+        free(data);
+        return -1;
+    }
+
+    size_t index, n = 0, ahead = 0;
+    leaf_node_t *leaf = btree_first_leaf(tree, &index);
+    while (leaf != NULL) {
+        btree_leaf_readahead(tree, leaf, &ahead);
+        size_t num_keys = leaf->header.num_keys;
+        memcpy(keys + n * tree->key_size, leaf_key(tree, leaf, 0), num_keys * tree->key_size);
+        if (tree->vlog == NULL) {
+            memcpy(data + n * tree->data_size, leaf_data(tree, leaf, 0), num_keys * tree->data_size);
+        } else if (btree_freeze_values(tree, leaf, data + n * tree->value_size) != 0) {
+            leaf = NULL;
+            break;
+        }
+        n += num_keys;
+        if (leaf->next == PAGE_INDEX_NONE)
+            break;
+        leaf = btree_leaf(tree, leaf->next);
+    }
+    int ret = -1;
+    if (leaf == NULL)
+        printf("Failed to read btree leaves while freezing\n");
+    else
+        ret = frozen_write(path, tree->key_size, tree->value_size, n, keys, data);
+    free(keys);
+    free(data);
+    return ret;
+}
+
+/* Defragmentation.
+ *
+ * Random inserts leave leaves that are next to each other in key order
+ * scattered across the pool, and often half empty. A defrag step first
+ * refills leaves from their right-hand siblings, then permutes the tree's
+ * pages so the internal nodes come first and the leaves follow in key order,
+ * which turns a scan into a sequential run of pages. Each step does at most
+ * a given amount of work, so callers can interleave it with other operations.
+ */
+
+static void btree_release_page(btree_t *tree, size_t index, page_t *page)
+{
+    memset(page, 0, sizeof(page_t));
+    memcpy(page->data, &tree->free_page, sizeof(size_t));
+    page_pool_mark_dirty(tree->pool, index);
+    tree->free_page = index;
+}
+
+/* Moves keys from the front of the leaf at children[slot + 1] to the end of
+ * the one at children[slot] until the left one holds target keys, dropping
+ * the right one if it empties. */
+static int btree_defrag_refill_pair(btree_t *tree, size_t index, internal_node_t *parent,
+                                    size_t slot, size_t target)
+{
+    size_t left_index = parent->children[slot].index;
+    size_t right_index = parent->children[slot + 1].index;
+    leaf_node_t *left = btree_leaf(tree, left_index);
+    leaf_node_t *right = btree_leaf(tree, right_index);
+    if (left == NULL || right == NULL)
+        return -1;
+    size_t moved = target - left->header.num_keys;
+    if (moved > right->header.num_keys)
+        moved = right->header.num_keys;
+    size_t kept = right->header.num_keys - moved;
+
+    memcpy(leaf_key(tree, left, left->header.num_keys), leaf_key(tree, right, 0), moved * tree->key_size);
+    memcpy(leaf_data(tree, left, left->header.num_keys), leaf_data(tree, right, 0), moved * tree->data_size);
+    memmove(leaf_key(tree, right, 0), leaf_key(tree, right, moved), kept * tree->key_size);
+    memmove(leaf_data(tree, right, 0), leaf_data(tree, right, moved), kept * tree->data_size);
+    left->header.num_keys += moved;
+    right->header.num_keys = kept;
+    page_pool_mark_dirty(tree->pool, left_index);
+    page_pool_mark_dirty(tree->pool, right_index);
+
+    size_t *counts = internal_counts(tree, parent);
+    counts[slot] += moved;
+    counts[slot + 1] -= moved;
+    if (kept > 0) {
+        // The separator is the smallest key on its right, which just changed.
+        memcpy(internal_key(tree, parent, slot), leaf_key(tree, right, 0), tree->key_size);
+        if (tree->flags & BTREE_LEARNED) {
+            leaf_model_fit(tree, left);
+            leaf_model_fit(tree, right);
+        }
+        page_pool_mark_dirty(tree->pool, index);
+        return 0;
+    }
+
+    left->next = right->next;
+    if (right->next != PAGE_INDEX_NONE) {
+        leaf_node_t *next = btree_leaf(tree, right->next);
+        if (next == NULL)
+            return -1;
+        next->prev = left_index;
+        page_pool_mark_dirty(tree->pool, right->next);
+    }
+    if (tree->rightmost_leaf == right_index)
+        tree->rightmost_leaf = left_index;
+    if (tree->flags & BTREE_LEARNED)
+        leaf_model_fit(tree, left);
+
+    size_t n = parent->header.num_keys;
+    memmove(internal_key(tree, parent, slot), internal_key(tree, parent, slot + 1),
+            (n - slot - 1) * tree->key_size);
+    btree_unswizzle(tree, parent);
+    memmove(&parent->children[slot + 1], &parent->children[slot + 2], (n - slot - 1) * sizeof(relation_t));
+    memmove(&counts[slot + 1], &counts[slot + 2], (n - slot - 1) * sizeof(size_t));
+    parent->header.num_keys--;
+    page_pool_mark_dirty(tree->pool, index);
+    btree_release_page(tree, right_index, (page_t*)right);
+    return 0;
+}
+
+static int btree_defrag_refill(btree_t *tree, size_t index, size_t target, size_t *budget)
+{
+    internal_node_t *node = btree_internal(tree, index);
+    if (node == NULL)
+        return -1;
+    if (node->children[0].node_type == NODE_TYPE_INTERNAL) {
+        for (size_t i = 0; i <= node->header.num_keys && *budget > 0; i++) {
+            if (btree_defrag_refill(tree, node->children[i].index, target, budget) != 0)
+                return -1;
+        }
+        return 0;
+    }
+    btree_prefetch_children(tree, node, 0, node->header.num_keys + 1);
+    size_t slot = 0;
+    while (slot < node->header.num_keys && *budget > 0) {
+        leaf_node_t *left = btree_leaf(tree, node->children[slot].index);
+        if (left == NULL)
+            return -1;
+        if (left->header.num_keys >= target) {
+            slot++;
+            continue;
+        }
+        if (btree_defrag_refill_pair(tree, index, node, slot, target) != 0)
+            return -1;
+        (*budget)--;
+    }
+    return 0;
+}
+
+/* A tree page and the parent slot that points at it. Pages are identified
+ * by their position in the plan, as swaps keep changing their indexes. */
+typedef struct {
+    node_type_t node_type;
+    size_t index;
+    size_t parent;
+    size_t slot;
+} btree_defrag_node_t;
+
+/* The tree's pages, and where each of them should end up. */
+typedef struct {
+    btree_defrag_node_t *nodes;
+    // Leaves are nodes[first_leaf..num_tree), free pages nodes[num_tree..len).
+    size_t first_leaf;
+    size_t num_tree;
+    size_t len;
+    size_t *targets;
+    // Plan entry at each pool index, or PAGE_INDEX_NONE for other pages.
+    size_t *owner;
+} btree_defrag_plan_t;
+
+static void btree_defrag_plan_free(btree_defrag_plan_t *plan)
+{
+    free(plan->nodes);
+    free(plan->targets);
+    free(plan->owner);
+}
+
+static int btree_defrag_compare_index(const void *a, const void *b)
+{
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int btree_defrag_plan(btree_t *tree, btree_defrag_plan_t *plan)
+{
+    size_t max_len = tree->pool->max_len;
+    plan->nodes = (btree_defrag_node_t*)malloc(sizeof(btree_defrag_node_t) * max_len);
+    plan->targets = (size_t*)malloc(sizeof(size_t) * max_len);
+    plan->owner = (size_t*)malloc(sizeof(size_t) * max_len);
+    if (plan->nodes == NULL || plan->targets == NULL || plan->owner == NULL) {
+        printf("Failed to allocate btree defrag plan\n");
+        btree_defrag_plan_free(plan);
+        return -1;
+    }
+
+    // Breadth first, so internal nodes come first and the leaves, all on the
+    // last level, follow in key order.
+    btree_defrag_node_t *nodes = plan->nodes;
+    nodes[0].node_type = tree->root.node_type;
+    nodes[0].index = tree->root.index;
+    nodes[0].parent = PAGE_INDEX_NONE;
+    size_t len = 1;
+    plan->first_leaf = 0;
+    for (size_t i = 0; i < len && nodes[i].node_type == NODE_TYPE_INTERNAL; i++) {
+        internal_node_t *node = btree_internal(tree, nodes[i].index);
+        if (node == NULL) {
+            btree_defrag_plan_free(plan);
+            return -1;
+        }
+        for (size_t j = 0; j <= node->header.num_keys; j++) {
+            nodes[len].node_type = node->children[j].node_type;
+            nodes[len].index = node->children[j].index;
+            nodes[len].parent = i;
+            nodes[len].slot = j;
+            len++;
+        }
+        plan->first_leaf = i + 1;
+    }
+    plan->num_tree = len;
+    for (size_t i = tree->free_page; i != PAGE_INDEX_NONE; len++) {
+        page_t *page = page_pool_get_page(tree->pool, i);
+        if (page == NULL) {
+            btree_defrag_plan_free(plan);
+            return -1;
+        }
+        nodes[len].index = i;
+        nodes[len].parent = PAGE_INDEX_NONE;
+        memcpy(&i, page->data, sizeof(size_t));
+    }
+    plan->len = len;
+
+    // The tree keeps the set of indexes it has; only their order changes.
+    for (size_t i = 0; i < max_len; i++)
+        plan->owner[i] = PAGE_INDEX_NONE;
+    for (size_t i = 0; i < len; i++) {
+        plan->targets[i] = nodes[i].index;
+        plan->owner[nodes[i].index] = i;
+    }
+    qsort(plan->targets, len, sizeof(size_t), btree_defrag_compare_index);
+    return 0;
+}
+
+/* Points every reference to tree page i of the plan at its current index. */
+static int btree_defrag_relink(btree_t *tree, btree_defrag_plan_t *plan, size_t i)
+{
+    btree_defrag_node_t *nodes = plan->nodes;
+    size_t index = nodes[i].index;
+    if (i == 0) {
+        tree->root.index = index;
+    } else {
+        size_t parent_index = nodes[nodes[i].parent].index;
+        internal_node_t *parent = btree_internal(tree, parent_index);
+        if (parent == NULL)
+            return -1;
+        parent->children[nodes[i].slot].index = index;
+        page_pool_mark_dirty(tree->pool, parent_index);
+    }
+    if (i < plan->first_leaf)
+        return 0;
+    if (i > plan->first_leaf) {
+        leaf_node_t *prev = btree_leaf(tree, nodes[i - 1].index);
+        if (prev == NULL)
+            return -1;
+        prev->next = index;
+        page_pool_mark_dirty(tree->pool, nodes[i - 1].index);
+    }
+    if (i + 1 < plan->num_tree) {
+        leaf_node_t *next = btree_leaf(tree, nodes[i + 1].index);
+        if (next == NULL)
+            return -1;
+        next->prev = index;
+        page_pool_mark_dirty(tree->pool, nodes[i + 1].index);
+    } else {
+        tree->rightmost_leaf = index;
+    }
+    return 0;
+}
+
+/* Exchanges the pages at two pool indexes, contents and bookkeeping alike. */
+static int btree_defrag_swap(btree_t *tree, btree_defrag_plan_t *plan, size_t a, size_t b)
+{
+    page_pool_t *pool = tree->pool;
+    // Both must be resident so their contents move, and both get written
+    // back at their new indexes.
+    if (page_pool_get_page(pool, a) == NULL || page_pool_get_page(pool, b) == NULL)
+        return -1;
+    page_t *page = pool->pages[a];
+    pool->pages[a] = pool->pages[b];
+    pool->pages[b] = page;
+    page_meta_t meta = pool->meta[a];
+    pool->meta[a] = pool->meta[b];
+    pool->meta[b] = meta;
+    pool->epoch++;
+    page_pool_mark_dirty(pool, a);
+    page_pool_mark_dirty(pool, b);
+
+    size_t x = plan->owner[a], y = plan->owner[b];
+    plan->owner[a] = y;
+    plan->owner[b] = x;
+    plan->nodes[x].index = b;
+    if (y != PAGE_INDEX_NONE)
+        plan->nodes[y].index = a;
+    if (x < plan->num_tree && btree_defrag_relink(tree, plan, x) != 0)
+        return -1;
+    if (y < plan->num_tree && btree_defrag_relink(tree, plan, y) != 0)
+        return -1;
+    return 0;
+}
+
+/* Swaps each page of the plan to its target index, at most budget times.
+ * Pinned pages stay where they are, as views refer to them by index. */
+static int btree_defrag_place(btree_t *tree, size_t *budget)
+{
+    btree_defrag_plan_t plan;
+    if (btree_defrag_plan(tree, &plan) != 0)
+        return -1;
+    page_meta_t *meta = tree->pool->meta;
+    int ret = 0;
+    for (size_t i = 0; i < plan.len && *budget > 0; i++) {
+        size_t from = plan.nodes[i].index, to = plan.targets[i];
+        if (from == to || meta[from].pins > 0 || meta[to].pins > 0)
+            continue;
+        if (btree_defrag_swap(tree, &plan, from, to) != 0) {
+            ret = -1;
+            break;
+        }
+        (*budget)--;
+    }
+
+    // Free pages hold nothing but the list, so it is simply rebuilt.
+    tree->free_page = PAGE_INDEX_NONE;
+    for (size_t i = plan.len; i > plan.num_tree; i--) {
+        size_t index = plan.nodes[i - 1].index;
+        page_t *page = page_pool_get_page(tree->pool, index);
+        if (page == NULL) {
+            ret = -1;
+            break;
+        }
+        memcpy(page->data, &tree->free_page, sizeof(size_t));
+        page_pool_mark_dirty(tree->pool, index);
+        tree->free_page = index;
+    }
+    btree_defrag_plan_free(&plan);
+    return ret;
+}
+
+int btree_defrag_step(btree_t *tree, double fill, size_t budget)
+{
+    if (tree->deferred != NULL) {
+        printf("Cannot defragment a btree while its splits are deferred\n");
+        return -1;
+    }
+    // Refilling moves keys between leaves, which needs settled counts and no
+    // messages still on their way to them.
+    if (btree_prepare_counts(tree) != 0)
+        return -1;
+    size_t remaining = budget;
+    if (fill > 0 && tree->root.node_type == NODE_TYPE_INTERNAL) {
+        size_t target = fill * tree->leaf_capacity;
+        if (target < 1)
+            target = 1;
+        if (target > tree->leaf_capacity)
+            target = tree->leaf_capacity;
+        if (btree_defrag_refill(tree, tree->root.index, target, &remaining) != 0)
+            return -1;
+    }
+    if (btree_defrag_place(tree, &remaining) != 0)
+        return -1;
+    return remaining == 0;
+}
+
+int btree_defrag(btree_t *tree, double fill)
+{
+    int ret;
+    // The maintenance thread grows the pool, so its length is only read
+    // once btree_defrag_step is known to go ahead.
+    while ((ret = btree_defrag_step(tree, fill, tree->deferred != NULL ? 0 : tree->pool->len)) == 1)
+        ;
+    return ret;
+}
+
+int btree_value_log_gc(btree_t *tree, size_t max_bytes)
+{
+    if (tree->vlog == NULL) {
+        printf("Cannot collect garbage without a value log\n");
+        return -1;
+    }
+    if (tree->deferred != NULL) {
+        printf("Cannot collect garbage while btree splits are deferred\n");
+        return -1;
+    }
+    vlog_t *vlog = tree->vlog;
+    size_t record_size = tree->key_size + tree->value_size;
+    char *record = (char*)malloc(record_size);
+    if (record == NULL) {
+        printf("Failed to allocate value log record\n");
+        return -1;
+    }
+
+    // A record is live if the tree's handle for its key still points at it.
+    // Live records move to the head, past where this pass stops.
+    int ret = 0;
+    uint64_t end = vlog->head;
+    uint64_t offset = vlog->tail;
+    while (offset + record_size <= end && offset - vlog->tail < max_bytes) {
+        if (vlog_read_record(vlog, offset, record, record_size) != 0) {
+            ret = -1;
+            break;
+        }
+        char *data;
+        size_t page_index;
+        vlog_handle_t handle;
+        btree_locate(tree, record, &data, &page_index);
+        if (data != NULL) {
+            memcpy(&handle, data, sizeof(handle));
+            if (handle.offset == offset) {
+                if (vlog_append(vlog, record, tree->key_size, record + tree->key_size,
+                                tree->value_size, &handle) != 0) {
+                    ret = -1;
+                    break;
+                }
+                memcpy(data, &handle, sizeof(handle));
+                page_pool_mark_dirty(tree->pool, page_index);
+            }
+        }
+        offset += record_size;
+    }
+    // Moved records and the handles pointing at them have to outlive a crash
+    // before the old copies are punched out.
+    if (ret == 0 && vlog_sync(vlog) != 0)
+        ret = -1;
+    if (ret == 0 && tree->pool->fd >= 0 && page_pool_sync(tree->pool) != 0)
+        ret = -1;
+    if (ret == 0 && vlog_trim(vlog, offset) != 0)
+        ret = -1;
+    free(record);
+    return ret;
+}
+
+void btree_free(btree_t *tree)
+{
+    if (tree == NULL) {
+        printf("Warning: tried to free NULL btree_t*\n");
+        return;
+    }
+    if (tree->deferred != NULL) {
+        btree_deferred_stop(tree);
+        // Left set only if pending splits could not be posted.
+        if (tree->deferred != NULL) {
+            pthread_mutex_destroy(&tree->deferred->lock);
+            pthread_cond_destroy(&tree->deferred->wake);
+            free(tree->deferred);
+        }
+    }
+    // Pages belong to the pool and are freed with it.
+    if (tree->bloom != NULL)
+        bloom_free(tree->bloom);
+    if (tree->trace != NULL)
+        trace_close(tree->trace);
+    if (tree->vlog != NULL)
+        tree->vlog->owner = NULL;
+    free(tree);
 }
@@ -1,59 +1,318 @@
 #ifndef INDEX_H
 #define INDEX_H
 
+#include <pthread.h>
+#include <stddef.h>
+
 #define PAGE_SIZE 256
 
+// Default number of reads kept in flight for a file-backed pool.
+#define PAGE_POOL_IO_DEPTH 32
+// Pages prefetched ahead of a sequential run of misses.
+#define PAGE_POOL_READAHEAD 8
+
 typedef struct {
     char data[PAGE_SIZE];
 } page_t;
 
+typedef struct {
+    int dirty;
+    int reading;
+    // Pinned pages stay resident; the version changes whenever a page is
+    // marked dirty, so holders of a pointer into it can tell it moved.
+    size_t pins;
+    size_t version;
+    // NUMA node the page's memory was taken from, when the pool has a policy.
+    size_t node;
+    // Set when the page is read from the file, until its owner has dropped
+    // what only meant something in memory, such as cached child pointers.
+    int loaded;
+} page_meta_t;
+
+typedef struct page_io page_io_t;
+
+// Where the pages of a pool live on a NUMA machine: on the node of the thread
+// that allocates them, spread round-robin across nodes, or split into one
+// contiguous range of page indexes per node.
+typedef enum {
+    PAGE_POOL_NUMA_LOCAL,
+    PAGE_POOL_NUMA_INTERLEAVE,
+    PAGE_POOL_NUMA_PARTITIONED
+} page_pool_numa_policy_t;
+
+typedef struct page_numa page_numa_t;
+
 typedef struct {
     size_t max_len;
     size_t len;
+    // Only set for pools backed by a file; pages[] entries are NULL until read.
+    int fd;
+    page_io_t *io;
+    // NULL unless a NUMA policy was set; pages then come from per-node slabs.
+    page_numa_t *numa;
+    page_meta_t *meta;
+    // Changes whenever resident page memory is released or moved, so that
+    // pointers taken from pages[] can be checked for staleness.
+    size_t epoch;
+    size_t readahead;
+    size_t last_index;
+    size_t sequential;
+    // Accesses that had to start the read of their page themselves.
+    size_t misses;
     page_t *pages[];
 } page_pool_t;
 
 page_pool_t* page_pool_init(size_t max_pages);
+page_pool_t* page_pool_open(const char *path, size_t max_pages);
 page_t* page_pool_create_page(page_pool_t *pool, size_t *index);
 page_t* page_pool_get_page(page_pool_t *pool, size_t index);
+// Like page_pool_get_page, but returns NULL instead of reading the page.
+page_t* page_pool_try_get_page(page_pool_t *pool, size_t index);
+// Blocks until an outstanding read lands, then collects any others that
+// have; -1 if none is in flight.
+int page_pool_wait(page_pool_t *pool);
+void page_pool_prefetch(page_pool_t *pool, size_t index, size_t count);
+void page_pool_mark_dirty(page_pool_t *pool, size_t index);
+int page_pool_pin(page_pool_t *pool, size_t index);
+void page_pool_unpin(page_pool_t *pool, size_t index);
+int page_pool_evict(page_pool_t *pool, size_t index);
+int page_pool_sync(page_pool_t *pool);
+int page_pool_set_numa_policy(page_pool_t *pool, page_pool_numa_policy_t policy);
+size_t page_pool_numa_nodes(page_pool_t *pool);
+size_t page_pool_numa_pages(page_pool_t *pool, size_t node);
+// Writes back the dirty pages of a file-backed pool before releasing it.
 void page_pool_free(page_pool_t *pool);
 
+#define PAGE_INDEX_NONE ((size_t)-1)
+
 typedef enum {
     NODE_TYPE_INTERNAL,
     NODE_TYPE_LEAF
 } node_type_t;
 
 typedef struct {
-    node_type_t node_type_t;
+    node_type_t node_type;
     size_t index;
 } relation_t;
 
+// Every node page starts with a node_header_t.
+typedef struct {
+    node_type_t node_type;
+    // Leaves only: 1 + the slot in tree->deferred of a split of this leaf
+    // that is not in the parent yet, or 0.
+    unsigned int pending_split;
+    size_t num_keys;
+} node_header_t;
+
+// Internal nodes hold num_keys + 1 children, then the number of entries under
+// each child, then num_keys keys, each array starting after the space reserved
+// for the largest possible one before it. In a buffered tree the second half
+// of the page is a message buffer (see btree_message_t).
 typedef struct {
-    char **keys;
-    relation_t **children;
+    node_header_t header;
+    relation_t children[];
 } internal_node_t;
 
+// Leaves hold num_keys keys, then their data after the space reserved for the
+// largest possible keys array.
+typedef struct {
+    node_header_t header;
+    size_t next;
+    size_t prev;
+    char keys[];
+} leaf_node_t;
+
 typedef struct {
     char *key;
     char *data;
 } kvp_t;
 
+// Pending operations buffered in internal nodes, stored as this op byte
+// followed by the key and then the data.
+typedef enum {
+    BTREE_MESSAGE_INSERT,
+    BTREE_MESSAGE_DELETE
+} btree_message_t;
+
+// Buffer inserts and deletes in internal nodes and push them down in batches
+// (a B-epsilon tree), trading some fanout for far fewer leaf writes.
+#define BTREE_BUFFERED 0x1
+// Keep a linear model of key -> slot in each leaf, used to narrow the search
+// to a few slots. Keys must be unsigned big-endian integers of up to 8 bytes.
+#define BTREE_LEARNED 0x2
+// Cache pointers to resident children in internal nodes, so descending
+// through pages already in memory does not go through the pool.
+#define BTREE_SWIZZLE 0x4
+
+// Largest slot error a leaf model may have before leaves go back to binary
+// search.
+#define LEAF_MODEL_MAX_ERROR 4
+
+// Stored at the very end of each leaf page of a learned tree. The predicted
+// slot of key k is intercept + slope * (k - base), and every key in the leaf
+// is at most error slots away from its prediction.
 typedef struct {
-    kvp_t **key_value_pairs;
-    size_t next;
-    size_t prev;
-} leaf_node_t;
+    unsigned long long base;
+    double slope;
+    double intercept;
+    unsigned int error;
+    unsigned int valid;
+} leaf_model_t;
+
+// Leaf splits that may wait for the maintenance thread.
+#define BTREE_DEFERRED_SPLITS 64
+// Pending splits that wake the maintenance thread once it sleeps.
+#define BTREE_DEFERRED_WAKE 16
+// While splits keep coming the thread looks for them this often (in ns)
+// rather than being woken, and sleeps after this many polls find none.
+#define BTREE_DEFERRED_POLL_NS 200000
+#define BTREE_DEFERRED_IDLE_POLLS 16
+// Free pages the maintenance thread keeps ready for side pages.
+#define BTREE_DEFERRED_SPARES (2 * BTREE_DEFERRED_WAKE)
+
+// Leaf splits waiting for the maintenance thread. left[i] is the leaf holding
+// slot i's split (PAGE_INDEX_NONE if the slot is free). While side[i] is set,
+// the leaf is full and overflows into that page, and the split has yet to be
+// made; after that, keys holds the split's separator and only the parent
+// update is left. queue lists the slots in use, oldest first.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    int failed;
+    // Operations blocked on the lock, which the maintenance thread gives way
+    // to; yielded is set while it does, and sleeping while it waits to be
+    // woken for more splits.
+    size_t waiting;
+    int yielded;
+    int sleeping;
+    size_t left[BTREE_DEFERRED_SPLITS];
+    size_t side[BTREE_DEFERRED_SPLITS];
+    size_t queue[BTREE_DEFERRED_SPLITS];
+    size_t head;
+    size_t len;
+    // Pages the maintenance thread put on the tree's free list and no split
+    // has taken yet.
+    size_t spares;
+    size_t deferred;
+    // Splits done in full on the spot because every slot was taken.
+    size_t inline_splits;
+    size_t posted;
+    char keys[];
+} btree_deferred_t;
+
+typedef struct bloom bloom_t;
+typedef struct vlog vlog_t;
+typedef struct trace trace_t;
+
+// A read-only view of a value inside a pool page. The page stays pinned
+// until the view is released, and the view is only valid while the page
+// version it was taken at is current.
+typedef struct {
+    page_pool_t *pool;
+    size_t index;
+    size_t version;
+    const char *data;
+    size_t size;
+} btree_view_t;
 
 typedef struct {
     size_t key_size;
     size_t data_size;
-    internal_node_t *root;
+    int flags;
+    size_t leaf_capacity;
+    size_t internal_capacity;
+    size_t message_capacity;
+    size_t buffer_offset;
+    size_t swizzle_offset;
+    size_t num_keys;
+    // Fast-path appends not yet added to the counts along the right edge.
+    size_t pending_appends;
+    relation_t root;
+    // Last leaf in key order, where ascending inserts land without a descent.
+    size_t rightmost_leaf;
+    // Pages given up by defragmentation, reused before new ones are created.
+    size_t free_page;
     page_pool_t *pool;
+    bloom_t *bloom;
+    size_t bloom_capacity;
+    size_t bloom_deletes;
+    // Set for trees whose values live in a value log: data is then a
+    // vlog_handle_t and value_size is the size of the values themselves.
+    vlog_t *vlog;
+    size_t value_size;
+    // Where operations are recorded while tracing, otherwise NULL.
+    trace_t *trace;
+    // Set while splits are deferred; its lock is then held by every operation.
+    btree_deferred_t *deferred;
 } btree_t;
 
+// Called once a lookup finishes, with data as btree_search would return it.
+typedef void (*btree_lookup_callback_t)(void *arg, char *key, char *data);
+
+typedef struct {
+    char *key;
+    btree_lookup_callback_t callback;
+    void *arg;
+    relation_t node;
+} btree_lookup_t;
+
+// Lookups sharing one thread, each suspended while the page it needs next is
+// read, so that many reads are in flight at once. Keys must stay valid until
+// their callback runs, and the tree must not change while lookups are
+// pending.
+typedef struct {
+    btree_t *tree;
+    size_t capacity;
+    size_t len;
+    btree_lookup_t lookups[];
+} btree_lookups_t;
+
 btree_t* btree_allocate(page_pool_t *pool, size_t key_size, size_t data_size);
+btree_t* btree_allocate_with_flags(page_pool_t *pool, size_t key_size, size_t data_size, int flags);
+// The tree owns vlog until it is freed; no other tree may use it meanwhile.
+btree_t* btree_allocate_separated(page_pool_t *pool, vlog_t *vlog, size_t key_size, size_t value_size, int flags);
 void btree_insert(btree_t *tree, char *key, char *data);
+void btree_insert_batch(btree_t *tree, kvp_t *pairs, size_t n);
 void btree_search(btree_t *tree, char *key, char **data);
+int btree_search_value(btree_t *tree, char *key, char *value);
+int btree_search_view(btree_t *tree, char *key, btree_view_t *view);
+int btree_view_valid(btree_view_t *view);
+void btree_view_release(btree_view_t *view);
+// Callbacks run from submit when every page is resident, or from a later
+// poll, which returns how many lookups completed and blocks only if none of
+// them could.
+btree_lookups_t* btree_lookups_init(btree_t *tree, size_t capacity);
+int btree_lookup_submit(btree_lookups_t *lookups, char *key, btree_lookup_callback_t callback, void *arg);
+size_t btree_lookups_poll(btree_lookups_t *lookups);
+void btree_lookups_drain(btree_lookups_t *lookups);
+void btree_lookups_free(btree_lookups_t *lookups);
+int btree_delete(btree_t *tree, char *key);
+int btree_flush(btree_t *tree);
+size_t btree_rank(btree_t *tree, char *key);
+int btree_select(btree_t *tree, size_t rank, char **key, char **data);
+size_t btree_count_range(btree_t *tree, char *start, char *end);
+int btree_bloom_enable(btree_t *tree, size_t expected_keys);
+int btree_bloom_rebuild(btree_t *tree);
+// Writes an immutable copy of the tree to path, to be read with frozen_open().
+int btree_freeze(btree_t *tree, const char *path);
+int btree_defrag_step(btree_t *tree, double fill, size_t budget);
+int btree_defrag(btree_t *tree, double fill);
+int btree_value_log_gc(btree_t *tree, size_t max_bytes);
+// Records inserts, searches, deletes and range counts on one key in every
+// `sample` to path, for trace_replay().
+int btree_trace_start(btree_t *tree, const char *path, unsigned long long sample);
+int btree_trace_stop(btree_t *tree);
+// Starts a thread that makes leaf splits and their parent updates, so an
+// insert into a full leaf only adds the key to a side page of the leaf.
+// In-memory, unbuffered trees only. The thread moves keys between a leaf
+// and its side page, so read values with btree_search_value or a view
+// rather than through btree_search's pointer.
+// Defrag, freeze, bloom filter builds and value log collection have to wait
+// until btree_deferred_stop, which posts every split still pending.
+int btree_deferred_start(btree_t *tree);
+int btree_deferred_stop(btree_t *tree);
 void btree_free(btree_t *tree);
 
 #endif
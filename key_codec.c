@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "key_codec.h"
+
+
+/* Order-preserving key encoding.
+ *
+ * Every column is encoded so that memcmp on the encodings orders them like
+ * the values, and so that no encoding is a prefix of another. The second
+ * property makes a tuple compare column by column, and lets the unused tail
+ * of a fixed-size key be zero filled without affecting the order.
+ *
+ *   unsigned ints  big endian
+ *   signed ints    big endian with the sign bit flipped
+ *   floats         the IEEE bits with the sign bit flipped, or all bits
+ *                  flipped for negative numbers
+ *   strings        0x00 escaped as 0x00 0xff, ended by 0x00 0x00
+ *
+ * A descending column is the ascending encoding with every bit flipped. */
+
+void key_encoder_init(key_encoder_t *enc, char *buf, size_t size)
+{
+    enc->buf = buf;
+    enc->size = size;
+    enc->len = 0;
+    enc->error = 0;
+}
+
+static void key_encode_bytes(key_encoder_t *enc, const unsigned char *bytes, size_t len, int flags)
+{
+    if (enc->error || len > enc->size - enc->len) {
+        enc->error = 1;
+        return;
+    }
+    unsigned char mask = (flags & KEY_DESCENDING) ? 0xff : 0;
+    for (size_t i = 0; i < len; i++)
+        enc->buf[enc->len + i] = bytes[i] ^ mask;
+    enc->len += len;
+}
+
+static void key_encode_big_endian(key_encoder_t *enc, uint64_t value, size_t width, int flags)
+{
+    if (width == 0 || width > 8) {
+        printf("Cannot encode an integer %zu bytes wide\n", width);
+        enc->error = 1;
+        return;
+    }
+    unsigned char bytes[8];
+    for (size_t i = 0; i < width; i++)
+        bytes[i] = value >> (8 * (width - 1 - i));
+    key_encode_bytes(enc, bytes, width, flags);
+}
+
+void key_encode_uint(key_encoder_t *enc, uint64_t value, size_t width, int flags)
+{
+    // Dropping the high bytes would change the order.
+    if (width > 0 && width < 8 && value >> (8 * width) != 0) {
+        enc->error = 1;
+        return;
+    }
+    key_encode_big_endian(enc, value, width, flags);
+}
+
+void key_encode_int(key_encoder_t *enc, int64_t value, size_t width, int flags)
+{
+    if (width == 0 || width > 8) {
+        key_encode_big_endian(enc, 0, width, flags);
+        return;
+    }
+    uint64_t sign = (uint64_t)1 << (8 * width - 1);
+    if (width < 8 && (value < -(int64_t)sign || value >= (int64_t)sign)) {
+        enc->error = 1;
+        return;
+    }
+    key_encode_big_endian(enc, (uint64_t)value ^ sign, width, flags);
+}
+
+void key_encode_float(key_encoder_t *enc, float value, int flags)
+{
+    // -0 and 0 are equal, so they must encode the same.
+    if (value == 0)
+        value = 0;
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits = (bits & 0x80000000U) ? ~bits : bits ^ 0x80000000U;
+    key_encode_big_endian(enc, bits, sizeof(bits), flags);
+}
+
+void key_encode_double(key_encoder_t *enc, double value, int flags)
+{
+    if (value == 0)
+        value = 0;
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits = (bits & 0x8000000000000000ULL) ? ~bits : bits ^ 0x8000000000000000ULL;
+    key_encode_big_endian(enc, bits, sizeof(bits), flags);
+}
+
+void key_encode_string(key_encoder_t *enc, const char *value, size_t len, int flags)
+{
+    static const unsigned char escaped_zero[2] = {0x00, 0xff};
+    static const unsigned char terminator[2] = {0x00, 0x00};
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] != 0)
+            continue;
+        key_encode_bytes(enc, (const unsigned char*)value + start, i - start, flags);
+        key_encode_bytes(enc, escaped_zero, 2, flags);
+        start = i + 1;
+    }
+    key_encode_bytes(enc, (const unsigned char*)value + start, len - start, flags);
+    key_encode_bytes(enc, terminator, 2, flags);
+}
+
+int key_encoder_finish(key_encoder_t *enc)
+{
+    if (enc->error) {
+        printf("Encoded key does not fit in %zu bytes\n", enc->size);
+        return -1;
+    }
+    memset(enc->buf + enc->len, 0, enc->size - enc->len);
+    return 0;
+}
+
+void key_decoder_init(key_decoder_t *dec, const char *buf, size_t size)
+{
+    dec->buf = buf;
+    dec->size = size;
+    dec->pos = 0;
+    dec->error = 0;
+}
+
+static uint64_t key_decode_big_endian(key_decoder_t *dec, size_t width, int flags)
+{
+    if (dec->error || width == 0 || width > 8 || width > dec->size - dec->pos) {
+        dec->error = 1;
+        return 0;
+    }
+    unsigned char mask = (flags & KEY_DESCENDING) ? 0xff : 0;
+    uint64_t value = 0;
+    for (size_t i = 0; i < width; i++)
+        value = (value << 8) | (unsigned char)(dec->buf[dec->pos + i] ^ mask);
+    dec->pos += width;
+    return value;
+}
+
+uint64_t key_decode_uint(key_decoder_t *dec, size_t width, int flags)
+{
+    return key_decode_big_endian(dec, width, flags);
+}
+
+int64_t key_decode_int(key_decoder_t *dec, size_t width, int flags)
+{
+    uint64_t value = key_decode_big_endian(dec, width, flags);
+    if (dec->error)
+        return 0;
+    uint64_t sign = (uint64_t)1 << (8 * width - 1);
+    value ^= sign;
+    // Sign-extend narrower columns.
+    if (width < 8 && (value & sign))
+        value |= ~((sign << 1) - 1);
+    return (int64_t)value;
+}
+
+float key_decode_float(key_decoder_t *dec, int flags)
+{
+    uint32_t bits = key_decode_big_endian(dec, sizeof(bits), flags);
+    bits = (bits & 0x80000000U) ? bits ^ 0x80000000U : ~bits;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+double key_decode_double(key_decoder_t *dec, int flags)
+{
+    uint64_t bits = key_decode_big_endian(dec, sizeof(bits), flags);
+    bits = (bits & 0x8000000000000000ULL) ? bits ^ 0x8000000000000000ULL : ~bits;
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/* Copies up to capacity bytes of the string into value and returns its full
+ * length, which may be more than was copied. */
+size_t key_decode_string(key_decoder_t *dec, char *value, size_t capacity, int flags)
+{
+    unsigned char mask = (flags & KEY_DESCENDING) ? 0xff : 0;
+    size_t len = 0;
+    while (!dec->error) {
+        if (dec->size - dec->pos < 1) {
+            dec->error = 1;
+            break;
+        }
+        unsigned char byte = dec->buf[dec->pos++] ^ mask;
+        if (byte == 0) {
+            if (dec->size - dec->pos < 1) {
+                dec->error = 1;
+                break;
+            }
+            unsigned char next = dec->buf[dec->pos++] ^ mask;
+            if (next == 0x00)
+                return len;
+            if (next != 0xff) {
+                dec->error = 1;
+                break;
+            }
+        }
+        if (len < capacity)
+            value[len] = byte;
+        len++;
+    }
+    return 0;
+}
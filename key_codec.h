@@ -0,0 +1,42 @@
+#ifndef KEY_CODEC_H
+#define KEY_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sort this column from largest to smallest.
+#define KEY_DESCENDING 0x1
+
+// Writes columns one after the other into a fixed-size key. The first column
+// that does not fit, in the key or an integer in its width, sets error and
+// the rest are ignored.
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+    int error;
+} key_encoder_t;
+
+typedef struct {
+    const char *buf;
+    size_t size;
+    size_t pos;
+    int error;
+} key_decoder_t;
+
+void key_encoder_init(key_encoder_t *enc, char *buf, size_t size);
+void key_encode_uint(key_encoder_t *enc, uint64_t value, size_t width, int flags);
+void key_encode_int(key_encoder_t *enc, int64_t value, size_t width, int flags);
+void key_encode_float(key_encoder_t *enc, float value, int flags);
+void key_encode_double(key_encoder_t *enc, double value, int flags);
+void key_encode_string(key_encoder_t *enc, const char *value, size_t len, int flags);
+int key_encoder_finish(key_encoder_t *enc);
+
+void key_decoder_init(key_decoder_t *dec, const char *buf, size_t size);
+uint64_t key_decode_uint(key_decoder_t *dec, size_t width, int flags);
+int64_t key_decode_int(key_decoder_t *dec, size_t width, int flags);
+float key_decode_float(key_decoder_t *dec, int flags);
+double key_decode_double(key_decoder_t *dec, int flags);
+size_t key_decode_string(key_decoder_t *dec, char *value, size_t capacity, int flags);
+
+#endif
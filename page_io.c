@@ -0,0 +1,476 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "page_io.h"
+
+
+/* Asynchronous page reads.
+ *
+ * Reads are queued with page_io_submit_read() and reaped one at a time with
+ * page_io_wait(). io_uring is driven directly through its syscalls so there is
+ * no dependency on liburing; when the kernel (or a seccomp policy) refuses to
+ * set up a ring, or the ring does not support IORING_OP_READ, we fall back to
+ * a small pool of threads calling pread(). */
+
+#define PAGE_IO_WORKERS 4
+
+
+typedef struct {
+    page_t *page;
+    size_t index;
+    ssize_t result;
+} page_io_request_t;
+
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned unsubmitted;
+} page_io_uring_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;
+    pthread_cond_t completed;
+    pthread_t workers[PAGE_IO_WORKERS];
+    size_t num_workers;
+    int stopping;
+    // both queues are rings of `depth` requests
+    page_io_request_t *queue;
+    size_t queue_head;
+    size_t queue_len;
+    page_io_request_t *done;
+    size_t done_head;
+    size_t done_len;
+} page_io_threads_t;
+
+struct page_io {
+    int fd;
+    size_t depth;
+    size_t in_flight;
+    page_io_backend_t backend;
+    union {
+        page_io_uring_t uring;
+        page_io_threads_t threads;
+    };
+};
+
+
+/* io_uring backend */
+
+// IORING_OP_READ arrived in Linux 5.6 together with IORING_REGISTER_PROBE, so
+// a ring that cannot be probed cannot take our reads either.
+static int uring_supports_read(int ring_fd)
+{
+    unsigned ops_len = IORING_OP_LAST;
+    struct io_uring_probe *probe = (struct io_uring_probe*)calloc(
+        1, sizeof(struct io_uring_probe) + ops_len * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+        return 0;
+    int ret = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, ops_len);
+    int supported = ret >= 0 && IORING_OP_READ < probe->ops_len &&
+                    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+static int uring_setup(page_io_uring_t *ring, size_t depth)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    int ring_fd = syscall(__NR_io_uring_setup, (unsigned)depth, &params);
+    if (ring_fd < 0)
+        return -1;
+    if (!uring_supports_read(ring_fd)) {
+        close(ring_fd);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    ring->fd = ring_fd;
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        printf("Failed to map io_uring rings\n");
+        if (ring->sq_ring != MAP_FAILED)
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->cq_ring != MAP_FAILED)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_size);
+        close(ring_fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+static int uring_enter(page_io_uring_t *ring, unsigned min_complete)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    for (;;) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted,
+                          min_complete, flags, NULL, 0);
+        if (ret >= 0) {
+            ring->unsubmitted -= ret < ring->unsubmitted ? ret : ring->unsubmitted;
+            return 0;
+        }
+        if (errno != EINTR) {
+            printf("io_uring_enter failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+}
+
+static int uring_submit_read(page_io_t *io, page_t *page, size_t index)
+{
+    page_io_uring_t *ring = &io->uring;
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->entries) {
+        if (uring_enter(ring, 0) != 0)
+            return -1;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->entries) {
+            printf("io_uring submission queue is full\n");
+            return -1;
+        }
+    }
+
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = io->fd;
+    sqe->addr = (unsigned long)page->data;
+    sqe->len = PAGE_SIZE;
+    sqe->off = index * PAGE_SIZE;
+    sqe->user_data = index;
+    ring->sq_array[slot] = slot;
+
+    // Queued only: the ring is entered once per batch, by page_io_flush() or
+    // uring_wait().
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+    return 0;
+}
+
+static int uring_wait(page_io_t *io, size_t *index, ssize_t *result)
+{
+    page_io_uring_t *ring = &io->uring;
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            *index = cqe->user_data;
+            *result = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (uring_enter(ring, 1) != 0)
+            return -1;
+    }
+}
+
+static void uring_free(page_io_uring_t *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+
+/* thread pool backend */
+
+static void* threads_worker(void *arg)
+{
+    page_io_t *io = arg;
+    page_io_threads_t *threads = &io->threads;
+
+    pthread_mutex_lock(&threads->lock);
+    for (;;) {
+        while (!threads->stopping && threads->queue_len == 0)
+            pthread_cond_wait(&threads->submitted, &threads->lock);
+        if (threads->stopping)
+            break;
+
+        page_io_request_t request = threads->queue[threads->queue_head];
+        threads->queue_head = (threads->queue_head + 1) % io->depth;
+        threads->queue_len--;
+        pthread_mutex_unlock(&threads->lock);
+
+        request.result = pread(io->fd, request.page->data, PAGE_SIZE, request.index * PAGE_SIZE);
+        if (request.result < 0)
+            request.result = -errno;
+
+        pthread_mutex_lock(&threads->lock);
+        size_t tail = (threads->done_head + threads->done_len) % io->depth;
+        threads->done[tail] = request;
+        threads->done_len++;
+        pthread_cond_signal(&threads->completed);
+    }
+    pthread_mutex_unlock(&threads->lock);
+    return NULL;
+}
+
+static int threads_setup(page_io_t *io)
+{
+    page_io_threads_t *threads = &io->threads;
+    memset(threads, 0, sizeof(*threads));
+
+    threads->queue = (page_io_request_t*)malloc(sizeof(page_io_request_t) * io->depth);
+    threads->done = (page_io_request_t*)malloc(sizeof(page_io_request_t) * io->depth);
+    if (threads->queue == NULL || threads->done == NULL) {
+        printf("Failed to allocate page_io request queues\n");
+        free(threads->queue);
+        free(threads->done);
+        return -1;
+    }
+    pthread_mutex_init(&threads->lock, NULL);
+    pthread_cond_init(&threads->submitted, NULL);
+    pthread_cond_init(&threads->completed, NULL);
+
+    for (size_t i = 0; i < PAGE_IO_WORKERS; i++) {
+        if (pthread_create(&threads->workers[i], NULL, threads_worker, io) != 0)
+            break;
+        threads->num_workers++;
+    }
+    if (threads->num_workers == 0) {
+        printf("Failed to start any page_io worker threads\n");
+        free(threads->queue);
+        free(threads->done);
+        return -1;
+    }
+    return 0;
+}
+
+static int threads_submit_read(page_io_t *io, page_t *page, size_t index)
+{
+    page_io_threads_t *threads = &io->threads;
+    pthread_mutex_lock(&threads->lock);
+    size_t tail = (threads->queue_head + threads->queue_len) % io->depth;
+    threads->queue[tail].page = page;
+    threads->queue[tail].index = index;
+    threads->queue_len++;
+    pthread_cond_signal(&threads->submitted);
+    pthread_mutex_unlock(&threads->lock);
+    return 0;
+}
+
+static int threads_wait(page_io_t *io, size_t *index, ssize_t *result)
+{
+    page_io_threads_t *threads = &io->threads;
+    pthread_mutex_lock(&threads->lock);
+    while (threads->done_len == 0)
+        pthread_cond_wait(&threads->completed, &threads->lock);
+    page_io_request_t request = threads->done[threads->done_head];
+    threads->done_head = (threads->done_head + 1) % io->depth;
+    threads->done_len--;
+    pthread_mutex_unlock(&threads->lock);
+
+    *index = request.index;
+    *result = request.result;
+    return 0;
+}
+
+static void threads_free(page_io_threads_t *threads)
+{
+    pthread_mutex_lock(&threads->lock);
+    threads->stopping = 1;
+    pthread_cond_broadcast(&threads->submitted);
+    pthread_mutex_unlock(&threads->lock);
+    for (size_t i = 0; i < threads->num_workers; i++)
+        pthread_join(threads->workers[i], NULL);
+
+    pthread_cond_destroy(&threads->completed);
+    pthread_cond_destroy(&threads->submitted);
+    pthread_mutex_destroy(&threads->lock);
+    free(threads->queue);
+    free(threads->done);
+}
+
+
+/* public interface */
+
+page_io_t* page_io_init(int fd, size_t depth, page_io_backend_t backend)
+{
+    if (depth == 0) {
+        printf("Cannot initialize page_io with depth 0\n");
+        return NULL;
+    }
+    page_io_t *io = (page_io_t*)malloc(sizeof(page_io_t));
+    if (io == NULL) {
+        printf("Failed to allocate page_io_t\n");
+        return NULL;
+    }
+    io->fd = fd;
+    io->depth = depth;
+    io->in_flight = 0;
+
+    if (backend != PAGE_IO_THREADS) {
+        if (uring_setup(&io->uring, depth) == 0) {
+            io->backend = PAGE_IO_URING;
+            return io;
+        }
+        if (backend == PAGE_IO_URING) {
+            printf("Failed to set up io_uring: %s\n", strerror(errno));
+            free(io);
+            return NULL;
+        }
+    }
+
+    if (threads_setup(io) != 0) {
+        free(io);
+        return NULL;
+    }
+    io->backend = PAGE_IO_THREADS;
+    return io;
+}
+
+page_io_backend_t page_io_backend(page_io_t *io)
+{
+    return io->backend;
+}
+
+size_t page_io_in_flight(page_io_t *io)
+{
+    return io->in_flight;
+}
+
+int page_io_submit_read(page_io_t *io, page_t *page, size_t index)
+{
+    if (io->in_flight >= io->depth) {
+        printf("Cannot submit read for page %zu, %zu reads already in flight\n",
+               index, io->in_flight);
+        return -1;
+    }
+    int ret;
+    if (io->backend == PAGE_IO_URING)
+        ret = uring_submit_read(io, page, index);
+    else
+        ret = threads_submit_read(io, page, index);
+    if (ret == 0)
+        io->in_flight++;
+    return ret;
+}
+
+int page_io_flush(page_io_t *io)
+{
+    // The thread pool starts reads as soon as they are queued.
+    if (io->backend == PAGE_IO_URING && io->uring.unsubmitted > 0)
+        return uring_enter(&io->uring, 0);
+    return 0;
+}
+
+size_t page_io_ready(page_io_t *io)
+{
+    if (io->backend == PAGE_IO_URING) {
+        page_io_uring_t *ring = &io->uring;
+        return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+    }
+    pthread_mutex_lock(&io->threads.lock);
+    size_t ready = io->threads.done_len;
+    pthread_mutex_unlock(&io->threads.lock);
+    return ready;
+}
+
+int page_io_wait(page_io_t *io, size_t *index)
+{
+    if (io->in_flight == 0) {
+        printf("Cannot wait for a read, none are in flight\n");
+        return -1;
+    }
+    ssize_t result;
+    int ret;
+    if (io->backend == PAGE_IO_URING)
+        ret = uring_wait(io, index, &result);
+    else
+        ret = threads_wait(io, index, &result);
+    if (ret != 0)
+        return -1;
+    io->in_flight--;
+
+    if (result != PAGE_SIZE) {
+        if (result < 0)
+            printf("Failed to read page %zu: %s\n", *index, strerror(-result));
+        else
+            printf("Short read of page %zu (%zd bytes)\n", *index, result);
+        return -1;
+    }
+    return 0;
+}
+
+void page_io_free(page_io_t *io)
+{
+    if (io == NULL) {
+        printf("Warning: tried to free NULL page_io_t*\n");
+        return;
+    }
+    // Drain anything still in flight so no completion lands in freed memory.
+    size_t index;
+    ssize_t result;
+    while (io->in_flight > 0) {
+        int ret;
+        if (io->backend == PAGE_IO_URING)
+            ret = uring_wait(io, &index, &result);
+        else
+            ret = threads_wait(io, &index, &result);
+        // A ring that cannot be entered any more has nothing left to reap;
+        // closing it below cancels whatever it still holds.
+        if (ret != 0)
+            break;
+        io->in_flight--;
+    }
+
+    if (io->backend == PAGE_IO_URING)
+        uring_free(&io->uring);
+    else
+        threads_free(&io->threads);
+    free(io);
+}
@@ -0,0 +1,26 @@
+#ifndef PAGE_IO_H
+#define PAGE_IO_H
+
+#include "index.h"
+
+typedef enum {
+    PAGE_IO_AUTO,
+    PAGE_IO_URING,
+    PAGE_IO_THREADS
+} page_io_backend_t;
+
+typedef struct page_io page_io_t;
+
+page_io_t* page_io_init(int fd, size_t depth, page_io_backend_t backend);
+page_io_backend_t page_io_backend(page_io_t *io);
+size_t page_io_in_flight(page_io_t *io);
+int page_io_submit_read(page_io_t *io, page_t *page, size_t index);
+int page_io_flush(page_io_t *io);
+// Completed reads page_io_wait() can return without blocking.
+size_t page_io_ready(page_io_t *io);
+// Returns -1 with *index set when a read completed but failed, and -1 with
+// *index untouched when no completion could be collected at all.
+int page_io_wait(page_io_t *io, size_t *index);
+void page_io_free(page_io_t *io);
+
+#endif
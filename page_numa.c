@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/mempolicy.h>
+
+#include "page_numa.h"
+
+
+/* NUMA-aware page memory.
+ *
+ * Pages are carved out of PAGE_NUMA_SLAB_SIZE slabs, and each slab is bound
+ * to one node with mbind(), so that pages meant for a node end up there
+ * however the first access happens. On a single-node machine, or where
+ * mbind() is refused, slabs are simply left to the kernel's default policy. */
+
+size_t page_numa_parse_nodes(const char *list, size_t *node_ids)
+{
+    size_t count = 0;
+    const char *p = list;
+    char *end;
+    for (;;) {
+        unsigned long first = strtoul(p, &end, 10);
+        if (end == p)
+            break;
+        unsigned long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtoul(p + 1, &end, 10);
+            if (end == p + 1)
+                break;
+            p = end;
+        }
+        // Nodes past the mbind() mask cannot be bound to, so leave them out.
+        for (unsigned long id = first; id <= last && id < PAGE_NUMA_MAX_NODES; id++)
+            node_ids[count++] = id;
+        if (*p != ',')
+            break;
+        p++;
+    }
+    return count;
+}
+
+size_t page_numa_detect_nodes(size_t *node_ids)
+{
+    // /sys lists online nodes as ranges, e.g. "0-1" or "0,2-3".
+    char list[256];
+    size_t count = 0;
+    FILE *file = fopen("/sys/devices/system/node/online", "r");
+    if (file != NULL) {
+        if (fgets(list, sizeof(list), file) != NULL)
+            count = page_numa_parse_nodes(list, node_ids);
+        fclose(file);
+    }
+    if (count == 0) {
+        node_ids[0] = 0;
+        count = 1;
+    }
+    return count;
+}
+
+static size_t page_numa_current_node(page_numa_t *numa)
+{
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return 0;
+    for (size_t i = 0; i < numa->num_nodes; i++) {
+        if (numa->node_ids[i] == node)
+            return i;
+    }
+    return 0;
+}
+
+page_numa_t* page_numa_init(page_pool_numa_policy_t policy, const size_t *node_ids, size_t num_nodes)
+{
+    if (num_nodes == 0 || num_nodes > PAGE_NUMA_MAX_NODES) {
+        printf("Cannot initialize page_numa with %zu nodes\n", num_nodes);
+        return NULL;
+    }
+    page_numa_t *numa = (page_numa_t*)calloc(1, sizeof(page_numa_t));
+    if (numa == NULL) {
+        printf("Failed to allocate page_numa_t\n");
+        return NULL;
+    }
+    numa->policy = policy;
+    numa->num_nodes = num_nodes;
+    memcpy(numa->node_ids, node_ids, num_nodes * sizeof(size_t));
+    return numa;
+}
+
+size_t page_numa_node_for(page_numa_t *numa, size_t index, size_t max_len)
+{
+    switch (numa->policy) {
+    case PAGE_POOL_NUMA_INTERLEAVE:
+        return index % numa->num_nodes;
+    case PAGE_POOL_NUMA_PARTITIONED:
+        // Contiguous ranges of page indexes, one per node.
+        return index / ((max_len + numa->num_nodes - 1) / numa->num_nodes);
+    case PAGE_POOL_NUMA_LOCAL:
+    default:
+        return page_numa_current_node(numa);
+    }
+}
+
+static int page_numa_grow(page_numa_t *numa, size_t node)
+{
+    page_slab_t *slab = (page_slab_t*)malloc(sizeof(page_slab_t));
+    if (slab == NULL) {
+        printf("Failed to allocate page_slab_t\n");
+        return -1;
+    }
+    slab->pages = mmap(NULL, PAGE_NUMA_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab->pages == MAP_FAILED) {
+        printf("Failed to map a page slab\n");
+        free(slab);
+        return -1;
+    }
+    if (numa->num_nodes > 1) {
+        // Preferred rather than bound, so a full node spills instead of failing.
+        size_t id = numa->node_ids[node];
+        unsigned long mask[PAGE_NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+        mask[id / (8 * sizeof(unsigned long))] = 1UL << (id % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, slab->pages, PAGE_NUMA_SLAB_SIZE, MPOL_PREFERRED,
+                    mask, PAGE_NUMA_MAX_NODES + 1, 0) != 0)
+            numa->bind_failures++;
+    }
+    slab->next = numa->nodes[node].slabs;
+    numa->nodes[node].slabs = slab;
+    numa->nodes[node].slab_used = 0;
+    return 0;
+}
+
+page_t* page_numa_alloc(page_numa_t *numa, size_t node)
+{
+    page_numa_node_t *n = &numa->nodes[node];
+    page_t *page;
+    if (n->free_list != NULL) {
+        page = n->free_list;
+        memcpy(&n->free_list, page->data, sizeof(page_t*));
+        memset(page, 0, sizeof(page_t));
+    } else {
+        if (n->slabs == NULL || n->slab_used == PAGE_NUMA_SLAB_PAGES) {
+            if (page_numa_grow(numa, node) != 0)
+                return NULL;
+        }
+        // Fresh anonymous memory is already zeroed.
+        page = &n->slabs->pages[n->slab_used++];
+    }
+    n->pages++;
+    return page;
+}
+
+void page_numa_release(page_numa_t *numa, size_t node, page_t *page)
+{
+    page_numa_node_t *n = &numa->nodes[node];
+    memcpy(page->data, &n->free_list, sizeof(page_t*));
+    n->free_list = page;
+    n->pages--;
+}
+
+void page_numa_free(page_numa_t *numa)
+{
+    if (numa == NULL) {
+        printf("Warning: tried to free NULL page_numa_t*\n");
+        return;
+    }
+    for (size_t i = 0; i < numa->num_nodes; i++) {
+        page_slab_t *slab = numa->nodes[i].slabs;
+        while (slab != NULL) {
+            page_slab_t *next = slab->next;
+            munmap(slab->pages, PAGE_NUMA_SLAB_SIZE);
+            free(slab);
+            slab = next;
+        }
+    }
+    free(numa);
+}
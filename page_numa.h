@@ -0,0 +1,47 @@
+#ifndef PAGE_NUMA_H
+#define PAGE_NUMA_H
+
+#include "index.h"
+
+#define PAGE_NUMA_MAX_NODES 64
+// Slabs are bound to a node as a whole, so they are a multiple of the
+// system page size.
+#define PAGE_NUMA_SLAB_SIZE (64 * 1024)
+#define PAGE_NUMA_SLAB_PAGES (PAGE_NUMA_SLAB_SIZE / sizeof(page_t))
+
+typedef struct page_slab {
+    struct page_slab *next;
+    page_t *pages;
+} page_slab_t;
+
+typedef struct {
+    page_slab_t *slabs;
+    size_t slab_used;
+    // Released pages, each holding a pointer to the next.
+    page_t *free_list;
+    size_t pages;
+} page_numa_node_t;
+
+// nodes[i] holds the pages of the online node with ID node_ids[i]; pool
+// metadata and page_pool_numa_pages() count nodes by i.
+struct page_numa {
+    page_pool_numa_policy_t policy;
+    size_t num_nodes;
+    size_t node_ids[PAGE_NUMA_MAX_NODES];
+    size_t bind_failures;
+    page_numa_node_t nodes[PAGE_NUMA_MAX_NODES];
+};
+
+// Fills node_ids with the IDs in a node list such as "0,2-3" and returns
+// how many there are.
+size_t page_numa_parse_nodes(const char *list, size_t *node_ids);
+// Like page_numa_parse_nodes for the online nodes, or just node 0 if they
+// cannot be read.
+size_t page_numa_detect_nodes(size_t *node_ids);
+page_numa_t* page_numa_init(page_pool_numa_policy_t policy, const size_t *node_ids, size_t num_nodes);
+size_t page_numa_node_for(page_numa_t *numa, size_t index, size_t max_len);
+page_t* page_numa_alloc(page_numa_t *numa, size_t node);
+void page_numa_release(page_numa_t *numa, size_t node, page_t *page);
+void page_numa_free(page_numa_t *numa);
+
+#endif
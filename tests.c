@@ -3,6 +3,16 @@
 
 extern SUITE(page_pool_suite); // tests_index.c
 extern SUITE(btree_suite); // tests_index.c
+extern SUITE(page_io_suite); // tests_page_io.c
+extern SUITE(bloom_suite); // tests_bloom.c
+extern SUITE(hash_index_suite); // tests_hash_index.c
+extern SUITE(page_numa_suite); // tests_page_numa.c
+extern SUITE(frozen_suite); // tests_frozen.c
+extern SUITE(vlog_suite); // tests_vlog.c
+extern SUITE(key_codec_suite); // tests_key_codec.c
+extern SUITE(bwtree_suite); // tests_bwtree.c
+extern SUITE(trace_suite); // tests_trace.c
+extern SUITE(histogram_suite); // tests_histogram.c
 
 GREATEST_MAIN_DEFS();
 
@@ -12,5 +22,15 @@ int main(int argc, char **argv)
     GREATEST_MAIN_BEGIN();
     RUN_SUITE(page_pool_suite);
     RUN_SUITE(btree_suite);
+    RUN_SUITE(page_io_suite);
+    RUN_SUITE(bloom_suite);
+    RUN_SUITE(hash_index_suite);
+    RUN_SUITE(page_numa_suite);
+    RUN_SUITE(frozen_suite);
+    RUN_SUITE(vlog_suite);
+    RUN_SUITE(key_codec_suite);
+    RUN_SUITE(bwtree_suite);
+    RUN_SUITE(trace_suite);
+    RUN_SUITE(histogram_suite);
     GREATEST_MAIN_END();
 }
@@ -0,0 +1,94 @@
+#include "greatest.h"
+
+#include "bloom.h"
+
+
+/* bloom tests */
+
+TEST test_bloom_init__normal(void)
+{
+    // A new filter is empty and sized to whole cache lines.
+    bloom_t *bloom = bloom_init(1000, BLOOM_BITS_PER_KEY);
+
+    ASSERT(bloom != NULL);
+    ASSERT(bloom->num_blocks * BLOOM_BLOCK_WORDS * 64 >= 1000 * BLOOM_BITS_PER_KEY);
+    ASSERT_EQ((size_t)bloom->blocks % 64, 0);
+    for (size_t i = 0; i < bloom->num_blocks * BLOOM_BLOCK_WORDS; i++)
+        ASSERT_EQ(bloom->blocks[i], 0);
+
+    bloom_free(bloom);
+
+    PASS();
+}
+
+
+TEST test_bloom_init__no_keys(void)
+{
+    // Even a filter for no keys has a block to hash into.
+    bloom_t *bloom = bloom_init(0, BLOOM_BITS_PER_KEY);
+
+    ASSERT(bloom != NULL);
+    ASSERT_EQ(bloom->num_blocks, 1);
+    ASSERT_EQ(bloom_may_contain(bloom, "abcd", 4), 0);
+
+    bloom_free(bloom);
+
+    PASS();
+}
+
+
+TEST test_bloom_init__zero_bits(void)
+{
+    // Do not allow 0 bits per key.
+    bloom_t *bloom = bloom_init(10, 0);
+    ASSERT_EQ(bloom, NULL);
+
+    PASS();
+}
+
+
+TEST test_bloom_may_contain__no_false_negatives(void)
+{
+    // Everything added must always be reported as possibly present.
+    bloom_t *bloom = bloom_init(10000, BLOOM_BITS_PER_KEY);
+
+    for (int i = 0; i < 10000; i++)
+        bloom_add(bloom, (char*)&i, sizeof(i));
+    for (int i = 0; i < 10000; i++)
+        ASSERT(bloom_may_contain(bloom, (char*)&i, sizeof(i)));
+
+    bloom_free(bloom);
+
+    PASS();
+}
+
+
+TEST test_bloom_may_contain__false_positive_rate(void)
+{
+    // At the default bits per key, few absent keys should get through.
+    bloom_t *bloom = bloom_init(10000, BLOOM_BITS_PER_KEY);
+
+    for (int i = 0; i < 10000; i++)
+        bloom_add(bloom, (char*)&i, sizeof(i));
+    int false_positives = 0;
+    for (int i = 10000; i < 110000; i++)
+        false_positives += bloom_may_contain(bloom, (char*)&i, sizeof(i));
+
+    // 10 bits per key gives ~1% for a classic filter; blocking costs a little
+    ASSERT(false_positives < 3000);
+
+    bloom_free(bloom);
+
+    PASS();
+}
+
+
+GREATEST_SUITE(bloom_suite)
+{
+    RUN_TEST(test_bloom_init__normal);
+    RUN_TEST(test_bloom_init__no_keys);
+    RUN_TEST(test_bloom_init__zero_bits);
+
+    RUN_TEST(test_bloom_may_contain__no_false_negatives);
+    RUN_TEST(test_bloom_may_contain__false_positive_rate);
+}
@@ -0,0 +1,202 @@
+#include <pthread.h>
+
+#include "greatest.h"
+
+#include "bwtree.h"
+#include "tests_util.h"
+
+
+/* bwtree tests */
+
+static size_t test_bwtree_height(bwtree_t *tree)
+{
+    bwtree_record_t *record = tree->mapping[tree->root];
+    while (record->type != BWTREE_BASE)
+        record = ((bwtree_delta_t*)record)->next;
+    return ((bwtree_base_t*)record)->level;
+}
+
+
+TEST test_bwtree_allocate__bad_args(void)
+{
+    // Reject a missing pool, empty sizes, and entries too large for a page.
+    page_pool_t *pool = page_pool_init(10);
+
+    ASSERT_EQ(bwtree_allocate(NULL, 4, 4), NULL);
+    ASSERT_EQ(bwtree_allocate(pool, 0, 4), NULL);
+    ASSERT_EQ(bwtree_allocate(pool, 4, 0), NULL);
+    ASSERT_EQ(bwtree_allocate(pool, PAGE_SIZE / 2, 4), NULL);
+
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_bwtree_insert__many(void)
+{
+    // Random inserts, overwrites and deletes agree with a reference array,
+    // through enough consolidations to grow the tree several levels.
+    page_pool_t *pool = page_pool_init(20000);
+    bwtree_t *tree = bwtree_allocate(pool, 4, sizeof(int));
+    const int range = 20000;
+    int *expected = (int*)malloc(range * sizeof(int));
+    unsigned int state = 7;
+    size_t live = 0;
+    char key[4];
+    int value;
+
+    for (int k = 0; k < range; k++)
+        expected[k] = -1;
+    for (int i = 0; i < 60000; i++) {
+        state = state * 1103515245 + 12345;
+        int k = (state >> 8) % range;
+        test_key(k, key);
+        if (i % 5 == 0) {
+            ASSERT_EQ(bwtree_delete(tree, key), expected[k] == -1 ? -1 : 0);
+            if (expected[k] != -1)
+                live--;
+            expected[k] = -1;
+        } else {
+            bwtree_insert(tree, key, (char*)&i);
+            if (expected[k] == -1)
+                live++;
+            expected[k] = i;
+        }
+    }
+    ASSERT_EQ(tree->num_keys, live);
+    ASSERT(tree->splits > 0);
+    ASSERT(test_bwtree_height(tree) >= 2);
+
+    for (int k = 0; k < range; k++) {
+        test_key(k, key);
+        if (expected[k] == -1) {
+            ASSERT_EQ(bwtree_search(tree, key, (char*)&value), -1);
+        } else {
+            ASSERT_EQ(bwtree_search(tree, key, (char*)&value), 0);
+            ASSERT_EQ(value, expected[k]);
+        }
+    }
+
+    free(expected);
+    bwtree_free(tree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_bwtree_consolidate__bounded_chains(void)
+{
+    // Rewriting one key over and over keeps folding its leaf's deltas into new
+    // base pages, and those pages are reused rather than grown without bound.
+    page_pool_t *pool = page_pool_init(100);
+    bwtree_t *tree = bwtree_allocate(pool, 4, sizeof(int));
+    char key[4];
+    int value;
+
+    test_key(42, key);
+    for (int i = 0; i < 10000; i++)
+        bwtree_insert(tree, key, (char*)&i);
+    ASSERT_EQ(tree->num_keys, 1);
+    ASSERT(tree->consolidations >= 10000 / BWTREE_CONSOLIDATE_LENGTH);
+    ASSERT(tree->mapping[tree->root]->length < BWTREE_CONSOLIDATE_LENGTH);
+    ASSERT(pool->len < 100);
+    ASSERT_EQ(bwtree_search(tree, key, (char*)&value), 0);
+    ASSERT_EQ(value, 9999);
+
+    bwtree_free(tree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+typedef struct {
+    bwtree_t *tree;
+    unsigned int first;
+    unsigned int count;
+    unsigned int hot;
+} test_bwtree_worker_t;
+
+static void* test_bwtree_worker(void *arg)
+{
+    test_bwtree_worker_t *worker = (test_bwtree_worker_t*)arg;
+    char key[4];
+    int value;
+
+    for (unsigned int i = 0; i < worker->count; i++) {
+        unsigned int k = worker->first + i;
+        test_key(k, key);
+        bwtree_insert(worker->tree, key, (char*)&k);
+        // Every thread also keeps rewriting the same few keys.
+        test_key(i % worker->hot, key);
+        bwtree_insert(worker->tree, key, (char*)&k);
+        bwtree_search(worker->tree, key, (char*)&value);
+        if (i % 3 == 0) {
+            test_key(worker->first + i / 2, key);
+            bwtree_delete(worker->tree, key);
+        }
+    }
+    return NULL;
+}
+
+TEST test_bwtree_insert__concurrent(void)
+{
+    // Threads inserting their own ranges while fighting over a few hot keys
+    // lose no updates and leave every surviving key findable.
+    const unsigned int threads = 8, count = 5000, hot = 16;
+    page_pool_t *pool = page_pool_init(50000);
+    bwtree_t *tree = bwtree_allocate(pool, 4, sizeof(int));
+    pthread_t ids[8];
+    test_bwtree_worker_t workers[8];
+    char key[4];
+    int value;
+
+    for (unsigned int t = 0; t < threads; t++) {
+        workers[t].tree = tree;
+        workers[t].first = hot + t * count;
+        workers[t].count = count;
+        workers[t].hot = hot;
+        ASSERT_EQ(pthread_create(&ids[t], NULL, test_bwtree_worker, &workers[t]), 0);
+    }
+    for (unsigned int t = 0; t < threads; t++)
+        pthread_join(ids[t], NULL);
+
+    size_t live = hot;
+    for (unsigned int t = 0; t < threads; t++) {
+        for (unsigned int i = 0; i < count; i++) {
+            unsigned int k = workers[t].first + i;
+            // Step j deletes first + j / 2 whenever j is a multiple of 3.
+            int deleted = ((2 * i) % 3 == 0 && 2 * i < count) ||
+                          ((2 * i + 1) % 3 == 0 && 2 * i + 1 < count);
+            test_key(k, key);
+            if (deleted) {
+                ASSERT_EQ(bwtree_search(tree, key, (char*)&value), -1);
+            } else {
+                ASSERT_EQ(bwtree_search(tree, key, (char*)&value), 0);
+                ASSERT_EQ((unsigned int)value, k);
+                live++;
+            }
+        }
+    }
+    for (unsigned int k = 0; k < hot; k++) {
+        test_key(k, key);
+        ASSERT_EQ(bwtree_search(tree, key, (char*)&value), 0);
+    }
+    ASSERT_EQ(tree->num_keys, live);
+
+    bwtree_free(tree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+GREATEST_SUITE(bwtree_suite)
+{
+    RUN_TEST(test_bwtree_allocate__bad_args);
+    RUN_TEST(test_bwtree_insert__many);
+    RUN_TEST(test_bwtree_consolidate__bounded_chains);
+    RUN_TEST(test_bwtree_insert__concurrent);
+}
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "greatest.h"
+
+#include "frozen.h"
+#include "index.h"
+#include "vlog.h"
+#include "tests_util.h"
+
+
+/* frozen tests */
+
+TEST test_frozen_search(btree_t *btree, size_t num_keys)
+{
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "frozen");
+    ASSERT_EQ(btree_freeze(btree, path), 0);
+    frozen_t *frozen = frozen_open(path);
+    ASSERT(frozen != NULL);
+    ASSERT_EQ(frozen->num_keys, num_keys);
+
+    // Inserted keys were the even numbers, so odd ones and keys past either
+    // end must miss.
+    char key[4];
+    char *data;
+    for (unsigned int i = 0; i <= 2 * num_keys; i++) {
+        test_key(i, key);
+        frozen_search(frozen, key, &data);
+        if (i % 2 == 0 && i < 2 * num_keys) {
+            ASSERT(data != NULL);
+            int value;
+            memcpy(&value, data, sizeof(value));
+            ASSERT_EQ(value, i * 3);
+        } else {
+            ASSERT_EQ(data, NULL);
+        }
+    }
+
+    frozen_free(frozen);
+    unlink(path);
+    PASS();
+}
+
+
+static void test_frozen_fill(btree_t *btree, size_t num_keys)
+{
+    // Even keys in a scrambled order.
+    char key[4];
+    for (size_t i = 0; i < num_keys; i++) {
+        unsigned int k = (i * 7919) % num_keys;
+        int value = 2 * k * 3;
+        test_key(2 * k, key);
+        btree_insert(btree, key, (char*)&value);
+    }
+}
+
+
+TEST test_frozen__empty()
+{
+    // An empty tree freezes to an image where every search misses.
+    page_pool_t *pool = page_pool_init(4);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    int ret = test_frozen_search(btree, 0);
+    btree_free(btree);
+    page_pool_free(pool);
+    return ret;
+}
+
+
+TEST test_frozen__sizes()
+{
+    // Every tree shape from a single key to a few levels of leaves, including
+    // complete and almost complete Eytzinger trees.
+    size_t sizes[] = {1, 2, 3, 7, 8, 15, 16, 17, 100, 1000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        page_pool_t *pool = page_pool_init(500);
+        btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+        test_frozen_fill(btree, sizes[i]);
+        int ret = test_frozen_search(btree, sizes[i]);
+        btree_free(btree);
+        page_pool_free(pool);
+        if (ret != 0)
+            return ret;
+    }
+    PASS();
+}
+
+
+TEST test_frozen__buffered()
+{
+    // Inserts still sitting in buffers make it into the image.
+    page_pool_t *pool = page_pool_init(500);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), BTREE_BUFFERED);
+    test_frozen_fill(btree, 1000);
+    int ret = test_frozen_search(btree, 1000);
+    btree_free(btree);
+    page_pool_free(pool);
+    return ret;
+}
+
+
+TEST test_frozen_open__not_frozen()
+{
+    // Files without the header, or cut short, are refused.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "frozen");
+    ASSERT_EQ(frozen_open(path), NULL);
+
+    page_pool_t *pool = page_pool_init(10);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    test_frozen_fill(btree, 10);
+    ASSERT_EQ(btree_freeze(btree, path), 0);
+    ASSERT_EQ(truncate(path, FROZEN_HEADER_SIZE + 4), 0);
+    ASSERT_EQ(frozen_open(path), NULL);
+
+    btree_free(btree);
+    page_pool_free(pool);
+    unlink(path);
+    PASS();
+}
+
+
+TEST test_frozen__separated()
+{
+    // A tree whose values live in a value log freezes the values themselves,
+    // which stay readable after the log is collected.
+    char path[TEST_PATH_SIZE], log_path[TEST_PATH_SIZE];
+    test_temp_path(path, "frozen");
+    test_temp_path(log_path, "frozen");
+    vlog_t *vlog = vlog_open(log_path);
+    page_pool_t *pool = page_pool_init(100);
+    btree_t *btree = btree_allocate_separated(pool, vlog, 4, 64, 0);
+    char key[4], value[64], *data;
+
+    for (unsigned int i = 0; i < 100; i++) {
+        test_key(i, key);
+        memset(value, i, sizeof(value));
+        btree_insert(btree, key, value);
+    }
+    ASSERT_EQ(btree_freeze(btree, path), 0);
+    for (unsigned int i = 0; i < 100; i++) {
+        test_key(i, key);
+        btree_delete(btree, key);
+    }
+    ASSERT_EQ(btree_value_log_gc(btree, vlog->head), 0);
+
+    frozen_t *frozen = frozen_open(path);
+    ASSERT(frozen != NULL);
+    for (unsigned int i = 0; i < 100; i++) {
+        test_key(i, key);
+        frozen_search(frozen, key, &data);
+        ASSERT(data != NULL);
+        ASSERT_EQ(data[0], (char)i);
+        ASSERT_EQ(data[63], (char)i);
+    }
+
+    frozen_free(frozen);
+    btree_free(btree);
+    page_pool_free(pool);
+    vlog_free(vlog);
+    unlink(path);
+    unlink(log_path);
+    PASS();
+}
+
+
+GREATEST_SUITE(frozen_suite)
+{
+    RUN_TEST(test_frozen__empty);
+    RUN_TEST(test_frozen__sizes);
+    RUN_TEST(test_frozen__buffered);
+    RUN_TEST(test_frozen__separated);
+    RUN_TEST(test_frozen_open__not_frozen);
+}
@@ -0,0 +1,200 @@
+#include "greatest.h"
+
+#include "hash_index.h"
+
+
+/* hash_index tests */
+
+TEST test_hash_index_allocate__normal(void)
+{
+    // A new index is a single empty bucket.
+    page_pool_t *pool = page_pool_init(1);
+    hash_index_t *index = hash_index_allocate(pool, sizeof(int), sizeof(int));
+
+    ASSERT(index != NULL);
+    ASSERT_EQ(index->global_depth, 0);
+    ASSERT_EQ(index->num_keys, 0);
+    ASSERT_EQ(pool->len, 1);
+
+    hash_index_free(index);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_hash_index_allocate__bad_sizes(void)
+{
+    // Reject empty keys or data, entries that don't fit, and a missing pool.
+    page_pool_t *pool = page_pool_init(1);
+
+    ASSERT_EQ(hash_index_allocate(pool, 0, sizeof(int)), NULL);
+    ASSERT_EQ(hash_index_allocate(pool, sizeof(int), 0), NULL);
+    ASSERT_EQ(hash_index_allocate(pool, PAGE_SIZE, sizeof(int)), NULL);
+    ASSERT_EQ(hash_index_allocate(NULL, sizeof(int), sizeof(int)), NULL);
+
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_hash_index_insert__many(void)
+{
+    // Enough inserts to split buckets and grow the directory several times.
+    page_pool_t *pool = page_pool_init(1000);
+    hash_index_t *index = hash_index_allocate(pool, sizeof(int), sizeof(int));
+    const int count = 10000;
+    char *data;
+
+    for (int i = 0; i < count; i++) {
+        int value = -i;
+        hash_index_insert(index, (char*)&i, (char*)&value);
+    }
+    ASSERT_EQ(index->num_keys, count);
+    ASSERT(index->global_depth > 4);
+
+    for (int i = 0; i < count; i++) {
+        hash_index_search(index, (char*)&i, &data);
+        ASSERT(data != NULL);
+        ASSERT_EQ(*(int*)data, -i);
+    }
+    for (int i = count; i < 2 * count; i++) {
+        hash_index_search(index, (char*)&i, &data);
+        ASSERT_EQ(data, NULL);
+    }
+
+    hash_index_free(index);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_hash_index_insert__full_pool(void)
+{
+    // Once the pool has no pages left, inserts fail without doubling the
+    // directory past what the pool could ever fill, and keep what they had.
+    page_pool_t *pool = page_pool_init(4);
+    hash_index_t *index = hash_index_allocate(pool, sizeof(int), sizeof(int));
+    size_t found = 0;
+    char *data;
+
+    for (int i = 0; i < 500; i++)
+        hash_index_insert(index, (char*)&i, (char*)&i);
+    ASSERT_EQ(pool->len, 4);
+    ASSERT(index->num_keys <= 4 * index->bucket_capacity);
+    ASSERT(((size_t)1 << index->global_depth) < 2 * 4 * index->bucket_capacity);
+
+    for (int i = 0; i < 500; i++) {
+        hash_index_search(index, (char*)&i, &data);
+        if (data != NULL) {
+            ASSERT_EQ(*(int*)data, i);
+            found++;
+        }
+    }
+    ASSERT_EQ(found, index->num_keys);
+
+    hash_index_free(index);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_hash_index_insert__overwrite(void)
+{
+    // Inserting an existing key replaces its data.
+    page_pool_t *pool = page_pool_init(1);
+    hash_index_t *index = hash_index_allocate(pool, sizeof(int), sizeof(int));
+    int key = 5, value;
+    char *data;
+
+    value = 1;
+    hash_index_insert(index, (char*)&key, (char*)&value);
+    value = 2;
+    hash_index_insert(index, (char*)&key, (char*)&value);
+
+    ASSERT_EQ(index->num_keys, 1);
+    hash_index_search(index, (char*)&key, &data);
+    ASSERT_EQ(*(int*)data, 2);
+
+    hash_index_free(index);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_hash_index_delete__normal(void)
+{
+    // Deleted keys disappear and the rest are untouched.
+    page_pool_t *pool = page_pool_init(100);
+    hash_index_t *index = hash_index_allocate(pool, sizeof(int), sizeof(int));
+    char *data;
+
+    for (int i = 0; i < 1000; i++)
+        hash_index_insert(index, (char*)&i, (char*)&i);
+    for (int i = 0; i < 1000; i += 3)
+        ASSERT_EQ(hash_index_delete(index, (char*)&i), 0);
+    int missing = 1000;
+    ASSERT_EQ(hash_index_delete(index, (char*)&missing), -1);
+
+    for (int i = 0; i < 1000; i++) {
+        hash_index_search(index, (char*)&i, &data);
+        if (i % 3 == 0) {
+            ASSERT_EQ(data, NULL);
+        } else {
+            ASSERT(data != NULL);
+            ASSERT_EQ(*(int*)data, i);
+        }
+    }
+
+    hash_index_free(index);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_hash_index__shared_pool(void)
+{
+    // A hash index and a btree can allocate from the same pool.
+    page_pool_t *pool = page_pool_init(200);
+    hash_index_t *index = hash_index_allocate(pool, sizeof(int), sizeof(int));
+    btree_t *btree = btree_allocate(pool, sizeof(int), sizeof(int));
+    char *data;
+
+    for (int i = 0; i < 500; i++) {
+        int value = i + 1;
+        hash_index_insert(index, (char*)&i, (char*)&i);
+        btree_insert(btree, (char*)&i, (char*)&value);
+    }
+    for (int i = 0; i < 500; i++) {
+        hash_index_search(index, (char*)&i, &data);
+        ASSERT_EQ(*(int*)data, i);
+        btree_search(btree, (char*)&i, &data);
+        ASSERT_EQ(*(int*)data, i + 1);
+    }
+
+    btree_free(btree);
+    hash_index_free(index);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+GREATEST_SUITE(hash_index_suite)
+{
+    RUN_TEST(test_hash_index_allocate__normal);
+    RUN_TEST(test_hash_index_allocate__bad_sizes);
+
+    RUN_TEST(test_hash_index_insert__many);
+    RUN_TEST(test_hash_index_insert__full_pool);
+    RUN_TEST(test_hash_index_insert__overwrite);
+
+    RUN_TEST(test_hash_index_delete__normal);
+
+    RUN_TEST(test_hash_index__shared_pool);
+}
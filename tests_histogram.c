@@ -0,0 +1,168 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "greatest.h"
+
+#include "histogram.h"
+#include "index.h"
+#include "tests_util.h"
+
+
+/* histogram tests */
+
+TEST test_histogram_bucket__bounds(void)
+{
+    // Every value falls inside its bucket's bounds, and buckets above the
+    // exact ones are no wider than a sixteenth of their lower bound.
+    uint64_t values[] = {0, 1, 15, 16, 17, 31, 32, 33, 1000, 123456789,
+                         (uint64_t)1 << 40, ((uint64_t)1 << 63) + 12345, UINT64_MAX};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        size_t bucket = histogram_bucket(values[i]);
+        ASSERT(bucket < HISTOGRAM_BUCKETS);
+        ASSERT(histogram_bucket_low(bucket) <= values[i]);
+        ASSERT(values[i] <= histogram_bucket_high(bucket));
+    }
+    for (size_t bucket = 1; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        ASSERT_EQ(histogram_bucket_low(bucket), histogram_bucket_high(bucket - 1) + 1);
+        ASSERT(histogram_bucket_high(bucket) - histogram_bucket_low(bucket)
+               <= histogram_bucket_low(bucket) / HISTOGRAM_SUB_BUCKETS);
+    }
+    ASSERT_EQ(histogram_bucket_high(HISTOGRAM_BUCKETS - 1), UINT64_MAX);
+
+    PASS();
+}
+
+
+TEST test_histogram_percentile__merge(void)
+{
+    // Percentiles come out within a bucket of the true value, and merging
+    // two halves gives the same histogram as recording everything in one.
+    histogram_t *whole = (histogram_t*)calloc(3, sizeof(histogram_t));
+    histogram_t *low = whole + 1, *high = whole + 2;
+
+    for (uint64_t v = 1; v <= 100000; v++) {
+        histogram_record(whole, v);
+        histogram_record(v <= 50000 ? low : high, v);
+    }
+    ASSERT_EQ(whole->count, 100000);
+    ASSERT_EQ(whole->max, 100000);
+    uint64_t p50 = histogram_percentile(whole, 0.5);
+    uint64_t p999 = histogram_percentile(whole, 0.999);
+    ASSERT(p50 >= 50000 && p50 <= 50000 + 50000 / HISTOGRAM_SUB_BUCKETS);
+    ASSERT(p999 >= 99900 && p999 <= 100000);
+    ASSERT_EQ(histogram_percentile(whole, 1.0), 100000);
+    ASSERT(histogram_mean(whole) > 50000 * 0.95 && histogram_mean(whole) < 50000 * 1.05);
+
+    histogram_merge(low, high);
+    ASSERT_EQ(memcmp(low, whole, sizeof(histogram_t)), 0);
+
+    free(whole);
+
+    PASS();
+}
+
+
+TEST test_histogram_write__round_trip(void)
+{
+    // A binary dump reads back unchanged, and one of a different shape is
+    // refused. The text dump summarizes and lists the buckets in use.
+    histogram_t *histograms = (histogram_t*)calloc(4, sizeof(histogram_t));
+    for (uint64_t v = 0; v < 1000; v++) {
+        histogram_record(&histograms[0], v * v);
+        histogram_record(&histograms[1], 7);
+    }
+
+    FILE *file = tmpfile();
+    ASSERT_EQ(histogram_write(histograms, 2, file), 0);
+    rewind(file);
+    ASSERT_EQ(histogram_read(histograms + 2, 2, file), 0);
+    ASSERT_EQ(memcmp(histograms, histograms + 2, 2 * sizeof(histogram_t)), 0);
+    rewind(file);
+    ASSERT_EQ(histogram_read(histograms + 2, 1, file), -1);
+    fclose(file);
+
+    char text[256];
+    file = tmpfile();
+    histogram_print(&histograms[1], "sevens", file);
+    rewind(file);
+    ASSERT(fgets(text, sizeof(text), file) != NULL);
+    ASSERT(strstr(text, "sevens: count 1000") != NULL);
+    ASSERT(strstr(text, "max 7") != NULL);
+    ASSERT(fgets(text, sizeof(text), file) != NULL);
+    ASSERT(strstr(text, "1.000000") != NULL);
+    ASSERT_EQ(fgets(text, sizeof(text), file), NULL);
+    fclose(file);
+
+    free(histograms);
+
+    PASS();
+}
+
+
+static void* test_histogram_worker(void *arg)
+{
+    btree_t *tree = (btree_t*)arg;
+    char key[4], *data;
+    for (unsigned int k = 0; k < 1000; k++) {
+        test_key(k, key);
+        btree_search(tree, key, &data);
+    }
+    return NULL;
+}
+
+TEST test_latency_collect__operations(void)
+{
+    // Enabled, every insert and search is timed along with the splits and
+    // page creations they cause, from every thread; disabled, nothing is.
+    page_pool_t *pool = page_pool_init(1000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    histogram_t *histograms = (histogram_t*)malloc(LATENCY_OPS * sizeof(histogram_t));
+    pthread_t id;
+    char key[4], *data;
+
+    size_t pages = pool->len;
+    latency_reset();
+    latency_enable(1);
+    for (unsigned int i = 0; i < 1000; i++) {
+        // Scattered keys, so splits happen mid-leaf rather than by appending.
+        test_key((i * 7919) % 1000, key);
+        btree_insert(btree, key, (char*)&i);
+    }
+    for (unsigned int k = 0; k < 1000; k++) {
+        test_key(k, key);
+        btree_search(btree, key, &data);
+    }
+    ASSERT_EQ(pthread_create(&id, NULL, test_histogram_worker, btree), 0);
+    pthread_join(id, NULL);
+    latency_enable(0);
+
+    latency_collect(histograms);
+    ASSERT_EQ(histograms[LATENCY_INSERT].count, 1000);
+    ASSERT_EQ(histograms[LATENCY_SEARCH].count, 2000);
+    ASSERT(histograms[LATENCY_SPLIT].count > 0);
+    ASSERT_EQ(histograms[LATENCY_PAGE_CREATE].count, pool->len - pages);
+    ASSERT(histograms[LATENCY_INSERT].max >= histograms[LATENCY_SPLIT].max);
+
+    btree_search(btree, key, &data);
+    latency_collect(histograms);
+    ASSERT_EQ(histograms[LATENCY_SEARCH].count, 2000);
+    latency_reset();
+    latency_collect(histograms);
+    ASSERT_EQ(histograms[LATENCY_SEARCH].count, 0);
+
+    free(histograms);
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+GREATEST_SUITE(histogram_suite)
+{
+    RUN_TEST(test_histogram_bucket__bounds);
+    RUN_TEST(test_histogram_percentile__merge);
+    RUN_TEST(test_histogram_write__round_trip);
+    RUN_TEST(test_latency_collect__operations);
+}
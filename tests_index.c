@@ -1,6 +1,17 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include "greatest.h"
 
 #include "index.h"
+#include "page_io.h"
+#include "vlog.h"
+#include "tests_util.h"
 
 
 /* page_pool tests */
@@ -265,6 +276,237 @@ TEST test_page_pool_free__null(void)
 }
 
 
+TEST test_page_pool_open__empty_file(void)
+{
+    // Opening an empty file gives an empty pool that can grow.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    page_pool_t *pool = page_pool_open(path, 4);
+
+    ASSERT(pool != NULL);
+    ASSERT_EQ(pool->len, 0);
+
+    size_t index = 1337;
+    page_t *page = page_pool_create_page(pool, &index);
+    ASSERT(page != NULL);
+    ASSERT_EQ(index, 0);
+
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+TEST test_page_pool_open__reload(void)
+{
+    // Synced pages should come back from the file when it is reopened, and
+    // so should pages changed after the last sync.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    page_pool_t *pool = page_pool_open(path, 4);
+    size_t index;
+    for (int i = 0; i < 3; i++) {
+        page_t *page = page_pool_create_page(pool, &index);
+        memset(page->data, 'a' + i, PAGE_SIZE);
+    }
+    ASSERT_EQ(page_pool_sync(pool), 0);
+    page_pool_free(pool);
+
+    pool = page_pool_open(path, 4);
+    ASSERT(pool != NULL);
+    ASSERT_EQ(pool->len, 3);
+
+    // nothing is read until it is asked for
+    for (int i = 0; i < 3; i++)
+        ASSERT_EQ(pool->pages[i], NULL);
+
+    for (int i = 2; i >= 0; i--) {
+        page_t *page = page_pool_get_page(pool, i);
+        ASSERT(page != NULL);
+        ASSERT_EQ(page->data[0], 'a' + i);
+        ASSERT_EQ(page->data[PAGE_SIZE - 1], 'a' + i);
+    }
+
+    // Freeing the pool writes back what changed since the last sync.
+    memset(page_pool_get_page(pool, 1)->data, 'z', PAGE_SIZE);
+    page_pool_mark_dirty(pool, 1);
+    page_pool_free(pool);
+    pool = page_pool_open(path, 4);
+    ASSERT_EQ(page_pool_get_page(pool, 1)->data[0], 'z');
+    ASSERT_EQ(page_pool_get_page(pool, 2)->data[0], 'c');
+
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+TEST test_page_pool_open__too_many_pages(void)
+{
+    // A file with more pages than max_len cannot be opened.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    page_pool_t *pool = page_pool_open(path, 2);
+    size_t index;
+    page_pool_create_page(pool, &index);
+    page_pool_create_page(pool, &index);
+    page_pool_sync(pool);
+    page_pool_free(pool);
+
+    pool = page_pool_open(path, 1);
+    ASSERT_EQ(pool, NULL);
+
+    unlink(path);
+
+    PASS();
+}
+
+
+TEST test_page_pool_get_page__readahead(void)
+{
+    // Walking the pool in page order should prefetch the pages ahead of us.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    page_pool_t *pool = page_pool_open(path, 32);
+    size_t index;
+    for (int i = 0; i < 32; i++) {
+        page_t *page = page_pool_create_page(pool, &index);
+        page->data[0] = i;
+    }
+    page_pool_sync(pool);
+    page_pool_free(pool);
+
+    pool = page_pool_open(path, 32);
+    ASSERT(page_pool_get_page(pool, 0) != NULL);
+    // a single access is not a stream
+    ASSERT_EQ(pool->pages[1], NULL);
+
+    ASSERT(page_pool_get_page(pool, 1) != NULL);
+    for (int i = 2; i < 2 + PAGE_POOL_READAHEAD; i++)
+        ASSERT(pool->pages[i] != NULL);
+    ASSERT_EQ(pool->pages[2 + PAGE_POOL_READAHEAD], NULL);
+
+    for (int i = 2; i < 32; i++) {
+        page_t *page = page_pool_get_page(pool, i);
+        ASSERT(page != NULL);
+        ASSERT_EQ(page->data[0], i);
+    }
+
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+TEST test_page_pool_evict__normal(void)
+{
+    // Evicted pages are written back and can be read again.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    page_pool_t *pool = page_pool_open(path, 2);
+    size_t index;
+    page_t *page = page_pool_create_page(pool, &index);
+    page->data[7] = 42;
+
+    ASSERT_EQ(page_pool_evict(pool, index), 0);
+    ASSERT_EQ(pool->pages[index], NULL);
+
+    page = page_pool_get_page(pool, index);
+    ASSERT(page != NULL);
+    ASSERT_EQ(page->data[7], 42);
+
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+TEST test_page_pool_evict__in_memory(void)
+{
+    // Pages of a pool without a file cannot be evicted.
+    page_pool_t *pool = page_pool_init(2);
+    size_t index;
+    page_pool_create_page(pool, &index);
+
+    ASSERT_EQ(page_pool_evict(pool, index), -1);
+    ASSERT(pool->pages[index] != NULL);
+
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+/* Returns the newest io_uring descriptor of this process, or -1. */
+static int test_page_pool_uring_fd(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == NULL)
+        return -1;
+    int found = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char link[300], target[64];
+        snprintf(link, sizeof(link), "/proc/self/fd/%s", entry->d_name);
+        ssize_t len = readlink(link, target, sizeof(target) - 1);
+        if (len < 0)
+            continue;
+        target[len] = '\0';
+        int fd = atoi(entry->d_name);
+        if (strcmp(target, "anon_inode:[io_uring]") == 0 && fd > found)
+            found = fd;
+    }
+    closedir(dir);
+    return found;
+}
+
+
+TEST test_page_pool_get_page__io_failure(void)
+{
+    // A read that can never be collected fails instead of waiting forever.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    page_pool_t *pool = page_pool_open(path, 4);
+    size_t index;
+    page_pool_create_page(pool, &index);
+    page_pool_create_page(pool, &index);
+    ASSERT_EQ(page_pool_evict(pool, 0), 0);
+    ASSERT_EQ(page_pool_evict(pool, 1), 0);
+
+    int ring_fd = test_page_pool_uring_fd();
+    if (page_io_backend(pool->io) != PAGE_IO_URING || ring_fd < 0) {
+        page_pool_free(pool);
+        unlink(path);
+        SKIPm("io_uring is not available");
+    }
+    // Swap the ring for a file io_uring_enter() refuses, so the queued read
+    // is never submitted.
+    int null_fd = open("/dev/null", O_RDONLY);
+    dup2(null_fd, ring_fd);
+    close(null_fd);
+
+    page_pool_prefetch(pool, 0, 1);
+    ASSERT(pool->meta[0].reading);
+    ASSERT_EQ(page_pool_get_page(pool, 0), NULL);
+    ASSERT_EQ(pool->meta[0].reading, 0);
+    ASSERT_EQ(pool->pages[0], NULL);
+
+    page_pool_prefetch(pool, 1, 1);
+    ASSERT_EQ(page_pool_wait(pool), -1);
+    ASSERT_EQ(page_pool_evict(pool, 1), -1);
+    ASSERT_EQ(pool->meta[1].reading, 0);
+
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
 GREATEST_SUITE(page_pool_suite)
 {
     RUN_TEST(test_page_pool_init__normal);
@@ -284,6 +526,14 @@ GREATEST_SUITE(page_pool_suite)
     RUN_TEST(test_page_pool_free__empty);
     RUN_TEST(test_page_pool_free__nonempty);
     RUN_TEST(test_page_pool_free__null);
+
+    RUN_TEST(test_page_pool_open__empty_file);
+    RUN_TEST(test_page_pool_open__reload);
+    RUN_TEST(test_page_pool_open__too_many_pages);
+    RUN_TEST(test_page_pool_get_page__readahead);
+    RUN_TEST(test_page_pool_get_page__io_failure);
+    RUN_TEST(test_page_pool_evict__normal);
+    RUN_TEST(test_page_pool_evict__in_memory);
 }
 
 
@@ -361,6 +611,1877 @@ TEST test_btree_allocate__twice_on_same_pool(test_btree_environ_t *environ)
 }
 
 
+TEST test_btree_allocate__too_large(test_btree_environ_t *environ)
+{
+    // Keys and data must leave room for a few entries per page.
+    btree_t *btree = btree_allocate(environ->pool, PAGE_SIZE / 2, sizeof(int));
+    ASSERT_EQ(btree, NULL);
+
+    PASS();
+}
+
+
+TEST test_btree_search__empty(test_btree_environ_t *environ)
+{
+    // Nothing can be found in an empty tree.
+    btree_t *btree = btree_allocate(environ->pool, 4, sizeof(int));
+    char key[4];
+    char *data = (char*)1;
+    test_key(1, key);
+
+    btree_search(btree, key, &data);
+    ASSERT_EQ(data, NULL);
+
+    btree_free(btree);
+
+    PASS();
+}
+
+
+TEST test_btree_insert__single(test_btree_environ_t *environ)
+{
+    // A single insert can be found again, and nothing else can.
+    btree_t *btree = btree_allocate(environ->pool, 4, sizeof(int));
+    char key[4];
+    int value = 42;
+    char *data;
+
+    test_key(7, key);
+    btree_insert(btree, key, (char*)&value);
+    ASSERT_EQ(btree->num_keys, 1);
+
+    btree_search(btree, key, &data);
+    ASSERT(data != NULL);
+    ASSERT_EQ(*(int*)data, 42);
+
+    test_key(8, key);
+    btree_search(btree, key, &data);
+    ASSERT_EQ(data, NULL);
+
+    btree_free(btree);
+
+    PASS();
+}
+
+
+TEST test_btree_insert__overwrite(test_btree_environ_t *environ)
+{
+    // Inserting an existing key replaces its data.
+    btree_t *btree = btree_allocate(environ->pool, 4, sizeof(int));
+    char key[4];
+    int value;
+    char *data;
+
+    test_key(7, key);
+    value = 1;
+    btree_insert(btree, key, (char*)&value);
+    value = 2;
+    btree_insert(btree, key, (char*)&value);
+
+    ASSERT_EQ(btree->num_keys, 1);
+    btree_search(btree, key, &data);
+    ASSERT_EQ(*(int*)data, 2);
+
+    btree_free(btree);
+
+    PASS();
+}
+
+
+TEST test_btree_insert__many(void)
+{
+    // Enough inserts, in a scrambled order, to split leaves and internal nodes.
+    page_pool_t *pool = page_pool_init(1000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    char key[4];
+    char *data;
+    const int count = 5000;
+
+    for (int i = 0; i < count; i++) {
+        int value = (i * 7919) % count;
+        test_key(value, key);
+        btree_insert(btree, key, (char*)&value);
+    }
+    ASSERT_EQ(btree->num_keys, count);
+    ASSERT_EQ(btree->root.node_type, NODE_TYPE_INTERNAL);
+
+    for (int i = 0; i < count; i++) {
+        test_key(i, key);
+        btree_search(btree, key, &data);
+        ASSERT(data != NULL);
+        ASSERT_EQ(*(int*)data, i);
+    }
+    test_key(count, key);
+    btree_search(btree, key, &data);
+    ASSERT_EQ(data, NULL);
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_insert__leaves_linked(void)
+{
+    // Following leaf next links from the left visits every key in order.
+    page_pool_t *pool = page_pool_init(100);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    char key[4];
+    const int count = 500;
+
+    for (int i = count - 1; i >= 0; i--) {
+        test_key(i, key);
+        btree_insert(btree, key, (char*)&i);
+    }
+
+    relation_t node = btree->root;
+    while (node.node_type == NODE_TYPE_INTERNAL) {
+        internal_node_t *internal = (internal_node_t*)page_pool_get_page(pool, node.index)->data;
+        node = internal->children[0];
+    }
+    size_t index = node.index;
+    size_t prev = PAGE_INDEX_NONE;
+    int expected = 0;
+    while (index != PAGE_INDEX_NONE) {
+        leaf_node_t *leaf = (leaf_node_t*)page_pool_get_page(pool, index)->data;
+        ASSERT_EQ(leaf->prev, prev);
+        for (size_t i = 0; i < leaf->header.num_keys; i++) {
+            test_key(expected++, key);
+            ASSERT_EQ(memcmp(leaf->keys + i * 4, key, 4), 0);
+        }
+        prev = index;
+        index = leaf->next;
+    }
+    ASSERT_EQ(expected, count);
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_delete__normal(void)
+{
+    // Deleted keys disappear and the rest are untouched.
+    page_pool_t *pool = page_pool_init(100);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    char key[4];
+    char *data;
+    const int count = 300;
+
+    for (int i = 0; i < count; i++) {
+        test_key(i, key);
+        btree_insert(btree, key, (char*)&i);
+    }
+    for (int i = 0; i < count; i += 2) {
+        test_key(i, key);
+        ASSERT_EQ(btree_delete(btree, key), 0);
+    }
+    ASSERT_EQ(btree->num_keys, count / 2);
+
+    for (int i = 0; i < count; i++) {
+        test_key(i, key);
+        btree_search(btree, key, &data);
+        if (i % 2 == 0) {
+            ASSERT_EQ(data, NULL);
+        } else {
+            ASSERT(data != NULL);
+            ASSERT_EQ(*(int*)data, i);
+        }
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_delete__missing(test_btree_environ_t *environ)
+{
+    // Deleting a key that is not there is an error.
+    btree_t *btree = btree_allocate(environ->pool, 4, sizeof(int));
+    char key[4];
+
+    test_key(1, key);
+    ASSERT_EQ(btree_delete(btree, key), -1);
+    btree_insert(btree, key, key);
+    ASSERT_EQ(btree_delete(btree, key), 0);
+    ASSERT_EQ(btree_delete(btree, key), -1);
+
+    btree_free(btree);
+
+    PASS();
+}
+
+
+TEST test_btree_bloom__search(void)
+{
+    // With a filter enabled, hits and misses still give the right answers.
+    page_pool_t *pool = page_pool_init(100);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    char key[4];
+    char *data;
+
+    // enabling on a non-empty tree picks up what is already there
+    for (int i = 0; i < 100; i++) {
+        test_key(i * 2, key);
+        btree_insert(btree, key, (char*)&i);
+    }
+    ASSERT_EQ(btree_bloom_enable(btree, 10), 0);
+    for (int i = 100; i < 500; i++) {
+        test_key(i * 2, key);
+        btree_insert(btree, key, (char*)&i);
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        test_key(i, key);
+        btree_search(btree, key, &data);
+        if (i % 2 == 0) {
+            ASSERT(data != NULL);
+            ASSERT_EQ(*(int*)data, i / 2);
+        } else {
+            ASSERT_EQ(data, NULL);
+        }
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_bloom__delete(void)
+{
+    // Deleting keys, enough to rebuild the filter, keeps lookups correct.
+    page_pool_t *pool = page_pool_init(100);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    char key[4];
+    char *data;
+
+    btree_bloom_enable(btree, 200);
+    for (int i = 0; i < 200; i++) {
+        test_key(i, key);
+        btree_insert(btree, key, (char*)&i);
+    }
+    for (int i = 0; i < 150; i++) {
+        test_key(i, key);
+        ASSERT_EQ(btree_delete(btree, key), 0);
+    }
+    ASSERT(btree->bloom_deletes < 150);
+
+    for (int i = 0; i < 200; i++) {
+        test_key(i, key);
+        btree_search(btree, key, &data);
+        if (i < 150)
+            ASSERT_EQ(data, NULL);
+        else
+            ASSERT(data != NULL);
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_bloom__no_page_reads(void)
+{
+    // Misses rejected by the filter should not read any page from disk.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    page_pool_t *pool = page_pool_open(path, 100);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    char key[4];
+    char *data;
+
+    for (int i = 0; i < 200; i++) {
+        test_key(i, key);
+        btree_insert(btree, key, (char*)&i);
+    }
+    btree_bloom_enable(btree, 200);
+    for (size_t i = 0; i < pool->len; i++)
+        page_pool_evict(pool, i);
+
+    int rejected = 0;
+    for (int i = 1000; i < 1100; i++) {
+        test_key(i, key);
+        btree_search(btree, key, &data);
+        ASSERT_EQ(data, NULL);
+        int resident = 0;
+        for (size_t j = 0; j < pool->len; j++)
+            resident += pool->pages[j] != NULL;
+        rejected += resident == 0;
+    }
+    // allow for a few false positives
+    ASSERT(rejected > 90);
+
+    btree_free(btree);
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+TEST test_btree_bloom__leaf_readahead(void)
+{
+    // Walks along the leaves of a tree built in random order read ahead
+    // through the leaves' parents, so few of the reads are waited on alone.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    char frozen_path[TEST_PATH_SIZE];
+    test_temp_path(frozen_path, "pool");
+    ASSERT(strcmp(path, frozen_path) != 0);
+    page_pool_t *pool = page_pool_open(path, 1000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    char key[4];
+
+    for (int i = 0; i < 3000; i++) {
+        int k = (i * 7919) % 3000;
+        test_key(k, key);
+        btree_insert(btree, key, (char*)&k);
+    }
+    size_t leaves = 0;
+    for (size_t i = 0; i < pool->len; i++)
+        leaves += ((node_header_t*)pool->pages[i]->data)->node_type == NODE_TYPE_LEAF;
+
+    for (int walk = 0; walk < 2; walk++) {
+        ASSERT_EQ(page_pool_sync(pool), 0);
+        for (size_t i = 0; i < pool->len; i++)
+            ASSERT_EQ(page_pool_evict(pool, i), 0);
+        size_t misses = pool->misses;
+        if (walk == 0)
+            ASSERT_EQ(btree_bloom_enable(btree, 3000), 0);
+        else
+            ASSERT_EQ(btree_freeze(btree, frozen_path), 0);
+        ASSERT(pool->misses - misses < leaves / 2);
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+    unlink(path);
+    unlink(frozen_path);
+
+    PASS();
+}
+
+
+TEST test_btree_append__packs_leaves(void)
+{
+    // Ascending inserts should leave every leaf but the last one full.
+    page_pool_t *pool = page_pool_init(1000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    char key[4];
+    char *data;
+    const int count = 10000;
+
+    for (int i = 0; i < count; i++) {
+        test_key(i, key);
+        btree_insert(btree, key, (char*)&i);
+    }
+
+    size_t leaves = 0;
+    size_t index = btree->rightmost_leaf;
+    leaf_node_t *last = (leaf_node_t*)page_pool_get_page(pool, index)->data;
+    ASSERT_EQ(last->next, PAGE_INDEX_NONE);
+    while (index != PAGE_INDEX_NONE) {
+        leaf_node_t *leaf = (leaf_node_t*)page_pool_get_page(pool, index)->data;
+        if (leaf != last)
+            ASSERT_EQ(leaf->header.num_keys, btree->leaf_capacity);
+        leaves++;
+        index = leaf->prev;
+    }
+    ASSERT_EQ(leaves, (count + btree->leaf_capacity - 1) / btree->leaf_capacity);
+
+    for (int i = 0; i < count; i++) {
+        test_key(i, key);
+        btree_search(btree, key, &data);
+        ASSERT(data != NULL);
+        ASSERT_EQ(*(int*)data, i);
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_append__mixed_with_random(void)
+{
+    // Appends interleaved with inserts elsewhere and deletes of the tail.
+    page_pool_t *pool = page_pool_init(1000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    char key[4];
+    char *data;
+
+    for (int i = 0; i < 3000; i++) {
+        int k = 3 * i;
+        test_key(k, key);
+        btree_insert(btree, key, (char*)&k);
+        k = (i * 7919) % (3 * i + 1);
+        if (k % 3 == 0)
+            k++;
+        test_key(k, key);
+        btree_insert(btree, key, (char*)&k);
+    }
+    // empty the last leaf, so appends have to go the long way again
+    for (int k = 3 * 3000; k >= 3 * 2900; k--) {
+        test_key(k, key);
+        btree_delete(btree, key);
+    }
+    for (int k = 3 * 2900; k < 3 * 3100; k++) {
+        test_key(k, key);
+        btree_insert(btree, key, (char*)&k);
+    }
+
+    for (int k = 0; k < 3 * 3100; k++) {
+        test_key(k, key);
+        btree_search(btree, key, &data);
+        if (k % 3 == 0 || k >= 3 * 2900)
+            ASSERT(data != NULL);
+        if (data != NULL)
+            ASSERT_EQ(*(int*)data, k);
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_search_view__normal(test_btree_environ_t *environ)
+{
+    // A view points straight into the page holding the value and pins it.
+    btree_t *btree = btree_allocate(environ->pool, 4, sizeof(int));
+    btree_view_t view;
+    char key[4];
+    int value = 99;
+
+    test_key(3, key);
+    btree_insert(btree, key, (char*)&value);
+
+    ASSERT_EQ(btree_search_view(btree, key, &view), 0);
+    page_t *page = page_pool_get_page(environ->pool, view.index);
+    ASSERT(view.data >= page->data && view.data + view.size <= page->data + PAGE_SIZE);
+    ASSERT_EQ(view.size, sizeof(int));
+    ASSERT_EQ(*(int*)view.data, 99);
+    ASSERT_EQ(environ->pool->meta[view.index].pins, 1);
+    ASSERT(btree_view_valid(&view));
+
+    btree_view_release(&view);
+    ASSERT_EQ(environ->pool->meta[view.index].pins, 0);
+    ASSERT_FALSE(btree_view_valid(&view));
+
+    btree_free(btree);
+
+    PASS();
+}
+
+
+TEST test_btree_search_view__missing(test_btree_environ_t *environ)
+{
+    // Looking up a missing key gives an empty view and pins nothing.
+    btree_t *btree = btree_allocate(environ->pool, 4, sizeof(int));
+    btree_view_t view;
+    char key[4];
+
+    test_key(3, key);
+    ASSERT_EQ(btree_search_view(btree, key, &view), -1);
+    ASSERT_EQ(view.data, NULL);
+    ASSERT_EQ(environ->pool->meta[btree->root.index].pins, 0);
+
+    btree_free(btree);
+
+    PASS();
+}
+
+
+TEST test_btree_search_view__invalidated(test_btree_environ_t *environ)
+{
+    // Changing the page under a view makes it invalid.
+    btree_t *btree = btree_allocate(environ->pool, 4, sizeof(int));
+    btree_view_t view;
+    char key[4];
+    int value = 1;
+
+    test_key(5, key);
+    btree_insert(btree, key, (char*)&value);
+    ASSERT_EQ(btree_search_view(btree, key, &view), 0);
+
+    // an insert before it shifts the value along the page
+    test_key(4, key);
+    btree_insert(btree, key, (char*)&value);
+    ASSERT_FALSE(btree_view_valid(&view));
+
+    btree_view_release(&view);
+    btree_free(btree);
+
+    PASS();
+}
+
+
+TEST test_btree_search_view__pinned_not_evicted(void)
+{
+    // A page with a view on it cannot be evicted until the view is released.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    page_pool_t *pool = page_pool_open(path, 10);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    btree_view_t view;
+    char key[4];
+    int value = 7;
+
+    test_key(1, key);
+    btree_insert(btree, key, (char*)&value);
+    ASSERT_EQ(btree_search_view(btree, key, &view), 0);
+
+    ASSERT_EQ(page_pool_evict(pool, view.index), -1);
+    ASSERT(pool->pages[view.index] != NULL);
+    ASSERT_EQ(*(int*)view.data, 7);
+
+    btree_view_release(&view);
+    ASSERT_EQ(page_pool_evict(pool, view.index), 0);
+
+    btree_free(btree);
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+/* Buffered data is not necessarily aligned, so read it bytewise. */
+static int test_btree_data(char *data)
+{
+    int value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+
+/* Deterministic pseudo-random numbers, so failures reproduce. */
+static unsigned int test_btree_rand(unsigned int *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return (*state >> 16) & 0x7fff;
+}
+
+
+TEST test_btree_learned__allocate(test_btree_environ_t *environ)
+{
+    // Learned leaves give up room for their model, and need integer-sized keys.
+    btree_t *plain = btree_allocate(environ->pool, 4, sizeof(int));
+    btree_t *learned = btree_allocate_with_flags(environ->pool, 4, sizeof(int), BTREE_LEARNED);
+
+    ASSERT(learned != NULL);
+    ASSERT(learned->leaf_capacity < plain->leaf_capacity);
+    ASSERT_EQ(btree_allocate_with_flags(environ->pool, 9, sizeof(int), BTREE_LEARNED), NULL);
+
+    btree_free(plain);
+    btree_free(learned);
+
+    PASS();
+}
+
+
+TEST test_btree_learned__dense_keys(void)
+{
+    // Consecutive keys fit a line exactly, so every full leaf ends up with a
+    // model that has no error.
+    page_pool_t *pool = page_pool_init(200);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), BTREE_LEARNED);
+    char key[4];
+    char *data;
+
+    for (int i = 0; i < 1000; i++) {
+        test_key(i, key);
+        btree_insert(btree, key, (char*)&i);
+    }
+    for (int i = 0; i < 1000; i++) {
+        test_key(i, key);
+        btree_search(btree, key, &data);
+        ASSERT(data != NULL);
+        ASSERT_EQ(*(int*)data, i);
+    }
+
+    size_t leaves = 0;
+    size_t index = btree->rightmost_leaf;
+    while (index != PAGE_INDEX_NONE) {
+        leaf_node_t *leaf = (leaf_node_t*)page_pool_get_page(pool, index)->data;
+        leaf_model_t *model = (leaf_model_t*)((char*)leaf + PAGE_SIZE - sizeof(leaf_model_t));
+        if (leaf->header.num_keys == btree->leaf_capacity) {
+            ASSERT(model->valid);
+            ASSERT_EQ(model->error, 0);
+            leaves++;
+        }
+        index = leaf->prev;
+    }
+    ASSERT(leaves > 1);
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_learned__matches_reference(void)
+{
+    // Squared keys are far from linear, and a random mix of inserts and
+    // deletes keeps shifting slots under the models; answers must still
+    // match a plain array.
+    page_pool_t *pool = page_pool_init(2000);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), BTREE_LEARNED);
+    const int range = 2000;
+    int reference[2000];
+    unsigned int state = 7;
+    char key[4];
+    char *data;
+
+    for (int i = 0; i < range; i++)
+        reference[i] = -1;
+
+    for (int i = 0; i < 20000; i++) {
+        int k = test_btree_rand(&state) % range;
+        test_key(k * k, key);
+        if (test_btree_rand(&state) % 4 == 0) {
+            btree_delete(btree, key);
+            reference[k] = -1;
+        } else {
+            btree_insert(btree, key, (char*)&i);
+            reference[k] = i;
+        }
+    }
+
+    size_t rank = 0;
+    for (int k = 0; k < range; k++) {
+        test_key(k * k, key);
+        ASSERT_EQ(btree_rank(btree, key), rank);
+        btree_search(btree, key, &data);
+        if (reference[k] < 0) {
+            ASSERT_EQ(data, NULL);
+        } else {
+            ASSERT(data != NULL);
+            ASSERT_EQ(*(int*)data, reference[k]);
+            rank++;
+        }
+        // Keys between the squares miss too.
+        test_key(k * k + 1, key);
+        btree_search(btree, key, &data);
+        if (k > 0)
+            ASSERT_EQ(data, NULL);
+    }
+    ASSERT_EQ(btree->num_keys, rank);
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_buffered__allocate(test_btree_environ_t *environ)
+{
+    // Buffered trees keep fewer keys per internal node to make room for messages.
+    btree_t *plain = btree_allocate(environ->pool, 4, sizeof(int));
+    btree_t *buffered = btree_allocate_with_flags(environ->pool, 4, sizeof(int), BTREE_BUFFERED);
+
+    ASSERT(buffered != NULL);
+    ASSERT(buffered->internal_capacity < plain->internal_capacity);
+    ASSERT(buffered->message_capacity >= 2);
+    ASSERT_EQ(plain->message_capacity, 0);
+
+    btree_free(plain);
+    btree_free(buffered);
+
+    PASS();
+}
+
+
+TEST test_btree_buffered__matches_reference(void)
+{
+    // A random mix of inserts, overwrites and deletes gives the same answers
+    // as a plain array, both before and after everything is flushed.
+    page_pool_t *pool = page_pool_init(2000);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), BTREE_BUFFERED);
+    const int range = 2000;
+    int reference[2000];
+    unsigned int state = 1;
+    char key[4];
+    char *data;
+
+    for (int i = 0; i < range; i++)
+        reference[i] = -1;
+
+    for (int i = 0; i < 20000; i++) {
+        int k = test_btree_rand(&state) % range;
+        test_key(k, key);
+        if (test_btree_rand(&state) % 4 == 0) {
+            btree_delete(btree, key);
+            reference[k] = -1;
+        } else {
+            btree_insert(btree, key, (char*)&i);
+            reference[k] = i;
+        }
+    }
+    ASSERT_EQ(btree->root.node_type, NODE_TYPE_INTERNAL);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int k = 0; k < range; k++) {
+            test_key(k, key);
+            btree_search(btree, key, &data);
+            if (reference[k] < 0) {
+                ASSERT_EQ(data, NULL);
+            } else {
+                ASSERT(data != NULL);
+                ASSERT_EQ(test_btree_data(data), reference[k]);
+            }
+        }
+        ASSERT_EQ(btree_flush(btree), 0);
+    }
+
+    size_t live = 0;
+    for (int k = 0; k < range; k++)
+        live += reference[k] >= 0;
+    ASSERT_EQ(btree->num_keys, live);
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_buffered__defers_leaf_writes(void)
+{
+    // Once the root is internal, new inserts wait in its buffer.
+    page_pool_t *pool = page_pool_init(100);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), BTREE_BUFFERED);
+    char key[4];
+    char *data;
+    int i = 0;
+
+    while (btree->root.node_type == NODE_TYPE_LEAF) {
+        test_key(i, key);
+        btree_insert(btree, key, (char*)&i);
+        i++;
+    }
+    size_t applied = btree->num_keys;
+    test_key(i, key);
+    btree_insert(btree, key, (char*)&i);
+
+    ASSERT_EQ(btree->num_keys, applied);
+    btree_search(btree, key, &data);
+    ASSERT(data != NULL);
+    ASSERT_EQ(test_btree_data(data), i);
+
+    ASSERT_EQ(btree_flush(btree), 0);
+    ASSERT_EQ(btree->num_keys, applied + 1);
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_buffered__bloom(void)
+{
+    // Keys still buffered must not be filtered out.
+    page_pool_t *pool = page_pool_init(500);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), BTREE_BUFFERED);
+    char key[4];
+    char *data;
+
+    for (int i = 0; i < 1000; i++) {
+        test_key(i, key);
+        btree_insert(btree, key, (char*)&i);
+    }
+    ASSERT_EQ(btree_bloom_enable(btree, 10), 0);
+
+    for (int i = 0; i < 1000; i++) {
+        test_key(i, key);
+        btree_search(btree, key, &data);
+        ASSERT(data != NULL);
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+/* Checks every subtree count against the leaves under it; returns the
+ * number of entries under node. */
+static size_t test_btree_check_counts(btree_t *btree, relation_t node, int *ok)
+{
+    page_t *page = page_pool_get_page(btree->pool, node.index);
+    if (node.node_type == NODE_TYPE_LEAF)
+        return ((leaf_node_t*)page->data)->header.num_keys;
+
+    internal_node_t *internal = (internal_node_t*)page->data;
+    size_t *counts = (size_t*)&internal->children[btree->internal_capacity + 1];
+    size_t total = 0;
+    for (size_t i = 0; i <= internal->header.num_keys; i++) {
+        size_t count = test_btree_check_counts(btree, internal->children[i], ok);
+        if (count != counts[i])
+            *ok = 0;
+        total += count;
+    }
+    return total;
+}
+
+
+TEST test_btree_order_statistics(int flags)
+{
+    page_pool_t *pool = page_pool_init(2000);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), flags);
+    const int range = 3000;
+    char present[3000] = {0};
+    unsigned int state = 7;
+    char key[4], end[4];
+    char *found_key, *data;
+
+    // ascending appends first, then a random mix on top
+    for (int k = 0; k < range; k += 2) {
+        test_key(k, key);
+        btree_insert(btree, key, (char*)&k);
+        present[k] = 1;
+    }
+    for (int i = 0; i < 6000; i++) {
+        int k = test_btree_rand(&state) % range;
+        test_key(k, key);
+        if (test_btree_rand(&state) % 3 == 0) {
+            btree_delete(btree, key);
+            present[k] = 0;
+        } else {
+            btree_insert(btree, key, (char*)&k);
+            present[k] = 1;
+        }
+    }
+
+    size_t rank = 0;
+    for (int k = 0; k < range; k++) {
+        test_key(k, key);
+        ASSERT_EQ(btree_rank(btree, key), rank);
+        if (present[k]) {
+            ASSERT_EQ(btree_select(btree, rank, &found_key, &data), 0);
+            ASSERT_EQ(memcmp(found_key, key, 4), 0);
+            rank++;
+        }
+    }
+    ASSERT_EQ(rank, btree->num_keys);
+    ASSERT_EQ(btree_select(btree, rank, &found_key, &data), -1);
+    ASSERT_EQ(found_key, NULL);
+
+    int ok = 1;
+    ASSERT_EQ(test_btree_check_counts(btree, btree->root, &ok), btree->num_keys);
+    ASSERT(ok);
+
+    for (int i = 0; i < 200; i++) {
+        int a = test_btree_rand(&state) % range;
+        int b = a + test_btree_rand(&state) % 500;
+        size_t expected = 0;
+        for (int k = a; k < b && k < range; k++)
+            expected += present[k];
+        test_key(a, key);
+        test_key(b, end);
+        ASSERT_EQ(btree_count_range(btree, key, end), expected);
+        // backwards ranges are empty
+        ASSERT_EQ(btree_count_range(btree, end, key), 0);
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_order_statistics__plain(void)
+{
+    // Rank, select and range counts agree with a reference set.
+    return test_btree_order_statistics(0);
+}
+
+
+TEST test_btree_order_statistics__buffered(void)
+{
+    // The same for a buffered tree, where messages are flushed first.
+    return test_btree_order_statistics(BTREE_BUFFERED);
+}
+
+
+TEST test_btree_order_statistics__empty(test_btree_environ_t *environ)
+{
+    // Nothing has a rank above 0 in an empty tree, and nothing can be selected.
+    btree_t *btree = btree_allocate(environ->pool, 4, sizeof(int));
+    char key[4];
+    char *found_key, *data;
+
+    test_key(10, key);
+    ASSERT_EQ(btree_rank(btree, key), 0);
+    ASSERT_EQ(btree_select(btree, 0, &found_key, &data), -1);
+
+    btree_free(btree);
+
+    PASS();
+}
+
+
+/* Checks every key in [0, range) is found exactly when values[k] >= 0, that
+ * the counts add up, and that the leaves sit at consecutive page indexes in
+ * key order. */
+TEST test_btree_defrag_check(btree_t *btree, int *values, int range, int contiguous)
+{
+    char key[4];
+    char *data;
+    size_t live = 0;
+    for (int k = 0; k < range; k++) {
+        test_key(k, key);
+        btree_search(btree, key, &data);
+        if (values[k] < 0) {
+            ASSERT_EQ(data, NULL);
+        } else {
+            ASSERT(data != NULL);
+            ASSERT_EQ(test_btree_data(data), values[k]);
+            ASSERT_EQ(btree_rank(btree, key), live);
+            live++;
+        }
+    }
+    ASSERT_EQ(btree->num_keys, live);
+    int ok = 1;
+    ASSERT_EQ(test_btree_check_counts(btree, btree->root, &ok), live);
+    ASSERT(ok);
+
+    relation_t node = btree->root;
+    while (node.node_type == NODE_TYPE_INTERNAL)
+        node = ((internal_node_t*)page_pool_get_page(btree->pool, node.index)->data)->children[0];
+    size_t index = node.index, prev = PAGE_INDEX_NONE;
+    while (index != PAGE_INDEX_NONE) {
+        leaf_node_t *leaf = (leaf_node_t*)page_pool_get_page(btree->pool, index)->data;
+        ASSERT_EQ(leaf->prev, prev);
+        if (contiguous && prev != PAGE_INDEX_NONE)
+            ASSERT_EQ(index, prev + 1);
+        prev = index;
+        index = leaf->next;
+    }
+    ASSERT_EQ(btree->rightmost_leaf, prev);
+    PASS();
+}
+
+
+TEST test_btree_defrag__orders_leaves(void)
+{
+    // After random inserts scatter the leaves, defrag lays them out in key
+    // order without changing what the tree holds.
+    page_pool_t *pool = page_pool_init(2000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    int values[2000];
+    unsigned int state = 3;
+    char key[4];
+
+    for (int k = 0; k < 2000; k++)
+        values[k] = -1;
+    for (int i = 0; i < 3000; i++) {
+        int k = test_btree_rand(&state) % 2000;
+        test_key(k, key);
+        btree_insert(btree, key, (char*)&i);
+        values[k] = i;
+    }
+    size_t len = pool->len;
+
+    ASSERT_EQ(btree_defrag(btree, 0), 0);
+    ASSERT_EQ(pool->len, len);
+    int ret = test_btree_defrag_check(btree, values, 2000, 1);
+
+    btree_free(btree);
+    page_pool_free(pool);
+    return ret;
+}
+
+
+TEST test_btree_defrag__refill(void)
+{
+    // Leaves emptied by deletes are refilled from their siblings, and the
+    // pages freed that way are used again by later inserts.
+    page_pool_t *pool = page_pool_init(2000);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), BTREE_LEARNED);
+    int values[2000];
+    unsigned int state = 5;
+    char key[4];
+
+    for (int k = 0; k < 2000; k++) {
+        int k2 = (k * 7919) % 2000;
+        test_key(k2, key);
+        btree_insert(btree, key, (char*)&k);
+        values[k2] = k;
+    }
+    for (int k = 0; k < 2000; k++) {
+        if (test_btree_rand(&state) % 4 != 0) {
+            test_key(k, key);
+            ASSERT_EQ(btree_delete(btree, key), 0);
+            values[k] = -1;
+        }
+    }
+
+    size_t len = pool->len;
+    ASSERT_EQ(btree_defrag(btree, 1.0), 0);
+    ASSERT(btree->free_page != PAGE_INDEX_NONE);
+    int ret = test_btree_defrag_check(btree, values, 2000, 1);
+    if (ret != 0)
+        return ret;
+
+    // Full leaves, apart from the last child of each parent.
+    size_t leaves = 0;
+    for (size_t index = btree->rightmost_leaf; index != PAGE_INDEX_NONE; leaves++)
+        index = ((leaf_node_t*)page_pool_get_page(pool, index)->data)->prev;
+    ASSERT(leaves < btree->num_keys / btree->leaf_capacity * 2);
+
+    for (int k = 0; k < 2000; k += 2) {
+        test_key(k, key);
+        btree_insert(btree, key, (char*)&k);
+        values[k] = k;
+    }
+    ASSERT_EQ(pool->len, len);
+    ret = test_btree_defrag_check(btree, values, 2000, 0);
+
+    btree_free(btree);
+    page_pool_free(pool);
+    return ret;
+}
+
+
+TEST test_btree_defrag__incremental(void)
+{
+    // Small steps reach the same layout, and the tree stays usable and
+    // file-backed pages land at their new indexes in between.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    page_pool_t *pool = page_pool_open(path, 2000);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), BTREE_BUFFERED);
+    int values[1000];
+    unsigned int state = 9;
+    char key[4];
+
+    for (int k = 0; k < 1000; k++)
+        values[k] = -1;
+    for (int i = 0; i < 2000; i++) {
+        int k = test_btree_rand(&state) % 1000;
+        test_key(k, key);
+        if (i % 5 == 0) {
+            btree_delete(btree, key);
+            values[k] = -1;
+        } else {
+            btree_insert(btree, key, (char*)&i);
+            values[k] = i;
+        }
+    }
+
+    int steps = 0, ret;
+    while ((ret = btree_defrag_step(btree, 0.75, 4)) == 1) {
+        steps++;
+        for (size_t i = 0; i < pool->len; i++)
+            ASSERT_EQ(page_pool_evict(pool, i), 0);
+        ret = test_btree_defrag_check(btree, values, 1000, 0);
+        if (ret != 0)
+            return ret;
+    }
+    ASSERT_EQ(ret, 0);
+    ASSERT(steps > 1);
+    ret = test_btree_defrag_check(btree, values, 1000, 1);
+
+    btree_free(btree);
+    page_pool_free(pool);
+    unlink(path);
+    return ret;
+}
+
+
+TEST test_btree_defrag__pinned(test_btree_environ_t *environ)
+{
+    // A page held by a view keeps its index, so releasing the view unpins the
+    // right page. Its links to moved neighbours may still change.
+    btree_t *btree = btree_allocate(environ->pool, 4, sizeof(int));
+    int values[60];
+    char key[4];
+    btree_view_t view;
+
+    for (int k = 0; k < 60; k++) {
+        int k2 = 59 - k;
+        test_key(k2, key);
+        btree_insert(btree, key, (char*)&k);
+        values[k2] = k;
+    }
+    test_key(0, key);
+    ASSERT_EQ(btree_search_view(btree, key, &view), 0);
+    size_t index = view.index;
+
+    ASSERT_EQ(btree_defrag(btree, 0), 0);
+    ASSERT_EQ(test_btree_data((char*)view.data), 59);
+    btree_view_release(&view);
+    ASSERT_EQ(btree_search_view(btree, key, &view), 0);
+    ASSERT_EQ(view.index, index);
+    btree_view_release(&view);
+    int ret = test_btree_defrag_check(btree, values, 60, 0);
+
+    btree_free(btree);
+    return ret;
+}
+
+
+TEST test_btree_separated(int flags)
+{
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    char pool_path[TEST_PATH_SIZE];
+    test_temp_path(pool_path, "pool");
+    vlog_t *vlog = vlog_open(path);
+    page_pool_t *pool = page_pool_open(pool_path, 200);
+    const size_t value_size = 4096;
+    ASSERT_EQ(btree_allocate_with_flags(pool, 4, value_size, flags), NULL);
+    btree_t *btree = btree_allocate_separated(pool, vlog, 4, value_size, flags);
+    ASSERT(btree != NULL);
+    // One tree per log, or collecting one would drop the other's values.
+    ASSERT_EQ(btree_allocate_separated(pool, vlog, 4, value_size, flags), NULL);
+    char *value = (char*)malloc(value_size);
+    char *read = (char*)malloc(value_size);
+    int versions[300];
+    char key[4];
+
+    for (int round = 0; round < 3; round++) {
+        for (int k = 0; k < 300; k++) {
+            test_key(k, key);
+            memset(value, k + round, value_size);
+            btree_insert(btree, key, value);
+            versions[k] = round;
+        }
+    }
+    for (int k = 0; k < 300; k += 3) {
+        test_key(k, key);
+        ASSERT_EQ(btree_delete(btree, key), 0);
+        versions[k] = -1;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int k = 0; k < 300; k++) {
+            test_key(k, key);
+            if (versions[k] < 0) {
+                ASSERT_EQ(btree_search_value(btree, key, read), -1);
+                continue;
+            }
+            ASSERT_EQ(btree_search_value(btree, key, read), 0);
+            ASSERT_EQ(read[0], (char)(k + versions[k]));
+            ASSERT_EQ(read[value_size - 1], (char)(k + versions[k]));
+        }
+        // Collect in small pieces until everything before the head is gone.
+        uint64_t head = vlog->head;
+        while (vlog->tail < head)
+            ASSERT_EQ(btree_value_log_gc(btree, 10 * value_size), 0);
+        // The handles collection rewrote are on disk before the old records
+        // are gone.
+        for (size_t i = 0; i < pool->len; i++)
+            ASSERT_EQ(pool->meta[i].dirty, 0);
+        size_t live = 0;
+        for (int k = 0; k < 300; k++)
+            live += versions[k] >= 0;
+        ASSERT_EQ(vlog->head - vlog->tail, live * (4 + value_size));
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+    vlog_free(vlog);
+    unlink(path);
+    unlink(pool_path);
+    free(value);
+    free(read);
+    PASS();
+}
+
+
+TEST test_btree_separated__plain(void)
+{
+    // Values far too large for a leaf live in the log; garbage collection
+    // keeps the live ones readable and leaves only them behind.
+    return test_btree_separated(0);
+}
+
+
+TEST test_btree_separated__buffered(void)
+{
+    // Handles still in buffers count as live too.
+    return test_btree_separated(BTREE_BUFFERED);
+}
+
+
+TEST test_btree_insert_batch(int flags)
+{
+    page_pool_t *pool = page_pool_init(2000);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), flags);
+    const int range = 5000;
+    int reference[5000];
+    unsigned int state = 11;
+    char keys[500][4];
+    int values[500];
+    kvp_t pairs[500];
+    char key[4];
+    char *data;
+
+    for (int k = 0; k < range; k++)
+        reference[k] = -1;
+    // a few single inserts first, so batches overwrite as well as add
+    for (int k = 0; k < range; k += 7) {
+        test_key(k, key);
+        btree_insert(btree, key, (char*)&k);
+        reference[k] = k;
+    }
+    for (int batch = 0; batch < 20; batch++) {
+        // clustered around a random spot, with repeated keys inside the batch
+        int base = test_btree_rand(&state) % range;
+        for (int j = 0; j < 500; j++) {
+            int k = (base + test_btree_rand(&state) % 1000) % range;
+            test_key(k, keys[j]);
+            values[j] = batch * 1000 + j;
+            pairs[j].key = keys[j];
+            pairs[j].data = (char*)&values[j];
+            reference[k] = values[j];
+        }
+        btree_insert_batch(btree, pairs, 500);
+    }
+    ASSERT_EQ(btree_flush(btree), 0);
+
+    size_t live = 0;
+    for (int k = 0; k < range; k++) {
+        test_key(k, key);
+        btree_search(btree, key, &data);
+        if (reference[k] < 0) {
+            ASSERT_EQ(data, NULL);
+            continue;
+        }
+        ASSERT(data != NULL);
+        ASSERT_EQ(test_btree_data(data), reference[k]);
+        ASSERT_EQ(btree_rank(btree, key), live);
+        live++;
+    }
+    ASSERT_EQ(btree->num_keys, live);
+    int ok = 1;
+    ASSERT_EQ(test_btree_check_counts(btree, btree->root, &ok), live);
+    ASSERT(ok);
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+typedef struct {
+    btree_t *tree;
+    btree_lookups_t *lookups;
+    size_t completed;
+    size_t mismatches;
+    // Keys chained from callbacks, each submitting the next.
+    unsigned int next;
+    unsigned int last;
+    char key[4];
+} test_btree_lookups_state_t;
+
+static void test_btree_lookups_check(void *arg, char *key, char *data)
+{
+    test_btree_lookups_state_t *state = (test_btree_lookups_state_t*)arg;
+    char *expected;
+    btree_search(state->tree, key, &expected);
+    if ((data == NULL) != (expected == NULL) ||
+        (data != NULL && memcmp(data, expected, sizeof(int)) != 0))
+        state->mismatches++;
+    state->completed++;
+}
+
+static void test_btree_lookups_chain(void *arg, char *key, char *data)
+{
+    test_btree_lookups_state_t *state = (test_btree_lookups_state_t*)arg;
+    test_btree_lookups_check(arg, key, data);
+    if (state->next < state->last) {
+        // key may be state->key itself, so it is only rewritten here.
+        test_key(state->next++, state->key);
+        btree_lookup_submit(state->lookups, state->key, test_btree_lookups_chain, state);
+    }
+}
+
+
+TEST test_btree_deferred__bad_args(void)
+{
+    // Only in-memory, unbuffered trees defer splits, once at a time, and
+    // whole-tree operations wait until splits are no longer deferred.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    page_pool_t *file_pool = page_pool_open(path, 10);
+    page_pool_t *pool = page_pool_init(10);
+    btree_t *on_file = btree_allocate(file_pool, 4, sizeof(int));
+    btree_t *buffered = btree_allocate_with_flags(pool, 4, sizeof(int), BTREE_BUFFERED);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+
+    ASSERT_EQ(btree_deferred_start(on_file), -1);
+    ASSERT_EQ(btree_deferred_start(buffered), -1);
+    ASSERT_EQ(btree_deferred_stop(btree), -1);
+    ASSERT_EQ(btree_deferred_start(btree), 0);
+    ASSERT_EQ(btree_deferred_start(btree), -1);
+    ASSERT_EQ(btree_bloom_enable(btree, 100), -1);
+    ASSERT_EQ(btree_defrag(btree, 1.0), -1);
+    ASSERT_EQ(btree_freeze(btree, path), -1);
+    ASSERT_EQ(btree_deferred_stop(btree), 0);
+    ASSERT_EQ(btree->deferred, NULL);
+    ASSERT_EQ(btree_bloom_enable(btree, 100), 0);
+
+    btree_free(on_file);
+    btree_free(buffered);
+    btree_free(btree);
+    page_pool_free(file_pool);
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+/* Random inserts, batches and deletes on tree, checked against reference
+ * (the data for each of 4000 keys, or -1) as they go. */
+static int test_btree_deferred_run(btree_t *btree, int *reference, unsigned int state)
+{
+    const int range = 4000;
+    char keys[50][4];
+    int values[50];
+    kvp_t pairs[50];
+    char key[4];
+    int value;
+
+    for (int i = 0; i < 8000; i++) {
+        int k = test_btree_rand(&state) % range;
+        test_key(k, key);
+        if (i % 5 == 0) {
+            if (btree_delete(btree, key) != (reference[k] < 0 ? -1 : 0))
+                return 0;
+            reference[k] = -1;
+        } else if (i % 500 == 1) {
+            for (int j = 0; j < 50; j++) {
+                int b = (k + j * 3) % range;
+                test_key(b, keys[j]);
+                values[j] = i + j;
+                pairs[j].key = keys[j];
+                pairs[j].data = (char*)&values[j];
+                reference[b] = values[j];
+            }
+            btree_insert_batch(btree, pairs, 50);
+        } else {
+            btree_insert(btree, key, (char*)&i);
+            reference[k] = i;
+        }
+        test_key(test_btree_rand(&state) % range, key);
+        int found = btree_search_value(btree, key, (char*)&value) == 0;
+        int expected = reference[((unsigned char)key[2] << 8) | (unsigned char)key[3]];
+        if (found != (expected >= 0) || (found && value != expected))
+            return 0;
+    }
+
+    size_t live = 0;
+    for (int k = 0; k < range; k++) {
+        test_key(k, key);
+        int found = btree_search_value(btree, key, (char*)&value) == 0;
+        if (found != (reference[k] >= 0) || (found && value != reference[k]))
+            return 0;
+        if (found && btree_rank(btree, key) != live++)
+            return 0;
+    }
+    return btree->num_keys == live;
+}
+
+TEST test_btree_deferred__background(int flags)
+{
+    // With the maintenance thread making parent updates, inserts, deletes
+    // and searches behave as in any tree, and stopping leaves none pending.
+    page_pool_t *pool = page_pool_init(4000);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), flags);
+    int reference[4000];
+
+    for (int k = 0; k < 4000; k++)
+        reference[k] = -1;
+    ASSERT_EQ(btree_deferred_start(btree), 0);
+    ASSERT(test_btree_deferred_run(btree, reference, 17));
+    ASSERT(btree->deferred->deferred > 0);
+    ASSERT_EQ(btree_deferred_stop(btree), 0);
+    ASSERT_EQ(btree->root.node_type, NODE_TYPE_INTERNAL);
+    ASSERT(test_btree_deferred_run(btree, reference, 18));
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+TEST test_btree_deferred__background_plain(void)
+{
+    return test_btree_deferred__background(0);
+}
+
+TEST test_btree_deferred__background_learned(void)
+{
+    return test_btree_deferred__background(BTREE_LEARNED | BTREE_SWIZZLE);
+}
+
+
+TEST test_btree_deferred__ascending(void)
+{
+    // Ascending keys take the append fast path into leaves whose splits are
+    // still pending, and ranks, selects and range counts stay exact.
+    page_pool_t *pool = page_pool_init(4000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    char key[4], end[4];
+    char *found, *data;
+
+    ASSERT_EQ(btree_deferred_start(btree), 0);
+    for (unsigned int k = 0; k < 5000; k++) {
+        test_key(k, key);
+        btree_insert(btree, key, (char*)&k);
+        // Give the maintenance thread a chance to post splits in between.
+        if (k % 100 == 99)
+            usleep(100);
+    }
+    ASSERT(btree->deferred->deferred > 0);
+    test_key(2500, key);
+    ASSERT_EQ(btree_rank(btree, key), 2500);
+    ASSERT_EQ(btree_deferred_stop(btree), 0);
+
+    for (unsigned int k = 0; k < 5000; k++) {
+        test_key(k, key);
+        ASSERT_EQ(btree_rank(btree, key), k);
+        ASSERT_EQ(btree_select(btree, k, &found, &data), 0);
+        ASSERT_EQ(memcmp(found, key, 4), 0);
+        ASSERT_EQ(*(unsigned int*)data, k);
+    }
+    for (unsigned int k = 0; k < 5000; k += 37) {
+        test_key(k, key);
+        test_key(k + 1000, end);
+        ASSERT_EQ(btree_count_range(btree, key, end), k + 1000 <= 5000 ? 1000 : 5000 - k);
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_deferred__pending(void)
+{
+    // With the maintenance thread held off, leaves split without their
+    // parents knowing and are found through the pending splits, until every
+    // slot is taken and splits are made in full again.
+    page_pool_t *pool = page_pool_init(4000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    int reference[4000];
+    char key[4];
+    char *data;
+
+    for (int k = 0; k < 4000; k++)
+        reference[k] = -1;
+    ASSERT_EQ(btree_deferred_start(btree), 0);
+    pthread_mutex_lock(&btree->deferred->lock);
+    btree->deferred->failed = 1;
+    pthread_mutex_unlock(&btree->deferred->lock);
+    for (unsigned int i = 0; i < 3000; i++) {
+        test_key((i * 7919) % 3000, key);
+        btree_insert(btree, key, (char*)&i);
+        reference[(i * 7919) % 3000] = i;
+    }
+    ASSERT_EQ(btree->deferred->len, BTREE_DEFERRED_SPLITS);
+    ASSERT(btree->deferred->inline_splits > 0);
+    ASSERT_EQ(btree->deferred->posted, 0);
+    for (unsigned int i = 0; i < 3000; i++) {
+        test_key((i * 7919) % 3000, key);
+        btree_search(btree, key, &data);
+        ASSERT(data != NULL);
+        ASSERT_EQ(*(unsigned int*)data, i);
+    }
+    ASSERT_EQ(btree_rank(btree, key), (7919u * 2999) % 3000);
+    ASSERT_EQ(btree->deferred->len, 0);
+    ASSERT_EQ(btree->deferred->posted, BTREE_DEFERRED_SPLITS);
+
+    ASSERT(test_btree_deferred_run(btree, reference, 19));
+    ASSERT_EQ(btree_deferred_stop(btree), 0);
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_deferred__side_pages(void)
+{
+    // With the maintenance thread held off, full leaves overflow into side
+    // pages, where searches, overwrites and deletes find their keys, and
+    // posting the splits shares the keys out between the two halves.
+    page_pool_t *pool = page_pool_init(4000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    char key[4];
+    char *data;
+
+    ASSERT_EQ(btree_deferred_start(btree), 0);
+    pthread_mutex_lock(&btree->deferred->lock);
+    btree->deferred->failed = 1;
+    pthread_mutex_unlock(&btree->deferred->lock);
+    for (unsigned int i = 0; i < 600; i++) {
+        test_key((i * 7919) % 600, key);
+        btree_insert(btree, key, (char*)&i);
+    }
+    size_t sides = 0;
+    for (size_t slot = 0; slot < BTREE_DEFERRED_SPLITS; slot++)
+        sides += btree->deferred->left[slot] != PAGE_INDEX_NONE
+                 && btree->deferred->side[slot] != PAGE_INDEX_NONE;
+    ASSERT(sides > 0);
+    ASSERT_EQ(btree->deferred->inline_splits, 0);
+
+    for (unsigned int k = 0; k < 600; k++) {
+        test_key(k, key);
+        unsigned int value = k + 1000;
+        btree_insert(btree, key, (char*)&value);
+        if (k % 3 == 0)
+            ASSERT_EQ(btree_delete(btree, key), 0);
+    }
+    ASSERT_EQ(btree->num_keys, 400);
+    for (unsigned int k = 0; k < 600; k++) {
+        test_key(k, key);
+        btree_search(btree, key, &data);
+        if (k % 3 == 0) {
+            ASSERT_EQ(data, NULL);
+        } else {
+            ASSERT(data != NULL);
+            ASSERT_EQ(*(unsigned int*)data, k + 1000);
+        }
+    }
+
+    test_key(599, key);
+    ASSERT_EQ(btree_rank(btree, key), 399);
+    ASSERT_EQ(btree->deferred->len, 0);
+    for (size_t slot = 0; slot < BTREE_DEFERRED_SPLITS; slot++)
+        ASSERT_EQ(btree->deferred->left[slot], PAGE_INDEX_NONE);
+    ASSERT_EQ(btree_deferred_stop(btree), 0);
+    for (unsigned int k = 1; k < 600; k += 3) {
+        test_key(k, key);
+        ASSERT_EQ(btree_rank(btree, key), k - k / 3 - 1);
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_deferred__bloom(void)
+{
+    // A filter outgrown while splits are deferred is not rebuilt from a leaf
+    // chain missing the side pages, but once btree_deferred_stop posts them.
+    page_pool_t *pool = page_pool_init(4000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    char key[4];
+    int value;
+
+    ASSERT_EQ(btree_bloom_enable(btree, 10), 0);
+    ASSERT_EQ(btree_deferred_start(btree), 0);
+    pthread_mutex_lock(&btree->deferred->lock);
+    btree->deferred->failed = 1;
+    pthread_mutex_unlock(&btree->deferred->lock);
+    for (unsigned int i = 0; i < 600; i++) {
+        test_key((i * 7919) % 600, key);
+        btree_insert(btree, key, (char*)&i);
+    }
+    ASSERT_EQ(btree->bloom_capacity, 10);
+    for (unsigned int i = 0; i < 600; i++) {
+        test_key((i * 7919) % 600, key);
+        ASSERT_EQ(btree_search_value(btree, key, (char*)&value), 0);
+        ASSERT_EQ(value, i);
+    }
+
+    ASSERT_EQ(btree_deferred_stop(btree), 0);
+    ASSERT_EQ(btree->bloom_capacity, 600);
+    for (unsigned int i = 0; i < 600; i++) {
+        test_key((i * 7919) % 600, key);
+        ASSERT_EQ(btree_search_value(btree, key, (char*)&value), 0);
+        ASSERT_EQ(value, i);
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_lookups__in_memory(void)
+{
+    // With every page resident, lookups finish inside submit.
+    page_pool_t *pool = page_pool_init(1000);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), BTREE_BUFFERED);
+    btree_lookups_t *lookups = btree_lookups_init(btree, 4);
+    test_btree_lookups_state_t state = {btree, lookups, 0, 0, 0, 0};
+    char keys[3000][4];
+
+    for (int k = 0; k < 2000; k++) {
+        test_key(k, keys[k]);
+        btree_insert(btree, keys[k], (char*)&k);
+    }
+    for (int k = 0; k < 3000; k++) {
+        test_key(k, keys[k]);
+        ASSERT_EQ(btree_lookup_submit(lookups, keys[k], test_btree_lookups_check, &state), 0);
+        ASSERT_EQ(lookups->len, 0);
+    }
+    ASSERT_EQ(state.completed, 3000);
+    ASSERT_EQ(state.mismatches, 0);
+    ASSERT_EQ(btree_lookups_poll(lookups), 0);
+
+    btree_lookups_free(lookups);
+    btree_free(btree);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_lookups__overlapped_reads(void)
+{
+    // Lookups over an evicted file-backed tree suspend on their reads, keep
+    // several in flight at once, and still all answer correctly.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    page_pool_t *pool = page_pool_open(path, 1000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    btree_lookups_t *lookups = btree_lookups_init(btree, 16);
+    test_btree_lookups_state_t state = {btree, lookups, 0, 0, 0, 0};
+    char keys[16][4];
+
+    for (int k = 0; k < 3000; k += 2) {
+        test_key(k, keys[0]);
+        btree_insert(btree, keys[0], (char*)&k);
+    }
+    ASSERT_EQ(page_pool_sync(pool), 0);
+    for (size_t i = 0; i < pool->len; i++)
+        ASSERT_EQ(page_pool_evict(pool, i), 0);
+    for (int i = 0; i < 16; i++) {
+        // Far enough apart that no two share a leaf.
+        test_key(i * 187, keys[i]);
+        ASSERT_EQ(btree_lookup_submit(lookups, keys[i], test_btree_lookups_check, &state), 0);
+    }
+    ASSERT(lookups->len > 0);
+    ASSERT_EQ(btree_lookup_submit(lookups, keys[0], test_btree_lookups_check, &state), -1);
+    // Lookups wait on their leaves together, so they finish in batches.
+    size_t most_per_poll = 0;
+    while (lookups->len > 0) {
+        size_t completed = btree_lookups_poll(lookups);
+        ASSERT(completed > 0);
+        if (completed > most_per_poll)
+            most_per_poll = completed;
+    }
+    ASSERT_EQ(state.completed, 16);
+    ASSERT_EQ(state.mismatches, 0);
+    ASSERT(most_per_poll > 1);
+
+    // Callbacks may keep the queue full by submitting more lookups.
+    for (size_t i = 0; i < pool->len; i++)
+        ASSERT_EQ(page_pool_evict(pool, i), 0);
+    state.completed = 0;
+    state.next = 1000;
+    state.last = 1400;
+    test_key(999, state.key);
+    ASSERT_EQ(btree_lookup_submit(lookups, state.key, test_btree_lookups_chain, &state), 0);
+    btree_lookups_drain(lookups);
+    ASSERT_EQ(state.completed, 401);
+    ASSERT_EQ(state.mismatches, 0);
+
+    btree_lookups_free(lookups);
+    btree_free(btree);
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+TEST test_btree_insert_batch__plain(void)
+{
+    // Batches land the same as inserting the pairs one at a time, with the
+    // last pair winning for a repeated key.
+    return test_btree_insert_batch(0);
+}
+
+
+TEST test_btree_insert_batch__learned(void)
+{
+    // The same with leaf models kept up to date as keys are added.
+    return test_btree_insert_batch(BTREE_LEARNED);
+}
+
+
+TEST test_btree_insert_batch__buffered(void)
+{
+    // Buffered trees take batches through their buffers.
+    return test_btree_insert_batch(BTREE_BUFFERED);
+}
+
+
+TEST test_btree_insert_batch__separated(void)
+{
+    // Values in a batch for a separated tree go to the value log.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    vlog_t *vlog = vlog_open(path);
+    page_pool_t *pool = page_pool_init(100);
+    btree_t *btree = btree_allocate_separated(pool, vlog, 4, 1000, 0);
+    char keys[100][4];
+    char values[100][1000];
+    char read[1000];
+    kvp_t pairs[100];
+
+    for (int i = 0; i < 100; i++) {
+        test_key(99 - i, keys[i]);
+        memset(values[i], i, sizeof(values[i]));
+        pairs[i].key = keys[i];
+        pairs[i].data = values[i];
+    }
+    btree_insert_batch(btree, pairs, 100);
+    ASSERT_EQ(btree->num_keys, 100);
+    ASSERT_EQ(vlog->head, VLOG_BLOCK_SIZE + 100 * 1004);
+    for (int i = 0; i < 100; i++) {
+        ASSERT_EQ(btree_search_value(btree, keys[i], read), 0);
+        ASSERT_EQ(read[999], i);
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+    vlog_free(vlog);
+    unlink(path);
+
+    PASS();
+}
+
+
+TEST test_btree_swizzle__matches_plain(void)
+{
+    // A swizzled tree answers searches and order statistics like a plain one.
+    page_pool_t *pool = page_pool_init(4000);
+    btree_t *plain = btree_allocate(pool, 4, sizeof(int));
+    btree_t *swizzled = btree_allocate_with_flags(pool, 4, sizeof(int), BTREE_SWIZZLE);
+    unsigned int state = 13;
+    char key[4];
+    char *data, *other, *found_key;
+
+    ASSERT(swizzled->internal_capacity < plain->internal_capacity);
+    for (int i = 0; i < 6000; i++) {
+        int k = test_btree_rand(&state) % 3000;
+        test_key(k, key);
+        if (i % 4 == 0) {
+            ASSERT_EQ(btree_delete(swizzled, key), btree_delete(plain, key));
+        } else {
+            btree_insert(plain, key, (char*)&i);
+            btree_insert(swizzled, key, (char*)&i);
+        }
+    }
+    ASSERT_EQ(swizzled->num_keys, plain->num_keys);
+    for (int k = 0; k < 3000; k++) {
+        test_key(k, key);
+        btree_search(plain, key, &data);
+        btree_search(swizzled, key, &other);
+        ASSERT_EQ(data == NULL, other == NULL);
+        if (data != NULL)
+            ASSERT_EQ(*(int*)other, *(int*)data);
+        ASSERT_EQ(btree_rank(swizzled, key), btree_rank(plain, key));
+    }
+    for (size_t rank = 0; rank < swizzled->num_keys; rank += 7) {
+        ASSERT_EQ(btree_select(swizzled, rank, &found_key, &data), 0);
+        ASSERT_EQ(btree_rank(plain, found_key), rank);
+    }
+
+    btree_free(plain);
+    btree_free(swizzled);
+    page_pool_free(pool);
+
+    PASS();
+}
+
+
+TEST test_btree_swizzle__eviction(void)
+{
+    // Descents reuse the child pointers they cached until a page is evicted,
+    // after which the pointers are dropped rather than followed, as are any
+    // in a page read back from the file.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "pool");
+    page_pool_t *pool = page_pool_open(path, 1000);
+    btree_t *btree = btree_allocate_with_flags(pool, 4, sizeof(int), BTREE_SWIZZLE);
+    char key[4];
+    char *data;
+
+    for (int k = 0; k < 2000; k++) {
+        test_key(k, key);
+        btree_insert(btree, key, (char*)&k);
+    }
+    ASSERT_EQ(btree->root.node_type, NODE_TYPE_INTERNAL);
+    test_key(1000, key);
+    btree_search(btree, key, &data);
+    internal_node_t *root = (internal_node_t*)page_pool_get_page(pool, btree->root.index)->data;
+    page_t **cached = (page_t**)((char*)root + btree->swizzle_offset + sizeof(size_t));
+    size_t slot = 0;
+    while (slot < root->header.num_keys && cached[slot] == NULL)
+        slot++;
+    ASSERT(cached[slot] != NULL);
+    ASSERT_EQ(cached[slot], pool->pages[root->children[slot].index]);
+
+    for (int round = 0; round < 2; round++) {
+        ASSERT_EQ(page_pool_sync(pool), 0);
+        for (size_t i = 0; i < pool->len; i++)
+            ASSERT_EQ(page_pool_evict(pool, i), 0);
+        for (int k = 0; k < 2000; k++) {
+            test_key(k, key);
+            btree_search(btree, key, &data);
+            ASSERT(data != NULL);
+            ASSERT_EQ(*(int*)data, k);
+        }
+    }
+
+    // Pointers read back from the file are never followed, even when the
+    // page claims they were cached at the pool's current epoch.
+    char forged[PAGE_SIZE];
+    ASSERT_EQ(page_pool_evict(pool, btree->root.index), 0);
+    ASSERT_EQ(pread(pool->fd, forged, PAGE_SIZE, btree->root.index * PAGE_SIZE), PAGE_SIZE);
+    root = (internal_node_t*)forged;
+    memcpy(forged + btree->swizzle_offset, &pool->epoch, sizeof(size_t));
+    cached = (page_t**)(forged + btree->swizzle_offset + sizeof(size_t));
+    for (slot = 0; slot <= root->header.num_keys; slot++)
+        cached[slot] = (page_t*)forged;
+    ASSERT_EQ(pwrite(pool->fd, forged, PAGE_SIZE, btree->root.index * PAGE_SIZE), PAGE_SIZE);
+    for (int k = 0; k < 2000; k++) {
+        test_key(k, key);
+        btree_search(btree, key, &data);
+        ASSERT(data != NULL);
+        ASSERT_EQ(*(int*)data, k);
+    }
+
+    btree_free(btree);
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
 GREATEST_SUITE(btree_suite)
 {
     test_btree_environ_t environ;
@@ -375,4 +2496,67 @@ GREATEST_SUITE(btree_suite)
     BTREE_RUN_TEST(test_btree_allocate__data_size_0);
     BTREE_RUN_TEST(test_btree_allocate__null_pool);
     BTREE_RUN_TEST(test_btree_allocate__twice_on_same_pool);
+    BTREE_RUN_TEST(test_btree_allocate__too_large);
+
+    BTREE_RUN_TEST(test_btree_search__empty);
+    BTREE_RUN_TEST(test_btree_insert__single);
+    BTREE_RUN_TEST(test_btree_insert__overwrite);
+    RUN_TEST(test_btree_insert__many);
+    RUN_TEST(test_btree_insert__leaves_linked);
+
+    RUN_TEST(test_btree_delete__normal);
+    BTREE_RUN_TEST(test_btree_delete__missing);
+
+    RUN_TEST(test_btree_bloom__search);
+    RUN_TEST(test_btree_bloom__delete);
+    RUN_TEST(test_btree_bloom__no_page_reads);
+    RUN_TEST(test_btree_bloom__leaf_readahead);
+
+    RUN_TEST(test_btree_append__packs_leaves);
+    RUN_TEST(test_btree_append__mixed_with_random);
+
+    BTREE_RUN_TEST(test_btree_search_view__normal);
+    BTREE_RUN_TEST(test_btree_search_view__missing);
+    BTREE_RUN_TEST(test_btree_search_view__invalidated);
+    RUN_TEST(test_btree_search_view__pinned_not_evicted);
+
+    RUN_TEST(test_btree_order_statistics__plain);
+    RUN_TEST(test_btree_order_statistics__buffered);
+    BTREE_RUN_TEST(test_btree_order_statistics__empty);
+
+    RUN_TEST(test_btree_swizzle__matches_plain);
+    RUN_TEST(test_btree_swizzle__eviction);
+
+    RUN_TEST(test_btree_deferred__bad_args);
+    RUN_TEST(test_btree_deferred__background_plain);
+    RUN_TEST(test_btree_deferred__background_learned);
+    RUN_TEST(test_btree_deferred__ascending);
+    RUN_TEST(test_btree_deferred__pending);
+    RUN_TEST(test_btree_deferred__side_pages);
+    RUN_TEST(test_btree_deferred__bloom);
+
+    RUN_TEST(test_btree_lookups__in_memory);
+    RUN_TEST(test_btree_lookups__overlapped_reads);
+
+    RUN_TEST(test_btree_insert_batch__plain);
+    RUN_TEST(test_btree_insert_batch__learned);
+    RUN_TEST(test_btree_insert_batch__buffered);
+    RUN_TEST(test_btree_insert_batch__separated);
+
+    RUN_TEST(test_btree_separated__plain);
+    RUN_TEST(test_btree_separated__buffered);
+
+    RUN_TEST(test_btree_defrag__orders_leaves);
+    RUN_TEST(test_btree_defrag__refill);
+    RUN_TEST(test_btree_defrag__incremental);
+    BTREE_RUN_TEST(test_btree_defrag__pinned);
+
+    BTREE_RUN_TEST(test_btree_learned__allocate);
+    RUN_TEST(test_btree_learned__dense_keys);
+    RUN_TEST(test_btree_learned__matches_reference);
+
+    BTREE_RUN_TEST(test_btree_buffered__allocate);
+    RUN_TEST(test_btree_buffered__matches_reference);
+    RUN_TEST(test_btree_buffered__defers_leaf_writes);
+    RUN_TEST(test_btree_buffered__bloom);
 }
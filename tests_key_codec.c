@@ -0,0 +1,186 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "greatest.h"
+
+#include "key_codec.h"
+
+
+/* key_codec tests */
+
+#define TEST_KEY_SIZE 32
+
+/* A row of the (int32, descending double, string, uint16) schema the
+ * ordering tests use. */
+typedef struct {
+    int32_t a;
+    double b;
+    char c[8];
+    size_t c_len;
+    uint16_t d;
+} test_key_row_t;
+
+
+static int test_key_encode(test_key_row_t *row, char key[TEST_KEY_SIZE])
+{
+    key_encoder_t enc;
+    key_encoder_init(&enc, key, TEST_KEY_SIZE);
+    key_encode_int(&enc, row->a, 4, 0);
+    key_encode_double(&enc, row->b, KEY_DESCENDING);
+    key_encode_string(&enc, row->c, row->c_len, 0);
+    key_encode_uint(&enc, row->d, 2, 0);
+    return key_encoder_finish(&enc);
+}
+
+
+/* The order the encoding has to reproduce. */
+static int test_key_compare(test_key_row_t *x, test_key_row_t *y)
+{
+    if (x->a != y->a)
+        return x->a < y->a ? -1 : 1;
+    if (x->b != y->b)
+        return x->b > y->b ? -1 : 1;
+    size_t len = x->c_len < y->c_len ? x->c_len : y->c_len;
+    int cmp = memcmp(x->c, y->c, len);
+    if (cmp != 0)
+        return cmp < 0 ? -1 : 1;
+    if (x->c_len != y->c_len)
+        return x->c_len < y->c_len ? -1 : 1;
+    if (x->d != y->d)
+        return x->d < y->d ? -1 : 1;
+    return 0;
+}
+
+
+static void test_key_random_row(unsigned int *state, test_key_row_t *row)
+{
+    // Small value ranges so that ties on the leading columns are common.
+    static const int32_t ints[] = {INT32_MIN, -70000, -1, 0, 1, 255, 256, INT32_MAX};
+    static const double doubles[] = {-INFINITY, -1e300, -2.5, -0.0, 0.0, 1e-300, 3.0, INFINITY};
+    *state = *state * 1103515245 + 12345;
+    row->a = ints[(*state >> 16) % 8];
+    *state = *state * 1103515245 + 12345;
+    row->b = doubles[(*state >> 16) % 8];
+    *state = *state * 1103515245 + 12345;
+    row->c_len = (*state >> 16) % 4;
+    for (size_t i = 0; i < row->c_len; i++) {
+        *state = *state * 1103515245 + 12345;
+        // 0x00 and 0xff are the bytes that need care
+        row->c[i] = "\x00\x01\xff" "a"[(*state >> 16) % 4];
+    }
+    *state = *state * 1103515245 + 12345;
+    row->d = (*state >> 16) % 3 == 0 ? 65535 : (*state >> 16) % 3;
+}
+
+
+TEST test_key_codec__order()
+{
+    // memcmp on encoded rows agrees with comparing the rows column by column.
+    unsigned int state = 1;
+    for (int i = 0; i < 20000; i++) {
+        test_key_row_t x, y;
+        char x_key[TEST_KEY_SIZE], y_key[TEST_KEY_SIZE];
+        test_key_random_row(&state, &x);
+        test_key_random_row(&state, &y);
+        ASSERT_EQ(test_key_encode(&x, x_key), 0);
+        ASSERT_EQ(test_key_encode(&y, y_key), 0);
+        int expected = test_key_compare(&x, &y);
+        int actual = memcmp(x_key, y_key, TEST_KEY_SIZE);
+        actual = (actual > 0) - (actual < 0);
+        ASSERT_EQ(actual, expected);
+    }
+    PASS();
+}
+
+
+TEST test_key_codec__round_trip()
+{
+    // Every column decodes back to the value it was encoded from.
+    char key[TEST_KEY_SIZE];
+    key_encoder_t enc;
+    key_encoder_init(&enc, key, TEST_KEY_SIZE);
+    key_encode_int(&enc, -5, 1, KEY_DESCENDING);
+    key_encode_int(&enc, INT64_MIN, 8, 0);
+    key_encode_uint(&enc, 0xabcdef, 3, 0);
+    key_encode_float(&enc, -1.5f, 0);
+    key_encode_double(&enc, 1e100, KEY_DESCENDING);
+    key_encode_string(&enc, "a\0b", 3, KEY_DESCENDING);
+    ASSERT_EQ(key_encoder_finish(&enc), 0);
+
+    key_decoder_t dec;
+    char string[8];
+    key_decoder_init(&dec, key, TEST_KEY_SIZE);
+    ASSERT_EQ(key_decode_int(&dec, 1, KEY_DESCENDING), -5);
+    ASSERT_EQ(key_decode_int(&dec, 8, 0), INT64_MIN);
+    ASSERT_EQ(key_decode_uint(&dec, 3, 0), 0xabcdef);
+    ASSERT_EQ(key_decode_float(&dec, 0), -1.5f);
+    ASSERT_EQ(key_decode_double(&dec, KEY_DESCENDING), 1e100);
+    ASSERT_EQ(key_decode_string(&dec, string, sizeof(string), KEY_DESCENDING), 3);
+    ASSERT_EQ(memcmp(string, "a\0b", 3), 0);
+    ASSERT_EQ(dec.error, 0);
+    PASS();
+}
+
+
+TEST test_key_codec__too_long()
+{
+    // Keys that do not fit are refused instead of silently cut short, and
+    // decoding past the end of a key is an error.
+    char key[4];
+    key_encoder_t enc;
+    key_encoder_init(&enc, key, sizeof(key));
+    key_encode_uint(&enc, 1, 2, 0);
+    key_encode_string(&enc, "ab", 2, 0);
+    ASSERT_EQ(enc.error, 1);
+    ASSERT_EQ(key_encoder_finish(&enc), -1);
+
+    key_decoder_t dec;
+    key_decoder_init(&dec, "\x01\x02", 2);
+    key_decode_uint(&dec, 4, 0);
+    ASSERT_EQ(dec.error, 1);
+    PASS();
+}
+
+
+TEST test_key_codec__out_of_range()
+{
+    // Integers too large for their width are refused instead of losing
+    // their high bytes, while the extremes that fit encode.
+    char key[TEST_KEY_SIZE];
+    key_encoder_t enc;
+    key_encoder_init(&enc, key, TEST_KEY_SIZE);
+    key_encode_uint(&enc, 256, 1, 0);
+    ASSERT_EQ(enc.error, 1);
+    ASSERT_EQ(key_encoder_finish(&enc), -1);
+    key_encoder_init(&enc, key, TEST_KEY_SIZE);
+    key_encode_int(&enc, 128, 1, 0);
+    ASSERT_EQ(enc.error, 1);
+    key_encoder_init(&enc, key, TEST_KEY_SIZE);
+    key_encode_int(&enc, -32769, 2, KEY_DESCENDING);
+    ASSERT_EQ(enc.error, 1);
+
+    key_encoder_init(&enc, key, TEST_KEY_SIZE);
+    key_encode_uint(&enc, 255, 1, 0);
+    key_encode_int(&enc, -128, 1, 0);
+    key_encode_int(&enc, 32767, 2, 0);
+    key_encode_uint(&enc, UINT64_MAX, 8, 0);
+    ASSERT_EQ(key_encoder_finish(&enc), 0);
+    key_decoder_t dec;
+    key_decoder_init(&dec, key, TEST_KEY_SIZE);
+    ASSERT_EQ(key_decode_uint(&dec, 1, 0), 255);
+    ASSERT_EQ(key_decode_int(&dec, 1, 0), -128);
+    ASSERT_EQ(key_decode_int(&dec, 2, 0), 32767);
+    ASSERT_EQ(key_decode_uint(&dec, 8, 0), UINT64_MAX);
+    ASSERT_EQ(dec.error, 0);
+    PASS();
+}
+
+
+GREATEST_SUITE(key_codec_suite)
+{
+    RUN_TEST(test_key_codec__order);
+    RUN_TEST(test_key_codec__round_trip);
+    RUN_TEST(test_key_codec__too_long);
+    RUN_TEST(test_key_codec__out_of_range);
+}
@@ -0,0 +1,155 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "greatest.h"
+
+#include "page_io.h"
+
+
+/* page_io tests */
+
+#define TEST_PAGE_IO_PAGES 16
+
+typedef struct {
+    char path[64];
+    int fd;
+} test_page_io_environ_t;
+
+
+void test_page_io_setup(test_page_io_environ_t *environ)
+{
+    // A file of TEST_PAGE_IO_PAGES pages, each filled with its own index.
+    strcpy(environ->path, "/tmp/cql_io_XXXXXX");
+    environ->fd = mkstemp(environ->path);
+    page_t page;
+    for (int i = 0; i < TEST_PAGE_IO_PAGES; i++) {
+        memset(page.data, i, PAGE_SIZE);
+        pwrite(environ->fd, page.data, PAGE_SIZE, i * PAGE_SIZE);
+    }
+}
+
+
+void test_page_io_teardown(test_page_io_environ_t *environ)
+{
+    close(environ->fd);
+    unlink(environ->path);
+}
+
+
+TEST test_page_io_read_all(int fd, page_io_backend_t backend)
+{
+    page_io_t *io = page_io_init(fd, TEST_PAGE_IO_PAGES, backend);
+    ASSERT(io != NULL);
+    ASSERT_EQ(page_io_backend(io), backend);
+
+    page_t pages[TEST_PAGE_IO_PAGES];
+    memset(pages, 0xff, sizeof(pages));
+    for (size_t i = 0; i < TEST_PAGE_IO_PAGES; i++)
+        ASSERT_EQ(page_io_submit_read(io, &pages[i], i), 0);
+    ASSERT_EQ(page_io_in_flight(io), TEST_PAGE_IO_PAGES);
+    ASSERT_EQ(page_io_flush(io), 0);
+
+    // completions may arrive in any order, but each exactly once
+    int seen[TEST_PAGE_IO_PAGES] = {0};
+    for (size_t i = 0; i < TEST_PAGE_IO_PAGES; i++) {
+        size_t index = 1337;
+        ASSERT_EQ(page_io_wait(io, &index), 0);
+        ASSERT(index < TEST_PAGE_IO_PAGES);
+        ASSERT_EQ(seen[index], 0);
+        seen[index] = 1;
+    }
+    ASSERT_EQ(page_io_in_flight(io), 0);
+    ASSERT_EQ(page_io_ready(io), 0);
+
+    for (int i = 0; i < TEST_PAGE_IO_PAGES; i++) {
+        ASSERT_EQ(pages[i].data[0], i);
+        ASSERT_EQ(pages[i].data[PAGE_SIZE - 1], i);
+    }
+
+    page_io_free(io);
+
+    PASS();
+}
+
+
+TEST test_page_io_read__uring(test_page_io_environ_t *environ)
+{
+    // Many reads in flight at once through io_uring.
+    page_io_t *io = page_io_init(environ->fd, 1, PAGE_IO_AUTO);
+    int have_uring = page_io_backend(io) == PAGE_IO_URING;
+    page_io_free(io);
+    if (!have_uring)
+        SKIPm("io_uring is not available");
+
+    return test_page_io_read_all(environ->fd, PAGE_IO_URING);
+}
+
+
+TEST test_page_io_read__threads(test_page_io_environ_t *environ)
+{
+    // Many reads in flight at once through the thread pool fallback.
+    return test_page_io_read_all(environ->fd, PAGE_IO_THREADS);
+}
+
+
+TEST test_page_io_submit__queue_full(test_page_io_environ_t *environ)
+{
+    // No more than depth reads may be in flight.
+    page_io_t *io = page_io_init(environ->fd, 2, PAGE_IO_AUTO);
+    page_t pages[3];
+
+    ASSERT_EQ(page_io_submit_read(io, &pages[0], 0), 0);
+    ASSERT_EQ(page_io_submit_read(io, &pages[1], 1), 0);
+    ASSERT_EQ(page_io_submit_read(io, &pages[2], 2), -1);
+    ASSERT_EQ(page_io_in_flight(io), 2);
+
+    page_io_free(io);
+
+    PASS();
+}
+
+
+TEST test_page_io_wait__past_end_of_file(test_page_io_environ_t *environ)
+{
+    // Reading a page that is not in the file is an error.
+    page_io_t *io = page_io_init(environ->fd, 1, PAGE_IO_AUTO);
+    page_t page;
+    size_t index;
+
+    ASSERT_EQ(page_io_submit_read(io, &page, TEST_PAGE_IO_PAGES), 0);
+    ASSERT_EQ(page_io_wait(io, &index), -1);
+    ASSERT_EQ(index, TEST_PAGE_IO_PAGES);
+
+    page_io_free(io);
+
+    PASS();
+}
+
+
+TEST test_page_io_init__depth_0(test_page_io_environ_t *environ)
+{
+    // Do not allow a depth of 0.
+    page_io_t *io = page_io_init(environ->fd, 0, PAGE_IO_AUTO);
+    ASSERT_EQ(io, NULL);
+
+    PASS();
+}
+
+
+GREATEST_SUITE(page_io_suite)
+{
+    test_page_io_environ_t environ;
+
+    SET_SETUP((greatest_setup_cb *)test_page_io_setup, &environ);
+    SET_TEARDOWN((greatest_setup_cb *)test_page_io_teardown, &environ);
+
+    #define PAGE_IO_RUN_TEST(NAME) RUN_TEST1(NAME, (test_page_io_environ_t*)&environ)
+
+    PAGE_IO_RUN_TEST(test_page_io_read__uring);
+    PAGE_IO_RUN_TEST(test_page_io_read__threads);
+    PAGE_IO_RUN_TEST(test_page_io_submit__queue_full);
+    PAGE_IO_RUN_TEST(test_page_io_wait__past_end_of_file);
+    PAGE_IO_RUN_TEST(test_page_io_init__depth_0);
+}
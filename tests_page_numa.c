@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "greatest.h"
+
+#include "page_numa.h"
+#include "tests_util.h"
+
+
+/* page_numa tests */
+
+TEST test_page_numa_pool__single_node()
+{
+    // With one node every page is placed on it, whatever the policy.
+    page_pool_t *pool = page_pool_init(600);
+    ASSERT_EQ(page_pool_set_numa_policy(pool, PAGE_POOL_NUMA_INTERLEAVE), 0);
+    pool->numa->num_nodes = 1;
+
+    size_t index;
+    for (int i = 0; i < 600; i++) {
+        page_t *page = page_pool_create_page(pool, &index);
+        ASSERT(page != NULL);
+        ASSERT_EQ(index, i);
+    }
+    ASSERT_EQ(page_pool_numa_nodes(pool), 1);
+    ASSERT_EQ(page_pool_numa_pages(pool, 0), 600);
+    ASSERT_EQ(page_pool_numa_pages(pool, 1), 0);
+
+    page_pool_free(pool);
+    PASS();
+}
+
+
+TEST test_page_numa_pool__pages_distinct_and_zeroed()
+{
+    // Slab pages never overlap and start out zeroed, like calloc'd ones.
+    page_pool_t *pool = page_pool_init(600);
+    ASSERT_EQ(page_pool_set_numa_policy(pool, PAGE_POOL_NUMA_LOCAL), 0);
+
+    size_t index;
+    for (int i = 0; i < 600; i++) {
+        page_t *page = page_pool_create_page(pool, &index);
+        for (int j = 0; j < PAGE_SIZE; j++)
+            ASSERT_EQ(page->data[j], 0);
+        memset(page->data, i % 100, PAGE_SIZE);
+    }
+    for (int i = 0; i < 600; i++) {
+        page_t *page = page_pool_get_page(pool, i);
+        ASSERT_EQ(page->data[0], i % 100);
+        ASSERT_EQ(page->data[PAGE_SIZE - 1], i % 100);
+    }
+
+    page_pool_free(pool);
+    PASS();
+}
+
+
+TEST test_page_numa_pool__policy()
+{
+    // Interleaved pages alternate between nodes, partitioned ones are split
+    // into one range per node.
+    page_pool_t *pool = page_pool_init(8);
+    ASSERT_EQ(page_pool_set_numa_policy(pool, PAGE_POOL_NUMA_INTERLEAVE), 0);
+    pool->numa->num_nodes = 2;
+
+    size_t index;
+    for (int i = 0; i < 3; i++)
+        page_pool_create_page(pool, &index);
+    ASSERT_EQ(pool->meta[0].node, 0);
+    ASSERT_EQ(pool->meta[1].node, 1);
+    ASSERT_EQ(pool->meta[2].node, 0);
+    ASSERT_EQ(page_pool_numa_pages(pool, 0), 2);
+    ASSERT_EQ(page_pool_numa_pages(pool, 1), 1);
+
+    // Too late to change the policy once pages exist.
+    ASSERT_EQ(page_pool_set_numa_policy(pool, PAGE_POOL_NUMA_PARTITIONED), -1);
+    page_pool_free(pool);
+
+    pool = page_pool_init(8);
+    ASSERT_EQ(page_pool_set_numa_policy(pool, PAGE_POOL_NUMA_PARTITIONED), 0);
+    pool->numa->num_nodes = 2;
+    for (int i = 0; i < 8; i++) {
+        page_pool_create_page(pool, &index);
+        ASSERT_EQ(pool->meta[i].node, i < 4 ? 0 : 1);
+    }
+    ASSERT_EQ(page_pool_numa_pages(pool, 0), 4);
+    ASSERT_EQ(page_pool_numa_pages(pool, 1), 4);
+
+    page_pool_free(pool);
+    PASS();
+}
+
+
+TEST test_page_numa_pool__evict_reuses_pages()
+{
+    // Evicted pages go back to their node and are reused, zeroed, for reads.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "numa");
+    page_pool_t *pool = page_pool_open(path, 4);
+    ASSERT(pool != NULL);
+    ASSERT_EQ(page_pool_set_numa_policy(pool, PAGE_POOL_NUMA_LOCAL), 0);
+
+    size_t index;
+    page_t *page = page_pool_create_page(pool, &index);
+    memset(page->data, 7, PAGE_SIZE);
+    ASSERT_EQ(page_pool_evict(pool, index), 0);
+    ASSERT_EQ(page_pool_numa_pages(pool, 0), 0);
+
+    page_t *other = page_pool_create_page(pool, &index);
+    ASSERT_EQ(other, page);
+    ASSERT_EQ(other->data[PAGE_SIZE - 1], 0);
+
+    page = page_pool_get_page(pool, 0);
+    ASSERT(page != NULL);
+    ASSERT_EQ(page->data[0], 7);
+    ASSERT_EQ(page->data[PAGE_SIZE - 1], 7);
+    ASSERT_EQ(page_pool_numa_pages(pool, 0), 2);
+
+    page_pool_free(pool);
+    unlink(path);
+    PASS();
+}
+
+
+TEST test_page_numa_detect_nodes()
+{
+    // Always at least the one node, even without /sys.
+    size_t node_ids[PAGE_NUMA_MAX_NODES];
+    size_t nodes = page_numa_detect_nodes(node_ids);
+    ASSERT(nodes >= 1);
+    ASSERT(nodes <= PAGE_NUMA_MAX_NODES);
+    for (size_t i = 1; i < nodes; i++)
+        ASSERT(node_ids[i] > node_ids[i - 1]);
+    PASS();
+}
+
+
+TEST test_page_numa_parse_nodes()
+{
+    // Sparse lists name only the nodes that are online, and IDs past the
+    // mbind() mask are left out.
+    size_t node_ids[PAGE_NUMA_MAX_NODES];
+    ASSERT_EQ(page_numa_parse_nodes("0,2\n", node_ids), 2);
+    ASSERT_EQ(node_ids[0], 0);
+    ASSERT_EQ(node_ids[1], 2);
+
+    ASSERT_EQ(page_numa_parse_nodes("1-2,5\n", node_ids), 3);
+    ASSERT_EQ(node_ids[0], 1);
+    ASSERT_EQ(node_ids[1], 2);
+    ASSERT_EQ(node_ids[2], 5);
+
+    ASSERT_EQ(page_numa_parse_nodes("0,62-70\n", node_ids), 3);
+    ASSERT_EQ(node_ids[2], 63);
+    ASSERT_EQ(page_numa_parse_nodes("\n", node_ids), 0);
+    PASS();
+}
+
+
+TEST test_page_numa_pool__sparse_nodes()
+{
+    // With nodes 0 and 2 online, pages spread over two nodes, not three.
+    size_t node_ids[2] = {0, 2};
+    page_pool_t *pool = page_pool_init(4);
+    pool->numa = page_numa_init(PAGE_POOL_NUMA_INTERLEAVE, node_ids, 2);
+    ASSERT(pool->numa != NULL);
+
+    size_t index;
+    for (int i = 0; i < 4; i++)
+        ASSERT(page_pool_create_page(pool, &index) != NULL);
+    ASSERT_EQ(page_pool_numa_nodes(pool), 2);
+    ASSERT_EQ(page_pool_numa_pages(pool, 0), 2);
+    ASSERT_EQ(page_pool_numa_pages(pool, 1), 2);
+    ASSERT_EQ(page_pool_numa_pages(pool, 2), 0);
+
+    page_pool_free(pool);
+    PASS();
+}
+
+
+GREATEST_SUITE(page_numa_suite)
+{
+    RUN_TEST(test_page_numa_pool__single_node);
+    RUN_TEST(test_page_numa_pool__pages_distinct_and_zeroed);
+    RUN_TEST(test_page_numa_pool__policy);
+    RUN_TEST(test_page_numa_pool__evict_reuses_pages);
+    RUN_TEST(test_page_numa_pool__sparse_nodes);
+    RUN_TEST(test_page_numa_detect_nodes);
+    RUN_TEST(test_page_numa_parse_nodes);
+}
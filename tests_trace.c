@@ -0,0 +1,297 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "greatest.h"
+
+#include "hash.h"
+#include "trace.h"
+#include "vlog.h"
+#include "tests_util.h"
+
+
+/* trace tests */
+
+/* Runs a fixed mix of operations against tree. */
+static void test_trace_workload(btree_t *tree)
+{
+    char key[4], end[4], *data;
+    for (int i = 0; i < 3000; i++) {
+        test_key((i * 7919) % 997, key);
+        if (i % 4 == 3) {
+            btree_delete(tree, key);
+        } else if (i % 4 == 2) {
+            btree_search(tree, key, &data);
+        } else if (i % 100 == 1) {
+            test_key(500, end);
+            btree_count_range(tree, key, end);
+        } else {
+            btree_insert(tree, key, (char*)&i);
+        }
+    }
+}
+
+
+TEST test_trace_replay__same_result(void)
+{
+    // Replaying a full trace into a fresh tree rebuilds the same contents and
+    // sees the same number of search hits.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "trace");
+    page_pool_t *pool = page_pool_init(1000);
+    btree_t *traced = btree_allocate(pool, 4, sizeof(int));
+    btree_t *fresh = btree_allocate(pool, 4, sizeof(int));
+    trace_stats_t stats;
+    char key[4], *expected, *data;
+
+    ASSERT_EQ(btree_trace_start(traced, path, 1), 0);
+    ASSERT_EQ(btree_trace_start(traced, path, 1), -1);
+    test_trace_workload(traced);
+    ASSERT_EQ(traced->trace->recorded, 3000);
+    ASSERT_EQ(btree_trace_stop(traced), 0);
+
+    trace_ops_t *ops = trace_load(path);
+    ASSERT(ops != NULL);
+    ASSERT_EQ(ops->num_ops, 3000);
+    ASSERT_EQ(trace_replay(ops, fresh, 1, &stats), 0);
+    ASSERT_EQ(stats.ops[TRACE_INSERT] + stats.ops[TRACE_SEARCH] + stats.ops[TRACE_DELETE]
+              + stats.ops[TRACE_SCAN], 3000);
+    ASSERT_EQ(stats.ops[TRACE_SEARCH], 750);
+    ASSERT(stats.ops[TRACE_SCAN] > 0);
+    ASSERT(stats.hits[TRACE_SEARCH] > 0);
+    ASSERT_EQ(stats.latency[TRACE_SEARCH].count, 750);
+    ASSERT(histogram_percentile(&stats.latency[TRACE_INSERT], 0.5)
+           <= histogram_percentile(&stats.latency[TRACE_INSERT], 0.999));
+    ASSERT_EQ(histogram_percentile(&stats.latency[TRACE_SCAN], 2.0), stats.latency[TRACE_SCAN].max);
+
+    ASSERT_EQ(fresh->num_keys, traced->num_keys);
+    for (unsigned int k = 0; k < 1000; k++) {
+        test_key(k, key);
+        btree_search(traced, key, &expected);
+        btree_search(fresh, key, &data);
+        ASSERT_EQ(data == NULL, expected == NULL);
+        if (data != NULL)
+            ASSERT_EQ(memcmp(expected, data, sizeof(int)), 0);
+    }
+
+    trace_ops_free(ops);
+    btree_free(traced);
+    btree_free(fresh);
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+TEST test_trace_record__sampled_by_key(void)
+{
+    // With sampling, only keys whose hash the sample divides are recorded,
+    // and each of those has every one of its operations in the trace.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "trace");
+    page_pool_t *pool = page_pool_init(1000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+
+    ASSERT_EQ(btree_trace_start(btree, path, 8), 0);
+    test_trace_workload(btree);
+    ASSERT_EQ(btree_trace_stop(btree), 0);
+
+    trace_ops_t *ops = trace_load(path);
+    ASSERT(ops != NULL);
+    ASSERT_EQ(ops->sample, 8);
+    ASSERT(ops->num_ops > 3000 / 8 / 3);
+    ASSERT(ops->num_ops < 3000 / 8 * 3);
+    size_t expected = 0;
+    for (int i = 0; i < 3000; i++) {
+        char key[4];
+        test_key((i * 7919) % 997, key);
+        if (hash_bytes(key, 4) % 8 == 0)
+            expected++;
+    }
+    ASSERT_EQ(ops->num_ops, expected);
+    for (size_t i = 0; i < ops->num_ops; i++)
+        ASSERT_EQ(hash_bytes(ops->records + i * ops->slot_size + 1, 4) % 8, 0);
+
+    trace_ops_free(ops);
+    btree_free(btree);
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+TEST test_trace_replay__threads(void)
+{
+    // Several replay threads share a tree and together run every operation.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "trace");
+    page_pool_t *pool = page_pool_init(2000);
+    btree_t *traced = btree_allocate(pool, 4, sizeof(int));
+    btree_t *fresh = btree_allocate(pool, 4, sizeof(int));
+    trace_stats_t stats;
+
+    ASSERT_EQ(btree_trace_start(traced, path, 1), 0);
+    test_trace_workload(traced);
+    ASSERT_EQ(btree_trace_stop(traced), 0);
+
+    trace_ops_t *ops = trace_load(path);
+    ASSERT_EQ(trace_replay(ops, fresh, 4, &stats), 0);
+    ASSERT_EQ(stats.ops[TRACE_INSERT] + stats.ops[TRACE_SEARCH] + stats.ops[TRACE_DELETE]
+              + stats.ops[TRACE_SCAN], ops->num_ops);
+    ASSERT(stats.seconds > 0);
+
+    trace_ops_free(ops);
+    btree_free(traced);
+    btree_free(fresh);
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+static void* test_trace_writer(void *arg)
+{
+    btree_t *tree = (btree_t*)arg;
+    char key[4];
+    for (unsigned int k = 0; k < 2000; k++) {
+        test_key(k * 2 + 1, key);
+        btree_insert(tree, key, (char*)&k);
+    }
+    return NULL;
+}
+
+TEST test_trace_record__concurrent(void)
+{
+    // Threads sharing a tree that defers splits record whole operations,
+    // never parts of two at once.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "trace");
+    page_pool_t *pool = page_pool_init(2000);
+    btree_t *btree = btree_allocate(pool, 4, sizeof(int));
+    pthread_t id;
+    char key[4];
+
+    ASSERT_EQ(btree_deferred_start(btree), 0);
+    ASSERT_EQ(btree_trace_start(btree, path, 1), 0);
+    ASSERT_EQ(pthread_create(&id, NULL, test_trace_writer, btree), 0);
+    for (unsigned int k = 0; k < 2000; k++) {
+        test_key(k * 2, key);
+        btree_insert(btree, key, (char*)&k);
+    }
+    pthread_join(id, NULL);
+    ASSERT_EQ(btree_trace_stop(btree), 0);
+    ASSERT_EQ(btree_deferred_stop(btree), 0);
+
+    trace_ops_t *ops = trace_load(path);
+    ASSERT(ops != NULL);
+    ASSERT_EQ(ops->num_ops, 4000);
+    for (size_t i = 0; i < ops->num_ops; i++) {
+        char *record = ops->records + i * ops->slot_size;
+        unsigned int k = ((unsigned char)record[3] << 8) | (unsigned char)record[4];
+        unsigned int value;
+        memcpy(&value, record + 5, sizeof(value));
+        ASSERT_EQ(record[0], TRACE_INSERT);
+        ASSERT_EQ(value, k / 2);
+    }
+
+    trace_ops_free(ops);
+    btree_free(btree);
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+TEST test_trace_record__public_only(void)
+{
+    // Value log collection looks up every record's key, but those lookups
+    // are neither traced nor timed as searches.
+    char path[TEST_PATH_SIZE], log_path[TEST_PATH_SIZE];
+    test_temp_path(path, "trace");
+    test_temp_path(log_path, "trace");
+    vlog_t *vlog = vlog_open(log_path);
+    page_pool_t *pool = page_pool_init(100);
+    btree_t *btree = btree_allocate_separated(pool, vlog, 4, 64, 0);
+    histogram_t *histograms = (histogram_t*)malloc(LATENCY_OPS * sizeof(histogram_t));
+    char key[4], value[64], *data;
+
+    ASSERT_EQ(btree_trace_start(btree, path, 1), 0);
+    for (unsigned int i = 0; i < 400; i++) {
+        test_key(i % 100, key);
+        memset(value, i, sizeof(value));
+        btree_insert(btree, key, value);
+    }
+    btree_search(btree, key, &data);
+    latency_reset();
+    latency_enable(1);
+    ASSERT_EQ(btree_value_log_gc(btree, vlog->head), 0);
+    latency_enable(0);
+    latency_collect(histograms);
+    ASSERT_EQ(histograms[LATENCY_SEARCH].count, 0);
+    ASSERT_EQ(btree->trace->recorded, 401);
+    ASSERT_EQ(btree_trace_stop(btree), 0);
+    ASSERT_EQ(btree_search_value(btree, key, value), 0);
+    ASSERT_EQ(value[0], (char)399);
+
+    free(histograms);
+    btree_free(btree);
+    page_pool_free(pool);
+    vlog_free(vlog);
+    unlink(path);
+    unlink(log_path);
+
+    PASS();
+}
+
+
+TEST test_trace_load__bad_files(void)
+{
+    // Files that are not traces are rejected, a torn last record is dropped,
+    // and traces only replay into trees of the same sizes.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "trace");
+    page_pool_t *pool = page_pool_init(10);
+    btree_t *wide = btree_allocate(pool, 8, sizeof(int));
+    trace_stats_t stats;
+    char key[4] = {0};
+    int value = 1;
+
+    ASSERT_EQ(trace_load(path), NULL);
+    ASSERT_EQ(trace_open(path, 4, 4, 0), NULL);
+
+    trace_t *trace = trace_open(path, 4, sizeof(int), 1);
+    trace_record(trace, TRACE_INSERT, key, (char*)&value);
+    trace_record(trace, TRACE_SEARCH, key, NULL);
+    ASSERT_EQ(trace_close(trace), 0);
+    trace_ops_t *ops = trace_load(path);
+    ASSERT_EQ(ops->num_ops, 2);
+    ASSERT_EQ(trace_replay(ops, wide, 1, &stats), -1);
+    trace_ops_free(ops);
+
+    ASSERT_EQ(truncate(path, sizeof(trace_header_t) + 1 + 4 + sizeof(int) + 2), 0);
+    ops = trace_load(path);
+    ASSERT_EQ(ops->num_ops, 1);
+    trace_ops_free(ops);
+
+    btree_free(wide);
+    page_pool_free(pool);
+    unlink(path);
+
+    PASS();
+}
+
+
+GREATEST_SUITE(trace_suite)
+{
+    RUN_TEST(test_trace_replay__same_result);
+    RUN_TEST(test_trace_record__sampled_by_key);
+    RUN_TEST(test_trace_replay__threads);
+    RUN_TEST(test_trace_record__concurrent);
+    RUN_TEST(test_trace_record__public_only);
+    RUN_TEST(test_trace_load__bad_files);
+}
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "tests_util.h"
+
+
+/* Helpers shared by the test suites */
+
+void test_key(unsigned int k, char key[4])
+{
+    key[0] = k >> 24;
+    key[1] = k >> 16;
+    key[2] = k >> 8;
+    key[3] = k;
+}
+
+void test_temp_path(char path[TEST_PATH_SIZE], const char *name)
+{
+    snprintf(path, TEST_PATH_SIZE, "/tmp/cql_%s_XXXXXX", name);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        path[0] = '\0';
+        return;
+    }
+    close(fd);
+}
@@ -0,0 +1,13 @@
+#ifndef TESTS_UTIL_H
+#define TESTS_UTIL_H
+
+// Room for any path test_temp_path makes.
+#define TEST_PATH_SIZE 64
+
+// Writes k big endian into a 4-byte key, so memcmp order is numeric order.
+void test_key(unsigned int k, char key[4]);
+// Creates an empty file /tmp/cql_<name>_XXXXXX and writes its name into
+// path, or an empty string if it cannot be created.
+void test_temp_path(char path[TEST_PATH_SIZE], const char *name);
+
+#endif
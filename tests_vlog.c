@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "greatest.h"
+
+#include "vlog.h"
+#include "tests_util.h"
+
+
+/* vlog tests */
+
+TEST test_vlog_append__read_back()
+{
+    // Records go one after the other after the header, and each handle
+    // reads back its value.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "vlog");
+    vlog_t *vlog = vlog_open(path);
+    ASSERT(vlog != NULL);
+    ASSERT_EQ(vlog->head, VLOG_BLOCK_SIZE);
+    ASSERT_EQ(vlog->tail, VLOG_BLOCK_SIZE);
+
+    char value[100];
+    vlog_handle_t handles[10];
+    for (int i = 0; i < 10; i++) {
+        memset(value, i, sizeof(value));
+        ASSERT_EQ(vlog_append(vlog, "key", 3, value, sizeof(value), &handles[i]), 0);
+        ASSERT_EQ(handles[i].offset, VLOG_BLOCK_SIZE + i * 103);
+        ASSERT_EQ(handles[i].length, sizeof(value));
+    }
+    for (int i = 9; i >= 0; i--) {
+        ASSERT_EQ(vlog_read(vlog, &handles[i], 3, value), 0);
+        ASSERT_EQ(value[0], i);
+        ASSERT_EQ(value[99], i);
+    }
+    char record[103];
+    ASSERT_EQ(vlog_read_record(vlog, handles[4].offset, record, sizeof(record)), 0);
+    ASSERT_EQ(memcmp(record, "key", 3), 0);
+    ASSERT_EQ(record[3], 4);
+
+    // Reopening finds the end of the log again.
+    vlog_free(vlog);
+    vlog = vlog_open(path);
+    ASSERT_EQ(vlog->head, VLOG_BLOCK_SIZE + 1030);
+    vlog_free(vlog);
+
+    // Files that are not value logs are refused.
+    FILE *file = fopen(path, "wb");
+    fputs("not a value log", file);
+    fclose(file);
+    ASSERT_EQ(vlog_open(path), NULL);
+
+    unlink(path);
+    PASS();
+}
+
+
+TEST test_vlog_trim__releases_blocks()
+{
+    // Trimmed records stop taking up disk space, later ones stay intact,
+    // and a reopened log starts from the same tail.
+    char path[TEST_PATH_SIZE];
+    test_temp_path(path, "vlog");
+    vlog_t *vlog = vlog_open(path);
+
+    char value[1000];
+    vlog_handle_t handle;
+    for (int i = 0; i < 100; i++) {
+        memset(value, i, sizeof(value));
+        ASSERT_EQ(vlog_append(vlog, "k", 1, value, sizeof(value), &handle), 0);
+    }
+    ASSERT_EQ(vlog_sync(vlog), 0);
+    struct stat before, after;
+    fstat(vlog->fd, &before);
+
+    ASSERT_EQ(vlog_trim(vlog, VLOG_BLOCK_SIZE + 99 * 1001), 0);
+    ASSERT_EQ(vlog->tail, VLOG_BLOCK_SIZE + 99 * 1001);
+    vlog_free(vlog);
+    vlog = vlog_open(path);
+    ASSERT_EQ(vlog->tail, VLOG_BLOCK_SIZE + 99 * 1001);
+    fstat(vlog->fd, &after);
+    ASSERT_EQ(after.st_size, before.st_size);
+    // Not every file system can punch holes.
+    if (after.st_blocks >= before.st_blocks)
+        SKIPm("file system kept the trimmed blocks");
+    ASSERT_EQ(vlog_read(vlog, &handle, 1, value), 0);
+    ASSERT_EQ(value[0], 99);
+
+    vlog_free(vlog);
+    unlink(path);
+    PASS();
+}
+
+
+GREATEST_SUITE(vlog_suite)
+{
+    RUN_TEST(test_vlog_append__read_back);
+    RUN_TEST(test_vlog_trim__releases_blocks);
+}
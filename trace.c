@@ -0,0 +1,315 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+#include "trace.h"
+
+
+/* Operation traces.
+ *
+ * A traced tree appends one record per operation to a buffered file. Sampling
+ * goes by key rather than by operation, so a sampled key's inserts, searches
+ * and deletes all make it into the trace and replay sees the same hits and
+ * misses it did. Replay reads the whole trace into fixed-size slots first so
+ * that file reads are not part of the measured latencies. */
+
+trace_t* trace_open(const char *path, size_t key_size, size_t data_size, uint64_t sample)
+{
+    if (sample == 0) {
+        printf("Cannot open trace with sample 0\n");
+        return NULL;
+    }
+    trace_t *trace = (trace_t*)malloc(sizeof(trace_t));
+    if (trace == NULL) {
+        printf("Failed to allocate trace_t\n");
+        return NULL;
+    }
+    trace->file = fopen(path, "wb");
+    if (trace->file == NULL) {
+        printf("Cannot open trace file %s\n", path);
+        free(trace);
+        return NULL;
+    }
+    trace->key_size = key_size;
+    trace->data_size = data_size;
+    trace->sample = sample;
+    trace->recorded = 0;
+    trace->failed = 0;
+
+    trace_header_t header = {TRACE_MAGIC, key_size, data_size, sample};
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+        printf("Failed to write trace header to %s\n", path);
+        fclose(trace->file);
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+static size_t trace_extra_size(trace_op_t op, size_t key_size, size_t data_size)
+{
+    if (op == TRACE_INSERT)
+        return data_size;
+    if (op == TRACE_SCAN)
+        return key_size;
+    return 0;
+}
+
+void trace_record(trace_t *trace, trace_op_t op, const char *key, const char *extra)
+{
+    if (trace->sample > 1 && hash_bytes(key, trace->key_size) % trace->sample != 0)
+        return;
+    unsigned char byte = op;
+    size_t extra_size = trace_extra_size(op, trace->key_size, trace->data_size);
+    if (fwrite(&byte, 1, 1, trace->file) != 1
+            || fwrite(key, trace->key_size, 1, trace->file) != 1
+            || (extra_size > 0 && fwrite(extra, extra_size, 1, trace->file) != 1)) {
+        // Say so once; a trace that is missing records is still readable.
+        if (!trace->failed)
+            printf("Failed to write trace record\n");
+        trace->failed = 1;
+        return;
+    }
+    trace->recorded++;
+}
+
+int trace_close(trace_t *trace)
+{
+    if (trace == NULL) {
+        printf("Warning: tried to close NULL trace_t*\n");
+        return -1;
+    }
+    int ret = trace->failed ? -1 : 0;
+    if (fclose(trace->file) != 0) {
+        printf("Failed to close trace file\n");
+        ret = -1;
+    }
+    free(trace);
+    return ret;
+}
+
+
+trace_ops_t* trace_load(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Cannot open trace file %s\n", path);
+        return NULL;
+    }
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC) {
+        printf("File %s is not a trace\n", path);
+        fclose(file);
+        return NULL;
+    }
+    trace_ops_t *ops = (trace_ops_t*)malloc(sizeof(trace_ops_t));
+    if (ops == NULL) {
+        printf("Failed to allocate trace_ops_t\n");
+        fclose(file);
+        return NULL;
+    }
+    ops->key_size = header.key_size;
+    ops->data_size = header.data_size;
+    ops->sample = header.sample;
+    ops->slot_size = 1 + ops->key_size + (ops->data_size > ops->key_size ? ops->data_size : ops->key_size);
+    ops->num_ops = 0;
+    ops->records = NULL;
+
+    size_t capacity = 0;
+    for (;;) {
+        if (ops->num_ops == capacity) {
+            capacity = capacity == 0 ? 1024 : 2 * capacity;
+            char *records = (char*)realloc(ops->records, capacity * ops->slot_size);
+            if (records == NULL) {
+                printf("Failed to allocate %zu trace records\n", capacity);
+                trace_ops_free(ops);
+                fclose(file);
+                return NULL;
+            }
+            ops->records = records;
+        }
+        char *record = ops->records + ops->num_ops * ops->slot_size;
+        if (fread(record, 1, 1, file) != 1)
+            break;
+        if ((unsigned char)record[0] >= TRACE_OPS) {
+            printf("Trace %s has an unknown operation %d\n", path, record[0]);
+            trace_ops_free(ops);
+            fclose(file);
+            return NULL;
+        }
+        size_t size = ops->key_size + trace_extra_size(record[0], ops->key_size, ops->data_size);
+        if (fread(record + 1, size, 1, file) != 1) {
+            // A tracing process that died mid-write leaves a partial record.
+            printf("Warning: trace %s ends in a partial record\n", path);
+            break;
+        }
+        ops->num_ops++;
+    }
+    fclose(file);
+    return ops;
+}
+
+void trace_ops_free(trace_ops_t *ops)
+{
+    if (ops == NULL) {
+        printf("Warning: tried to free NULL trace_ops_t*\n");
+        return;
+    }
+    free(ops->records);
+    free(ops);
+}
+
+
+typedef struct {
+    trace_ops_t *ops;
+    btree_t *tree;
+    pthread_rwlock_t *latch;
+    int shared_reads;
+    size_t first;
+    size_t step;
+    trace_stats_t stats;
+} trace_worker_t;
+
+static uint64_t trace_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void* trace_worker(void *arg)
+{
+    trace_worker_t *worker = (trace_worker_t*)arg;
+    trace_ops_t *ops = worker->ops;
+    btree_t *tree = worker->tree;
+    char value[ops->data_size];
+
+    for (size_t i = worker->first; i < ops->num_ops; i += worker->step) {
+        char *record = ops->records + i * ops->slot_size;
+        trace_op_t op = record[0];
+        char *key = record + 1;
+        char *extra = key + ops->key_size;
+        int hit = 0;
+
+        uint64_t start = trace_now();
+        if (op == TRACE_SEARCH && worker->shared_reads)
+            pthread_rwlock_rdlock(worker->latch);
+        else
+            pthread_rwlock_wrlock(worker->latch);
+        switch (op) {
+        case TRACE_INSERT:
+            btree_insert(tree, key, extra);
+            break;
+        case TRACE_SEARCH:
+            if (tree->vlog != NULL) {
+                hit = btree_search_value(tree, key, value) == 0;
+            } else {
+                char *data;
+                btree_search(tree, key, &data);
+                hit = data != NULL;
+            }
+            break;
+        case TRACE_DELETE:
+            hit = btree_delete(tree, key) == 0;
+            break;
+        default:
+            btree_count_range(tree, key, extra);
+            break;
+        }
+        pthread_rwlock_unlock(worker->latch);
+
+        worker->stats.ops[op]++;
+        worker->stats.hits[op] += hit;
+        histogram_record(&worker->stats.latency[op], trace_now() - start);
+    }
+    return NULL;
+}
+
+int trace_replay(trace_ops_t *ops, btree_t *tree, size_t threads, trace_stats_t *stats)
+{
+    if (ops->key_size != tree->key_size || ops->data_size != tree->value_size) {
+        printf("Cannot replay a trace of %zu byte keys and %zu byte data into this btree\n",
+               ops->key_size, ops->data_size);
+        return -1;
+    }
+    if (threads == 0) {
+        printf("Cannot replay a trace with 0 threads\n");
+        return -1;
+    }
+    trace_worker_t *workers = (trace_worker_t*)calloc(threads, sizeof(trace_worker_t));
+    pthread_t *ids = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    if (workers == NULL || ids == NULL) {
+        printf("Failed to allocate %zu trace replay threads\n", threads);
+        free(workers);
+        free(ids);
+        return -1;
+    }
+
+    // Searches only read pages in an in-memory pool without swizzling, so
+    // they can share the tree; anything else takes it for itself.
+    pthread_rwlock_t latch;
+    pthread_rwlock_init(&latch, NULL);
+    int shared_reads = tree->pool->fd < 0 && !(tree->flags & BTREE_SWIZZLE);
+    for (size_t i = 0; i < threads; i++) {
+        workers[i].ops = ops;
+        workers[i].tree = tree;
+        workers[i].latch = &latch;
+        workers[i].shared_reads = shared_reads;
+        workers[i].first = i;
+        workers[i].step = threads;
+    }
+
+    int ret = 0;
+    size_t started = 0;
+    uint64_t start = trace_now();
+    if (threads == 1) {
+        trace_worker(&workers[0]);
+    } else {
+        for (; started < threads; started++) {
+            if (pthread_create(&ids[started], NULL, trace_worker, &workers[started]) != 0) {
+                printf("Failed to start trace replay thread\n");
+                ret = -1;
+                break;
+            }
+        }
+        for (size_t i = 0; i < started; i++)
+            pthread_join(ids[i], NULL);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->seconds = (trace_now() - start) / 1e9;
+    for (size_t i = 0; i < threads; i++) {
+        for (size_t op = 0; op < TRACE_OPS; op++) {
+            stats->ops[op] += workers[i].stats.ops[op];
+            stats->hits[op] += workers[i].stats.hits[op];
+            histogram_merge(&stats->latency[op], &workers[i].stats.latency[op]);
+        }
+    }
+    pthread_rwlock_destroy(&latch);
+    free(workers);
+    free(ids);
+    return ret;
+}
+
+void trace_stats_print(trace_stats_t *stats, FILE *out)
+{
+    static const char *names[TRACE_OPS] = {"insert", "search", "delete", "scan"};
+    size_t total = 0;
+    for (size_t op = 0; op < TRACE_OPS; op++)
+        total += stats->ops[op];
+    fprintf(out, "%zu ops in %.3f s, %.0f ops/s\n", total, stats->seconds,
+            stats->seconds > 0 ? total / stats->seconds : 0.0);
+    for (size_t op = 0; op < TRACE_OPS; op++) {
+        if (stats->ops[op] == 0)
+            continue;
+        fprintf(out, "%-6s %10zu ops %10zu hits  p50 %llu ns  p99 %llu ns  p99.9 %llu ns  max %llu ns\n",
+                names[op], stats->ops[op], stats->hits[op],
+                (unsigned long long)histogram_percentile(&stats->latency[op], 0.5),
+                (unsigned long long)histogram_percentile(&stats->latency[op], 0.99),
+                (unsigned long long)histogram_percentile(&stats->latency[op], 0.999),
+                (unsigned long long)stats->latency[op].max);
+    }
+}
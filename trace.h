@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "histogram.h"
+#include "index.h"
+
+#define TRACE_MAGIC 0x00314352544c5143ULL // "CQLTRC1" in little endian
+
+typedef enum {
+    TRACE_INSERT,
+    TRACE_SEARCH,
+    TRACE_DELETE,
+    TRACE_SCAN,
+    TRACE_OPS
+} trace_op_t;
+
+// A trace file is this header followed by one record per operation: the op
+// byte, the key, then the data for inserts or the end key for scans. Only
+// keys whose hash is a multiple of sample are recorded, so every operation
+// on a sampled key is kept.
+typedef struct {
+    uint64_t magic;
+    uint64_t key_size;
+    uint64_t data_size;
+    uint64_t sample;
+} trace_header_t;
+
+struct trace {
+    FILE *file;
+    size_t key_size;
+    size_t data_size;
+    uint64_t sample;
+    size_t recorded;
+    int failed;
+};
+
+typedef struct trace trace_t;
+
+// A whole trace read into memory, each record in a slot of slot_size bytes.
+typedef struct {
+    size_t key_size;
+    size_t data_size;
+    uint64_t sample;
+    size_t slot_size;
+    size_t num_ops;
+    char *records;
+} trace_ops_t;
+
+typedef struct {
+    size_t ops[TRACE_OPS];
+    // Searches that found their key and deletes that removed one.
+    size_t hits[TRACE_OPS];
+    // Nanoseconds per operation, including the wait for the replay latch.
+    histogram_t latency[TRACE_OPS];
+    double seconds;
+} trace_stats_t;
+
+trace_t* trace_open(const char *path, size_t key_size, size_t data_size, uint64_t sample);
+// Not safe to call concurrently: a traced tree records each operation while
+// holding its lock, in the order the operations apply.
+void trace_record(trace_t *trace, trace_op_t op, const char *key, const char *extra);
+int trace_close(trace_t *trace);
+trace_ops_t* trace_load(const char *path);
+void trace_ops_free(trace_ops_t *ops);
+// Replays ops against tree, dealing them round-robin to threads that share
+// the tree under a latch. Order is only kept exactly with one thread.
+int trace_replay(trace_ops_t *ops, btree_t *tree, size_t threads, trace_stats_t *stats);
+void trace_stats_print(trace_stats_t *stats, FILE *out);
+
+#endif
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "vlog.h"
+
+
+/* Value log.
+ *
+ * Large values are kept out of the tree and appended here instead, so leaves
+ * only carry a handle. Overwritten and deleted values are left behind as
+ * garbage; the owner reclaims it by re-appending the live records found at
+ * the tail and then trimming the tail, which punches the old records out of
+ * the file. The header block keeps the tail, so that work survives a
+ * reopen. */
+
+vlog_t* vlog_open(const char *path)
+{
+    vlog_t *vlog = (vlog_t*)malloc(sizeof(vlog_t));
+    if (vlog == NULL) {
+        printf("Failed to allocate vlog_t\n");
+        return NULL;
+    }
+    vlog->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (vlog->fd < 0) {
+        printf("Cannot open value log %s: %s\n", path, strerror(errno));
+        free(vlog);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(vlog->fd, &st) != 0) {
+        printf("Cannot stat value log %s: %s\n", path, strerror(errno));
+        close(vlog->fd);
+        free(vlog);
+        return NULL;
+    }
+    vlog_header_t header = {VLOG_MAGIC, VLOG_BLOCK_SIZE};
+    if (st.st_size == 0) {
+        if (pwrite(vlog->fd, &header, sizeof(header), 0) != sizeof(header)
+                || ftruncate(vlog->fd, VLOG_BLOCK_SIZE) != 0) {
+            printf("Failed to write value log header to %s\n", path);
+            close(vlog->fd);
+            free(vlog);
+            return NULL;
+        }
+        st.st_size = VLOG_BLOCK_SIZE;
+    } else if (pread(vlog->fd, &header, sizeof(header), 0) != sizeof(header)
+               || header.magic != VLOG_MAGIC || header.tail > (uint64_t)st.st_size) {
+        printf("File %s is not a value log\n", path);
+        close(vlog->fd);
+        free(vlog);
+        return NULL;
+    }
+    vlog->head = st.st_size;
+    vlog->tail = header.tail;
+    vlog->owner = NULL;
+    return vlog;
+}
+
+int vlog_append(vlog_t *vlog, const char *key, size_t key_size,
+                const char *value, size_t length, vlog_handle_t *handle)
+{
+    struct iovec iov[2] = {
+        {(void*)key, key_size},
+        {(void*)value, length}
+    };
+    ssize_t written = pwritev(vlog->fd, iov, 2, vlog->head);
+    if (written != (ssize_t)(key_size + length)) {
+        printf("Failed to append to value log: %s\n", written < 0 ? strerror(errno) : "short write");
+        return -1;
+    }
+    handle->offset = vlog->head;
+    handle->length = length;
+    vlog->head += written;
+    return 0;
+}
+
+int vlog_read(vlog_t *vlog, const vlog_handle_t *handle, size_t key_size, char *value)
+{
+    ssize_t ret = pread(vlog->fd, value, handle->length, handle->offset + key_size);
+    if (ret != (ssize_t)handle->length) {
+        printf("Failed to read value at %llu from value log\n", (unsigned long long)handle->offset);
+        return -1;
+    }
+    return 0;
+}
+
+int vlog_read_record(vlog_t *vlog, uint64_t offset, char *record, size_t size)
+{
+    if (pread(vlog->fd, record, size, offset) != (ssize_t)size) {
+        printf("Failed to read record at %llu from value log\n", (unsigned long long)offset);
+        return -1;
+    }
+    return 0;
+}
+
+int vlog_sync(vlog_t *vlog)
+{
+    if (fdatasync(vlog->fd) != 0) {
+        printf("Failed to sync value log: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int vlog_trim(vlog_t *vlog, uint64_t tail)
+{
+    if (tail <= vlog->tail)
+        return 0;
+    // Only whole blocks can be released, so round the range to them; the
+    // bytes around it stay allocated until a later trim covers them. A file
+    // system that cannot punch holes just keeps them.
+    uint64_t start = vlog->tail / VLOG_BLOCK_SIZE * VLOG_BLOCK_SIZE;
+    uint64_t end = tail / VLOG_BLOCK_SIZE * VLOG_BLOCK_SIZE;
+    if (end > start && fallocate(vlog->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) != 0
+            && errno != EOPNOTSUPP) {
+        printf("Failed to trim value log: %s\n", strerror(errno));
+        return -1;
+    }
+    vlog->tail = tail;
+    // Losing this only means the next pass looks at the trimmed range again.
+    if (pwrite(vlog->fd, &tail, sizeof(tail), offsetof(vlog_header_t, tail)) != sizeof(tail)) {
+        printf("Failed to record value log tail\n");
+        return -1;
+    }
+    return 0;
+}
+
+void vlog_free(vlog_t *vlog)
+{
+    if (vlog == NULL) {
+        printf("Warning: tried to free NULL vlog_t*\n");
+        return;
+    }
+    close(vlog->fd);
+    free(vlog);
+}
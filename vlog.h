@@ -0,0 +1,50 @@
+#ifndef VLOG_H
+#define VLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Where a value lives in the log. Records are the value's key followed by
+// the value, and offset is the start of the record.
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} vlog_handle_t;
+
+#define VLOG_MAGIC 0x0031474c564c5143ULL // "CQLVLG1" in little endian
+// The header has a block to itself, so trimming never punches it out, and
+// records start after it.
+#define VLOG_BLOCK_SIZE 4096
+
+// Starts the file and keeps the tail, so a reopened log does not collect
+// what it already has.
+typedef struct {
+    uint64_t magic;
+    uint64_t tail;
+} vlog_header_t;
+
+// An append-only file of records. Everything before tail has been garbage
+// collected; head is where the next record goes. A log holds the values of
+// a single tree, its owner: collection takes every record that tree does
+// not point at for garbage.
+struct vlog {
+    int fd;
+    uint64_t head;
+    uint64_t tail;
+    void *owner;
+};
+
+typedef struct vlog vlog_t;
+
+vlog_t* vlog_open(const char *path);
+int vlog_append(vlog_t *vlog, const char *key, size_t key_size,
+                const char *value, size_t length, vlog_handle_t *handle);
+int vlog_read(vlog_t *vlog, const vlog_handle_t *handle, size_t key_size, char *value);
+int vlog_read_record(vlog_t *vlog, uint64_t offset, char *record, size_t size);
+int vlog_sync(vlog_t *vlog);
+// Releases everything before tail. Records that still matter must have been
+// copied past it, durably, first.
+int vlog_trim(vlog_t *vlog, uint64_t tail);
+void vlog_free(vlog_t *vlog);
+
+#endif